@@ -33,20 +33,21 @@
 /* addressing modes */
 enum { _imp, _acc, _rel, _imm, _abs, _abs_x, _abs_y, _zero, _zero_x, _zero_y, _ind, _ind_x, _ind_y };
 
-/* keep a filthy local copy of PC to
+/* keep a filthy local copy of PC and the CPU being traced to
 ** reduce the amount of parameter passing
 */
+static nes6502_context *dis_cpu;
 static uint32 pc_reg;
 
 
 static uint8 dis_op8(void)
 {
-   return (nes6502_getbyte(pc_reg + 1));
+   return (nes6502_getbyte(dis_cpu, pc_reg + 1));
 }
 
 static uint16 dis_op16(void)
 {
-   return (nes6502_getbyte(pc_reg + 1) + (nes6502_getbyte(pc_reg + 2) << 8));
+   return (nes6502_getbyte(dis_cpu, pc_reg + 1) + (nes6502_getbyte(dis_cpu, pc_reg + 2) << 8));
 }
 
 static void dis_show_ind(void)
@@ -115,7 +116,7 @@ static void dis_show_relative(void)
 
 static void dis_show_code(int optype)
 {
-   log_printf("%02X ", nes6502_getbyte(pc_reg));
+   log_printf("%02X ", nes6502_getbyte(dis_cpu, pc_reg));
 
    switch (optype)
    {
@@ -128,7 +129,7 @@ static void dis_show_code(int optype)
    case _imm:
    case _zero:
    case _zero_x:
-      log_printf("%02X    ", nes6502_getbyte(pc_reg + 1));
+      log_printf("%02X    ", nes6502_getbyte(dis_cpu, pc_reg + 1));
       break;
 
    case _abs:
@@ -137,7 +138,7 @@ static void dis_show_code(int optype)
    case _ind:
    case _ind_x:
    case _ind_y:
-      log_printf("%02X %02X ", nes6502_getbyte(pc_reg + 1), nes6502_getbyte(pc_reg + 2));
+      log_printf("%02X %02X ", nes6502_getbyte(dis_cpu, pc_reg + 1), nes6502_getbyte(dis_cpu, pc_reg + 2));
       break;
    }
 }
@@ -164,13 +165,15 @@ static void dis_show_op(char *opstr, int optype)
    }
 }
 
-void nes6502_disasm(uint32 PC, uint8 P, uint8 A, uint8 X, uint8 Y, uint8 S)
+void nes6502_disasm(nes6502_context *cpu, uint32 PC, uint8 P, uint8 A,
+                    uint8 X, uint8 Y, uint8 S)
 {
+   dis_cpu = cpu;
    pc_reg = PC;
 
    log_printf("%04X: ", pc_reg);
 
-   switch(nes6502_getbyte(pc_reg))
+   switch(nes6502_getbyte(dis_cpu, pc_reg))
    {
    case 0x00: dis_show_op("brk",_imp);    break;
    case 0x01: dis_show_op("ora",_ind_x);  break;
@@ -30,7 +30,8 @@
 extern "C" {
 #endif /* __cplusplus */
 
-extern void nes6502_disasm(uint32 PC, uint8 P, uint8 A, uint8 X, uint8 Y, uint8 S);
+extern void nes6502_disasm(nes6502_context *cpu, uint32 PC, uint8 P, uint8 A,
+                           uint8 X, uint8 Y, uint8 S);
 
 #ifdef __cplusplus
 }
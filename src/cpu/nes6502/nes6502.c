@@ -28,6 +28,7 @@
 #include "nes6502.h"
 #include "dis6502.h"
 #include <stdio.h>
+#include <string.h>
 
 
 #define  ADD_CYCLES(x)     instruction_cycles += (x)
@@ -35,6 +36,128 @@
 //#define  ADD_CYCLES(x)  remaining_cycles -= (x)
 //#define  INC_CYCLES()   remaining_cycles--
 
+/* computed-goto dispatch needs GCC's labels-as-values */
+#if defined(NES6502_JUMPTABLE) && !defined(__GNUC__)
+#undef NES6502_JUMPTABLE
+#endif
+
+/*
+** Opcode handler framing.  With NES6502_JUMPTABLE every handler ends by
+** doing its own cycle bookkeeping, fetching the next opcode and jumping
+** straight to its handler, so each handler gets its own indirect branch
+** (and branch predictor history) instead of all sharing the one at the
+** top of the switch.  Anything the loop head has to look at -- cycles
+** running out, DMA, pending interrupts -- drops back to the loop head.
+*/
+#ifdef NES6502_JUMPTABLE
+#define  OPCODE_BEGIN(xx)  op##xx:
+#define  OPCODE_END \
+{ \
+   remaining_cycles -= instruction_cycles; \
+   cpu->total_cycles += instruction_cycles; \
+   if (remaining_cycles <= 0 || cpu->dma_cycles || cpu->int_pending) \
+      continue; \
+   instruction_cycles = 0; \
+   opcode = bank_readbyte_pc(PC++); \
+   goto *opcode_table[opcode]; \
+}
+#else /* !NES6502_JUMPTABLE */
+#define  OPCODE_BEGIN(xx)  case 0x##xx:
+#define  OPCODE_END        break;
+#endif /* !NES6502_JUMPTABLE */
+
+#ifdef NES6502_IDLE_SKIP
+
+/*
+** Idle loops.  Memory and the APU only change when the CPU writes to
+** them, and interrupts only arrive from outside nes6502_execute, so if a
+** backward jump lands where the last one did with the same registers,
+** and nothing was written (or read from a register with side effects) in
+** between, every further pass is the same: burn whole passes up to the
+** end of the budget, leaving the last partial pass to run as usual.
+*/
+#define IDLE_CHECK() \
+{ \
+   uint32 idle_now = cpu->total_cycles + instruction_cycles; \
+   if (PC == idle_pc && cpu->idle_ok && A == idle_a && X == idle_x \
+       && Y == idle_y && P == idle_p && S == idle_s) \
+   { \
+      int idle_pass = idle_now - idle_cycles; \
+      int idle_left = remaining_cycles - instruction_cycles; \
+      if (idle_left > idle_pass) \
+      { \
+         idle_left = (idle_left - 1) / idle_pass * idle_pass; \
+         ADD_CYCLES(idle_left); \
+         idle_now += idle_left; \
+      } \
+   } \
+   else \
+   { \
+      idle_pc = PC; \
+      idle_a = A; \
+      idle_x = X; \
+      idle_y = Y; \
+      idle_p = P; \
+      idle_s = S; \
+   } \
+   idle_cycles = idle_now; \
+   cpu->idle_ok = 1; \
+}
+
+/*
+** Delay loops: "DEX / BNE *-1" and friends.  Run as many whole passes as
+** the counter and the budget allow in one go; the final pass (and any
+** pass the budget would cut short) is left to the interpreter.
+*/
+#define IDLE_COUNTDOWN() \
+{ \
+   uint8 idle_op = cpu->mem_page[PC >> NES6502_BANKSHIFT][PC & NES6502_BANKMASK]; \
+   int idle_pass = instruction_cycles + 2; \
+   int idle_left = remaining_cycles - instruction_cycles; \
+   int idle_n = 0; \
+   if (0xCA == idle_op) \
+      idle_n = X - 1; \
+   else if (0x88 == idle_op) \
+      idle_n = Y - 1; \
+   else if (0xE8 == idle_op) \
+      idle_n = 0xFF - X; \
+   else if (0xC8 == idle_op) \
+      idle_n = 0xFF - Y; \
+   if (idle_n > 0 && idle_left > idle_pass) \
+   { \
+      if (idle_n > (idle_left - 1) / idle_pass) \
+         idle_n = (idle_left - 1) / idle_pass; \
+      if (0xCA == idle_op) \
+         data = X -= idle_n; \
+      else if (0x88 == idle_op) \
+         data = Y -= idle_n; \
+      else if (0xE8 == idle_op) \
+         data = X += idle_n; \
+      else \
+         data = Y += idle_n; \
+      SET_NZ_FLAGS(data); \
+      ADD_CYCLES(idle_n * idle_pass); \
+   } \
+}
+
+#define IDLE_BRANCH() \
+{ \
+   if (0xFD == btemp && 0xD0 == opcode) \
+      IDLE_COUNTDOWN() \
+   else \
+      IDLE_CHECK(); \
+}
+
+#define IDLE_WRITE()    cpu->idle_ok = 0
+
+#else /* !NES6502_IDLE_SKIP */
+
+#define IDLE_CHECK()
+#define IDLE_BRANCH()
+#define IDLE_WRITE()
+
+#endif /* !NES6502_IDLE_SKIP */
+
 /*
 ** Check to see if an index reg addition overflowed to next page
 */
@@ -172,6 +295,8 @@
       else \
          ADD_CYCLES(3); \
       PC += ((int8) btemp); \
+      if ((int8) btemp < 0) \
+         IDLE_BRANCH(); \
    } \
    else \
    { \
@@ -242,7 +367,7 @@
    PUSH(P); \
    SET_FLAG(I_FLAG); \
    JUMP(NMI_VECTOR); \
-   int_pending &= ~NMI_MASK; \
+   cpu->int_pending &= ~NMI_MASK; \
    ADD_CYCLES(INT_CYCLES); \
 }
 
@@ -254,7 +379,7 @@
    PUSH(P); \
    SET_FLAG(I_FLAG); \
    JUMP(IRQ_VECTOR); \
-   int_pending &= ~IRQ_MASK; \
+   cpu->int_pending &= ~IRQ_MASK; \
    ADD_CYCLES(INT_CYCLES); \
 }
 
@@ -636,8 +761,11 @@
 
 #define JMP_ABSOLUTE() \
 { \
+   temp = PC; \
    JUMP(PC); \
    ADD_CYCLES(3); \
+   if (PC < temp) \
+      IDLE_CHECK(); \
 }
 
 #define JSR() \
@@ -1117,17 +1245,16 @@
 */
 
 /* register push/pull */
-#ifdef NES6502_MEM_ACCESS_CTRL
-
-# define  PUSH(value)             stack_push((S--),(value))
-# define  PULL()                  stack_pull((++S))
-
-#else
-
-# define  PUSH(value)             stack_page[S--] = (uint8) (value)
-# define  PULL()                  stack_page[++S]
-
-#endif /* #ifdef NES6502_MEM_ACCESS_CTRL */
+#define  PUSH(value) \
+{ \
+   chk_mem_access(acc_ram, STACK_OFFSET + S, NES6502_WRITE_ACCESS); \
+   IDLE_WRITE(); \
+   stack_page[S--] = (uint8) (value); \
+}
+#define  PULL() \
+   (chk_mem_access(acc_ram, STACK_OFFSET + (uint8) (S + 1), \
+                   NES6502_READ_ACCESS), \
+    stack_page[++S])
 
 /* Sets the Z and N flags based on given data, taken from precomputed table */
 #define  SET_NZ_FLAGS(value)     P &= ~(N_FLAG | Z_FLAG); \
@@ -1135,161 +1262,91 @@
 
 #define  GET_GLOBAL_REGS() \
 { \
-   PC = reg_PC; \
-   A = reg_A; \
-   X = reg_X; \
-   Y = reg_Y; \
-   P = reg_P; \
-   S = reg_S; \
+   PC = cpu->pc_reg; \
+   A = cpu->a_reg; \
+   X = cpu->x_reg; \
+   Y = cpu->y_reg; \
+   P = cpu->p_reg; \
+   S = cpu->s_reg; \
 }
 
 #define SET_LOCAL_REGS() \
 { \
-   reg_PC = PC; \
-   reg_A = A; \
-   reg_X = X; \
-   reg_Y = Y; \
-   reg_P = P; \
-   reg_S = S; \
+   cpu->pc_reg = PC; \
+   cpu->a_reg = A; \
+   cpu->x_reg = X; \
+   cpu->y_reg = Y; \
+   cpu->p_reg = P; \
+   cpu->s_reg = S; \
 }
 
 
 /* static data */
-static nes6502_memread *pmem_read, *pmr;
-static nes6502_memwrite *pmem_write, *pmw;
 
-/* lookup table for N/Z flags */
+/* lookup table for N/Z flags, shared by every CPU instance */
 static uint8 flag_table[256];
 
-/* internal critical CPU vars */
-static uint32 reg_PC;
-static uint8 reg_A, reg_P, reg_X, reg_Y, reg_S;
-static uint8 int_pending;
-static int dma_cycles;
-
-/* execution cycle count (can be reset by user) */
-static uint32 total_cycles = 0;
-
-/* memory region pointers */
-static uint8 *nes6502_banks[NES6502_NUMBANKS];
-static uint8 *ram = NULL;
-static uint8 *stack_page = NULL;
-
 /* access flag for memory 
  * $$$ ben : I add this for the playing time calculation.
- * Only if compiled with NES6502_MEM_ACCESS.
+ * Only done by the tracking copy of the core, see below.
  */
-#ifdef NES6502_MEM_ACCESS_CTRL
-
-uint8 *acc_nes6502_banks[NES6502_NUMBANKS];
-static uint8 *acc_ram = NULL;
-static uint8 *acc_stack_page = NULL;
-uint8 nes6502_mem_access = 0;
 
 /* $$$ ben :
  * Set memory access check flags, and store ORed frame global check
  * for music time calculation.
  */
-static void chk_mem_access(uint8 * access, int flags)
+INLINE void _chk_mem_access(nes6502_context *cpu, nes6502_accmap *map,
+                            uint32 offset, int flags)
 {
-  uint8 oldchk = * access;
-  if ((oldchk&flags) != flags) {
-    nes6502_mem_access |= flags;
-    *access = oldchk|flags;
+  uint32 *word, bit;
+
+  /* bank windows can hang off either end of the data */
+  if (offset >= map->size)
+    return;
+
+  /* flags is a single access kind: 1, 2 or 4 picks plane 0, 1 or 2 */
+  word = map->bits + (flags >> 1) * map->words + (offset >> 5);
+  bit = 1 << (offset & 31);
+  if (!(*word & bit)) {
+    *word |= bit;
+    map->dirty[offset >> 13] |= 1 << ((offset >> 8) & 31);
+    cpu->mem_access |= flags;
   }
 }
 
-INLINE void stack_push(uint8 s, uint8 v)
-{
-  chk_mem_access(acc_stack_page+s, NES6502_WRITE_ACCESS);
-  stack_page[s] = v;
-}
-
-INLINE uint8 stack_pull(uint8 s)
-{ 
-  chk_mem_access(acc_stack_page+s, NES6502_READ_ACCESS);
-  return stack_page[s];
-}
-
-INLINE uint8 zp_read(register uint32 addr)
-{
-  chk_mem_access(acc_ram+addr, NES6502_READ_ACCESS);
-  return ram[addr];
-}
-
-INLINE void zp_write(register uint32 addr, uint8 v)
-{
-  chk_mem_access(acc_ram+addr, NES6502_WRITE_ACCESS);
-  ram[addr] = v;
-}
-
-#define  ZP_READ(addr)           zp_read((addr))
-#define  ZP_WRITE(addr, value)   zp_write((addr),(value))
-
-#define bank_readbyte(address) _bank_readbyte((address), NES6502_READ_ACCESS)
-#define bank_readbyte_pc(address) _bank_readbyte((address), NES6502_EXE_ACCESS)
-
-#else
-# define chk_mem_access(access, flags)
+/*
+** The memory helpers and nes6502_execute() are built twice from
+** nes6502_exec.h, see the bottom of this file.  NES6502_TRACK is a
+** constant in each copy, so the lean one has the access checks compiled
+** right out and playback pays nothing for them.
+*/
+#define  chk_mem_access(map, offset, flags) \
+   (NES6502_TRACK ? _chk_mem_access(cpu, (map), (offset), (flags)) : (void) 0)
 
 /*
 ** Zero-page helper macros
 */
-#define  ZP_READ(addr)           ram[(addr)]
-#define  ZP_WRITE(addr, value)   ram[(addr)] = (uint8) (value)
-
-#define bank_readbyte(address)    _bank_readbyte((address))
-#define bank_readbyte_pc(address) _bank_readbyte((address))
-
-#endif /* #ifdef NES6502_MEM_ACCESS_CTRL */
-
-#ifdef NES6502_MEM_ACCESS_CTRL
-int max_access[NES6502_NUMBANKS] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-
-INLINE uint8 _bank_readbyte(register uint32 address, const uint8 flags)
-#else
-INLINE uint8 _bank_readbyte(register uint32 address)
-#endif
-{
-   ASSERT(nes6502_banks[address >> NES6502_BANKSHIFT]);
-
-#ifdef NES6502_MEM_ACCESS_CTRL
-   //printf("chk_mem_access(acc_nes6502_banks[%d] + %d, %d)\n", address>>NES6502_BANKSHIFT, address & NES6502_BANKMASK, flags);
-
-   if((address & NES6502_BANKMASK) > max_access[address>>NES6502_BANKSHIFT])
-   {
-      max_access[address>>NES6502_BANKSHIFT] = address & NES6502_BANKMASK;
-      //printf("max_access[%d] increased to %d\n", address>>NES6502_BANKSHIFT, max_access[address>>NES6502_BANKSHIFT]);
-   }
-#endif
-   chk_mem_access(acc_nes6502_banks[address>>NES6502_BANKSHIFT]
-		  + (address & NES6502_BANKMASK),
-		  flags);
-
-   return nes6502_banks[address >> NES6502_BANKSHIFT][address & NES6502_BANKMASK];
-}
-
-
-INLINE void bank_writebyte(register uint32 address, register uint8 value)
-{
-   ASSERT(nes6502_banks[address >> NES6502_BANKSHIFT]);
-
-#ifdef NES6502_MEM_ACCESS_CTRL
-   //printf("chk_mem_access(acc_nes6502_banks[%d] + %d, %d)\n", address>>NES6502_BANKSHIFT, address & NES6502_BANKMASK, NES6502_WRITE_ACCESS);
-
-   if((address & NES6502_BANKMASK) > max_access[address>>NES6502_BANKSHIFT])
-   {
-      max_access[address>>NES6502_BANKSHIFT] = address & NES6502_BANKMASK;
-      //printf("max_access[%d] increased to %d\n", address>>NES6502_BANKSHIFT, max_access[address>>NES6502_BANKSHIFT]);
-   }
-#endif
-
-   chk_mem_access(acc_nes6502_banks[address>>NES6502_BANKSHIFT]
-		  + (address & NES6502_BANKMASK),
-		  NES6502_WRITE_ACCESS);
-
-   nes6502_banks[address >> NES6502_BANKSHIFT][address & NES6502_BANKMASK] = value;
-}
+#define  ZP_READ(addr) \
+   (chk_mem_access(acc_ram, (addr), NES6502_READ_ACCESS), ram[(addr)])
+#define  ZP_WRITE(addr, value) \
+{ \
+   chk_mem_access(acc_ram, (addr), NES6502_WRITE_ACCESS); \
+   IDLE_WRITE(); \
+   ram[(addr)] = (uint8) (value); \
+}
+
+#define bank_readbyte(address) \
+   NES6502_EXEC(_bank_readbyte)(cpu, (address), NES6502_READ_ACCESS)
+#define bank_readbyte_pc(address) \
+   NES6502_EXEC(_bank_readbyte)(cpu, (address), NES6502_EXE_ACCESS)
+#define bank_readaddress(address) \
+   NES6502_EXEC(_bank_readaddress)(cpu, (address))
+#define zp_address(address) \
+   NES6502_EXEC(_zp_address)(cpu, ram, (address))
+#define mem_read(address) \
+   NES6502_EXEC(_mem_read)(cpu, (address))
+#define mem_write(address, value) \
+   NES6502_EXEC(_mem_write)(cpu, (address), (value))
 
 /* Read a 16bit word */
 #define READ_SNES_16(bank,offset) \
@@ -1298,186 +1355,76 @@ INLINE void bank_writebyte(register uint32 address, register uint8 value)
    ((unsigned int)( ((offset)+1) [ (uint8 *) (bank) ] ) << 8)\
 )
 
-INLINE uint32 zp_address(register uint8 address)
+/* the lean copy, for playback */
+#define  NES6502_TRACK    0
+#define  NES6502_EXEC(name) name##_lean
+#include "nes6502_exec.h"
+#undef   NES6502_TRACK
+#undef   NES6502_EXEC
+
+/* the copy that keeps the access map up to date */
+#define  NES6502_TRACK    1
+#define  NES6502_EXEC(name) name##_track
+#include "nes6502_exec.h"
+#undef   NES6502_TRACK
+#undef   NES6502_EXEC
+
+/* DMA a byte of data from ROM */
+uint8 nes6502_getbyte(nes6502_context *cpu, uint32 address)
 {
-  chk_mem_access(acc_ram+address, NES6502_READ_ACCESS);
-  chk_mem_access(acc_ram+address+1, NES6502_READ_ACCESS);
-
-#if defined (HOST_LITTLE_ENDIAN) && defined(HOST_UNALIGN_WORD)
-   /* TODO: this fails if src address is $xFFF */
-   /* TODO: this fails if host architecture doesn't support byte alignment */
-   /*       $$$ ben : DONE */
-   return (uint32) (*(uint16 *)(ram + address));
-#elif defined(TARGET_CPU_PPC)
-   return __lhbrx(ram, address);
-#else
-   return READ_SNES_16(ram,address);
-/*    uint32 x = (uint32) *(uint16 *)(ram + address); */
-/*    return (x << 8) | (x >> 8); */
-//#endif /* TARGET_CPU_PPC */
-#endif /* HOST_LITTLE_ENDIAN */
+   if (cpu->track_access)
+      return _bank_readbyte_track(cpu, address, NES6502_READ_ACCESS);
+   return _bank_readbyte_lean(cpu, address, NES6502_READ_ACCESS);
 }
 
-INLINE uint32 bank_readaddress(register uint32 address)
+/* Point each 6502 page at the first handler whose range touches it, so
+** the common case -- a page wholly owned by one handler, or by none --
+** costs a single lookup instead of a walk down the whole list.
+*/
+void nes6502_sethandlers(nes6502_context *cpu, nes6502_memread *read_handler,
+                         nes6502_memwrite *write_handler)
 {
+   nes6502_memread *pmr;
+   nes6502_memwrite *pmw;
+   uint32 page, first, last;
 
-#ifdef NES6502_MEM_ACCESS_CTRL
-  {
-    const unsigned int offset = address & NES6502_BANKMASK;
-    uint8 * addr = acc_nes6502_banks[address >> NES6502_BANKSHIFT];
-    chk_mem_access(addr+offset+0, NES6502_READ_ACCESS);
-    chk_mem_access(addr+offset+1, NES6502_READ_ACCESS);
-  }
-#endif
+   cpu->read_handler = read_handler;
+   cpu->write_handler = write_handler;
 
-#if defined (HOST_LITTLE_ENDIAN) && defined(HOST_UNALIGN_WORD)
-   /* TODO: this fails if src address is $xFFF */
-   /* TODO: this fails if host architecture doesn't support byte alignment */
-   /*       $$$ ben : DONE */
-   return (uint32) (*(uint16 *)(nes6502_banks[address >> NES6502_BANKSHIFT] + (address & NES6502_BANKMASK)));
-#elif defined(TARGET_CPU_PPC)
-   return __lhbrx(nes6502_banks[address >> NES6502_BANKSHIFT], address & NES6502_BANKMASK);
-#else
- {
-   const unsigned int offset = address & NES6502_BANKMASK;
-   return READ_SNES_16(nes6502_banks[address >> NES6502_BANKSHIFT], offset);
- }
-/*    uint32 x = (uint32) *(uint16 *)(nes6502_banks[address >> NES6502_BANKSHIFT] + (address & NES6502_BANKMASK)); */
-/*    return (x << 8) | (x >> 8); */
-//#endif /* TARGET_CPU_PPC */
-#endif /* HOST_LITTLE_ENDIAN */
-}
-
-
-/* read a byte of 6502 memory */
-static uint8 mem_read(uint32 address)
-{
-   /* TODO: following cases are N2A03-specific */
-   /* RAM */
-  if (address < 0x800) {
-    chk_mem_access(acc_ram + address, NES6502_READ_ACCESS);
-    return ram[address];
-  }
-   /* always paged memory */
-//   else if (address >= 0x6000)
-  else if (address >= 0x8000) {
-    return bank_readbyte(address);
-  }
-   /* check memory range handlers */
-   else
+   for (page = 0; page < 256; page++)
    {
-      for (pmr = pmem_read; pmr->min_range != 0xFFFFFFFF; pmr++)
+      first = page << 8;
+      last = first + 0xFF;
+
+      cpu->read_page[page] = NULL;
+      for (pmr = read_handler; pmr->min_range != 0xFFFFFFFF; pmr++)
       {
-         if ((address >= pmr->min_range) && (address <= pmr->max_range))
-            return pmr->read_func(address);
+         if (pmr->min_range <= last && pmr->max_range >= first)
+         {
+            cpu->read_page[page] = pmr;
+            break;
+         }
       }
-   }
 
-   /* return paged memory */
-   return bank_readbyte(address);
-}
-
-/* write a byte of data to 6502 memory */
-static void mem_write(uint32 address, uint8 value)
-{
-   /* RAM */
-   if (address < 0x800)
-   {
-     chk_mem_access(acc_ram + address, NES6502_WRITE_ACCESS);
-      ram[address] = value;
-      return;
-   }
-   /* check memory range handlers */
-   else
-   {
-      for (pmw = pmem_write; pmw->min_range != 0xFFFFFFFF; pmw++)
+      cpu->write_page[page] = NULL;
+      for (pmw = write_handler; pmw->min_range != 0xFFFFFFFF; pmw++)
       {
-         if ((address >= pmw->min_range) && (address <= pmw->max_range))
+         if (pmw->min_range <= last && pmw->max_range >= first)
          {
-            pmw->write_func(address, value);
-            return;
+            cpu->write_page[page] = pmw;
+            break;
          }
       }
    }
-
-   /* write to paged memory */
-   bank_writebyte(address, value);
-}
-
-/* set the current context */
-void nes6502_setcontext(nes6502_context *cpu)
-{
-   int loop;
-
-   ASSERT(cpu);
-   
-   /* Set the page pointers */
-   for (loop = 0; loop < NES6502_NUMBANKS; loop++) {
-      nes6502_banks[loop] = cpu->mem_page[loop];
-#ifdef NES6502_MEM_ACCESS_CTRL
-      acc_nes6502_banks[loop] = cpu->acc_mem_page[loop];
-#endif
-   }
-
-   ram = nes6502_banks[0];  /* quicker zero-page/RAM references */
-   stack_page = ram + STACK_OFFSET;
-#ifdef NES6502_MEM_ACCESS_CTRL
-   acc_ram = acc_nes6502_banks[0];  /* quicker zero-page/RAM references */
-   acc_stack_page = acc_ram + STACK_OFFSET;
-#endif
-
-   pmem_read = cpu->read_handler;
-   pmem_write = cpu->write_handler;
-
-   reg_PC = cpu->pc_reg;
-   reg_A = cpu->a_reg;
-   reg_P = cpu->p_reg;
-   reg_X = cpu->x_reg;
-   reg_Y = cpu->y_reg;
-   reg_S = cpu->s_reg;
-   int_pending = cpu->int_pending;
-   dma_cycles = cpu->dma_cycles;
-}
-
-/* get the current context */
-void nes6502_getcontext(nes6502_context *cpu)
-{
-   int loop;
-
-   /* Set the page pointers */
-   for (loop = 0; loop < NES6502_NUMBANKS; loop++) {
-      cpu->mem_page[loop] = nes6502_banks[loop];
-#ifdef NES6502_MEM_ACCESS_CTRL
-      cpu->acc_mem_page[loop] = acc_nes6502_banks[loop];
-#endif
-   }
-
-   cpu->read_handler = pmem_read;
-   cpu->write_handler = pmem_write;
-
-   cpu->pc_reg = reg_PC;
-   cpu->a_reg = reg_A;
-   cpu->p_reg = reg_P;
-   cpu->x_reg = reg_X;
-   cpu->y_reg = reg_Y;
-   cpu->s_reg = reg_S;
-   cpu->int_pending = int_pending;
-   cpu->dma_cycles = dma_cycles;
-}
-
-/* DMA a byte of data from ROM */
-uint8 nes6502_getbyte(uint32 address)
-{
-   return bank_readbyte(address);
 }
 
 /* get number of elapsed cycles */
-uint32 nes6502_getcycles(boolean reset_flag)
+uint32 nes6502_getcycles(nes6502_context *cpu, boolean reset_flag)
 {
-   uint32 cycles = total_cycles;
+   uint32 cycles = cpu->total_cycles;
 
    if (reset_flag)
-      total_cycles = 0;
+      cpu->total_cycles = 0;
 
    return cycles;
 }
@@ -1488,1010 +1435,11 @@ uint32 nes6502_getcycles(boolean reset_flag)
 ** Returns the number of cycles *actually* executed
 ** (note that this can be from 0-6 cycles more than you wanted)
 */
-int nes6502_execute(int remaining_cycles)
+int nes6502_execute(nes6502_context *cpu, int remaining_cycles)
 {
-   int instruction_cycles, old_cycles = total_cycles;
-   uint32 temp, addr; /* for macros */
-   uint32 PC;
-   uint8 A, X, Y, P, S;
-   uint8 opcode, data;
-   uint8 btemp, baddr; /* for macros */
-
-   GET_GLOBAL_REGS();
-
-#ifdef NES6502_MEM_ACCESS_CTRL
-   /* reset global memory access for this execute loop. */
-   nes6502_mem_access = 0;
-#endif   
-
-   /* Continue until we run out of cycles */
-
-
-   while (remaining_cycles > 0)
-   {
-      instruction_cycles = 0;
-
-      /* check for DMA cycle burning */
-      if (dma_cycles)
-      {
-         if (remaining_cycles <= dma_cycles)
-         {
-            dma_cycles -= remaining_cycles;
-            total_cycles += remaining_cycles;
-            goto _execute_done;
-         }
-         else
-         {
-            remaining_cycles -= dma_cycles;
-            total_cycles += dma_cycles;
-            dma_cycles = 0;
-         }
-      }
-
-      if (int_pending)
-      {
-         /* NMI has highest priority */
-         if (int_pending & NMI_MASK)
-         {
-            NMI();
-         }
-         /* IRQ has lowest priority */
-         else /* if (int_pending & IRQ_MASK) */
-         {
-            if (IS_FLAG_CLEAR(I_FLAG))
-               IRQ();
-         }
-      }
-
-      /* Fetch instruction */
-      //nes6502_disasm(PC, P, A, X, Y, S);
-
-      opcode = bank_readbyte_pc(PC++);
-
-      /* Execute instruction */
-
-      switch (opcode)
-      {
-      case 0x00:  /* BRK */
-         BRK();
-         break;
-
-      case 0x01:  /* ORA ($nn,X) */
-         ORA(6, INDIR_X_BYTE);
-         break;
-
-      /* JAM */
-      case 0x02:  /* JAM */
-      case 0x12:  /* JAM */
-      case 0x22:  /* JAM */
-      case 0x32:  /* JAM */
-      case 0x42:  /* JAM */
-      case 0x52:  /* JAM */
-      case 0x62:  /* JAM */
-      case 0x72:  /* JAM */
-      case 0x92:  /* JAM */
-      case 0xB2:  /* JAM */
-      case 0xD2:  /* JAM */
-      case 0xF2:  /* JAM */
-         JAM();
-         /* kill switch for CPU emulation */
-         goto _execute_done;
-
-      case 0x03:  /* SLO ($nn,X) */
-         SLO(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0x04:  /* NOP $nn */
-      case 0x44:  /* NOP $nn */
-      case 0x64:  /* NOP $nn */
-         DOP(3);
-         break;
-
-      case 0x05:  /* ORA $nn */
-         ORA(3, ZERO_PAGE_BYTE); 
-         break;
-
-      case 0x06:  /* ASL $nn */
-         ASL(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x07:  /* SLO $nn */
-         SLO(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x08:  /* PHP */
-         PHP(); 
-         break;
-
-      case 0x09:  /* ORA #$nn */
-         ORA(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x0A:  /* ASL A */
-         ASL_A();
-         break;
-
-      case 0x0B:  /* ANC #$nn */
-         ANC(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x0C:  /* NOP $nnnn */
-         TOP(); 
-         break;
-
-      case 0x0D:  /* ORA $nnnn */
-         ORA(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0x0E:  /* ASL $nnnn */
-         ASL(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x0F:  /* SLO $nnnn */
-         SLO(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x10:  /* BPL $nnnn */
-         BPL();
-         break;
-
-      case 0x11:  /* ORA ($nn),Y */
-         ORA(5, INDIR_Y_BYTE);
-         break;
-      
-      case 0x13:  /* SLO ($nn),Y */
-         SLO(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0x14:  /* NOP $nn,X */
-      case 0x34:  /* NOP */
-      case 0x54:  /* NOP $nn,X */
-      case 0x74:  /* NOP $nn,X */
-      case 0xD4:  /* NOP $nn,X */
-      case 0xF4:  /* NOP ($nn,X) */
-         DOP(4);
-         break;
-
-      case 0x15:  /* ORA $nn,X */
-         ORA(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0x16:  /* ASL $nn,X */
-         ASL(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x17:  /* SLO $nn,X */
-         SLO(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x18:  /* CLC */
-         CLC();
-         break;
-
-      case 0x19:  /* ORA $nnnn,Y */
-         ORA(4, ABS_IND_Y_BYTE);
-         break;
-      
-      case 0x1A:  /* NOP */
-      case 0x3A:  /* NOP */
-      case 0x5A:  /* NOP */
-      case 0x7A:  /* NOP */
-      case 0xDA:  /* NOP */
-      case 0xFA:  /* NOP */
-         NOP();
-         break;
-
-      case 0x1B:  /* SLO $nnnn,Y */
-         SLO(7, ABS_IND_Y, mem_write, addr);
-         break;
-
-      case 0x1C:  /* NOP $nnnn,X */
-      case 0x3C:  /* NOP $nnnn,X */
-      case 0x5C:  /* NOP $nnnn,X */
-      case 0x7C:  /* NOP $nnnn,X */
-      case 0xDC:  /* NOP $nnnn,X */
-      case 0xFC:  /* NOP $nnnn,X */
-         TOP();
-         break;
-
-      case 0x1D:  /* ORA $nnnn,X */
-         ORA(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0x1E:  /* ASL $nnnn,X */
-         ASL(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x1F:  /* SLO $nnnn,X */
-         SLO(7, ABS_IND_X, mem_write, addr);
-         break;
-      
-      case 0x20:  /* JSR $nnnn */
-         JSR();
-         break;
-
-      case 0x21:  /* AND ($nn,X) */
-         AND(6, INDIR_X_BYTE);
-         break;
-
-      case 0x23:  /* RLA ($nn,X) */
-         RLA(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0x24:  /* BIT $nn */
-         BIT(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0x25:  /* AND $nn */
-         AND(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0x26:  /* ROL $nn */
-         ROL(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x27:  /* RLA $nn */
-         RLA(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x28:  /* PLP */
-         PLP();
-         break;
-
-      case 0x29:  /* AND #$nn */
-         AND(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x2A:  /* ROL A */
-         ROL_A();
-         break;
-
-      case 0x2B:  /* ANC #$nn */
-         ANC(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x2C:  /* BIT $nnnn */
-         BIT(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0x2D:  /* AND $nnnn */
-         AND(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0x2E:  /* ROL $nnnn */
-         ROL(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x2F:  /* RLA $nnnn */
-         RLA(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x30:  /* BMI $nnnn */
-         BMI();
-         break;
-
-      case 0x31:  /* AND ($nn),Y */
-         AND(5, INDIR_Y_BYTE);
-         break;
-
-      case 0x33:  /* RLA ($nn),Y */
-         RLA(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0x35:  /* AND $nn,X */
-         AND(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0x36:  /* ROL $nn,X */
-         ROL(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x37:  /* RLA $nn,X */
-         RLA(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x38:  /* SEC */
-         SEC();
-         break;
-
-      case 0x39:  /* AND $nnnn,Y */
-         AND(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0x3B:  /* RLA $nnnn,Y */
-         RLA(7, ABS_IND_Y, mem_write, addr);
-         break;
-
-      case 0x3D:  /* AND $nnnn,X */
-         AND(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0x3E:  /* ROL $nnnn,X */
-         ROL(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x3F:  /* RLA $nnnn,X */
-         RLA(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x40:  /* RTI */
-         RTI();
-         break;
-
-      case 0x41:  /* EOR ($nn,X) */
-         EOR(6, INDIR_X_BYTE);
-         break;
-
-      case 0x43:  /* SRE ($nn,X) */
-         SRE(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0x45:  /* EOR $nn */
-         EOR(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0x46:  /* LSR $nn */
-         LSR(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x47:  /* SRE $nn */
-         SRE(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x48:  /* PHA */
-         PHA();
-         break;
-
-      case 0x49:  /* EOR #$nn */
-         EOR(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x4A:  /* LSR A */
-         LSR_A();
-         break;
-
-      case 0x4B:  /* ASR #$nn */
-         ASR(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x4C:  /* JMP $nnnn */
-         JMP_ABSOLUTE();
-         break;
-
-      case 0x4D:  /* EOR $nnnn */
-         EOR(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0x4E:  /* LSR $nnnn */
-         LSR(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x4F:  /* SRE $nnnn */
-         SRE(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x50:  /* BVC $nnnn */
-         BVC();
-         break;
-
-      case 0x51:  /* EOR ($nn),Y */
-         EOR(5, INDIR_Y_BYTE);
-         break;
-
-      case 0x53:  /* SRE ($nn),Y */
-         SRE(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0x55:  /* EOR $nn,X */
-         EOR(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0x56:  /* LSR $nn,X */
-         LSR(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x57:  /* SRE $nn,X */
-         SRE(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x58:  /* CLI */
-         CLI();
-         break;
-
-      case 0x59:  /* EOR $nnnn,Y */
-         EOR(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0x5B:  /* SRE $nnnn,Y */
-         SRE(7, ABS_IND_Y, mem_write, addr);
-         break;
-
-      case 0x5D:  /* EOR $nnnn,X */
-         EOR(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0x5E:  /* LSR $nnnn,X */
-         LSR(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x5F:  /* SRE $nnnn,X */
-         SRE(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x60:  /* RTS */
-         RTS();
-         break;
-
-      case 0x61:  /* ADC ($nn,X) */
-         ADC(6, INDIR_X_BYTE);
-         break;
-
-      case 0x63:  /* RRA ($nn,X) */
-         RRA(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0x65:  /* ADC $nn */
-         ADC(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0x66:  /* ROR $nn */
-         ROR(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x67:  /* RRA $nn */
-         RRA(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0x68:  /* PLA */
-         PLA();
-         break;
-
-      case 0x69:  /* ADC #$nn */
-         ADC(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x6A:  /* ROR A */
-         ROR_A();
-         break;
-
-      case 0x6B:  /* ARR #$nn */
-         ARR(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x6C:  /* JMP ($nnnn) */
-         JMP_INDIRECT();
-         break;
-
-      case 0x6D:  /* ADC $nnnn */
-         ADC(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0x6E:  /* ROR $nnnn */
-         ROR(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x6F:  /* RRA $nnnn */
-         RRA(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0x70:  /* BVS $nnnn */
-         BVS();
-         break;
-
-      case 0x71:  /* ADC ($nn),Y */
-         ADC(5, INDIR_Y_BYTE);
-         break;
-
-      case 0x73:  /* RRA ($nn),Y */
-         RRA(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0x75:  /* ADC $nn,X */
-         ADC(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0x76:  /* ROR $nn,X */
-         ROR(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x77:  /* RRA $nn,X */
-         RRA(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0x78:  /* SEI */
-         SEI();
-         break;
-
-      case 0x79:  /* ADC $nnnn,Y */
-         ADC(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0x7B:  /* RRA $nnnn,Y */
-         RRA(7, ABS_IND_Y, mem_write, addr);
-         break;
-
-      case 0x7D:  /* ADC $nnnn,X */
-         ADC(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0x7E:  /* ROR $nnnn,X */
-         ROR(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x7F:  /* RRA $nnnn,X */
-         RRA(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0x80:  /* NOP #$nn */
-      case 0x82:  /* NOP #$nn */
-      case 0x89:  /* NOP #$nn */
-      case 0xC2:  /* NOP #$nn */
-      case 0xE2:  /* NOP #$nn */
-         DOP(2);
-         break;
-
-      case 0x81:  /* STA ($nn,X) */
-         STA(6, INDIR_X_ADDR, mem_write, addr);
-         break;
-
-      case 0x83:  /* SAX ($nn,X) */
-         SAX(6, INDIR_X_ADDR, mem_write, addr);
-         break;
-
-      case 0x84:  /* STY $nn */
-         STY(3, ZERO_PAGE_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x85:  /* STA $nn */
-         STA(3, ZERO_PAGE_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x86:  /* STX $nn */
-         STX(3, ZERO_PAGE_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x87:  /* SAX $nn */
-         SAX(3, ZERO_PAGE_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x88:  /* DEY */
-         DEY();
-         break;
-
-      case 0x8A:  /* TXA */
-         TXA();
-         break;
-
-      case 0x8B:  /* ANE #$nn */
-         ANE(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0x8C:  /* STY $nnnn */
-         STY(4, ABSOLUTE_ADDR, mem_write, addr);
-         break;
-
-      case 0x8D:  /* STA $nnnn */
-         STA(4, ABSOLUTE_ADDR, mem_write, addr);
-         break;
-
-      case 0x8E:  /* STX $nnnn */
-         STX(4, ABSOLUTE_ADDR, mem_write, addr);
-         break;
-      
-      case 0x8F:  /* SAX $nnnn */
-         SAX(4, ABSOLUTE_ADDR, mem_write, addr);
-         break;
-
-      case 0x90:  /* BCC $nnnn */
-         BCC();
-         break;
-
-      case 0x91:  /* STA ($nn),Y */
-         STA(6, INDIR_Y_ADDR, mem_write, addr);
-         break;
-
-      case 0x93:  /* SHA ($nn),Y */
-         SHA(6, INDIR_Y_ADDR, mem_write, addr);
-         break;
-
-      case 0x94:  /* STY $nn,X */
-         STY(4, ZP_IND_X_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x95:  /* STA $nn,X */
-         STA(4, ZP_IND_X_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x96:  /* STX $nn,Y */
-         STX(4, ZP_IND_Y_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x97:  /* SAX $nn,Y */
-         SAX(4, ZP_IND_Y_ADDR, ZP_WRITE, baddr);
-         break;
-
-      case 0x98:  /* TYA */
-         TYA();
-         break;
-
-      case 0x99:  /* STA $nnnn,Y */
-         STA(5, ABS_IND_Y_ADDR, mem_write, addr);
-         break;
-
-      case 0x9A:  /* TXS */
-         TXS();
-         break;
-
-      case 0x9B:  /* SHS $nnnn,Y */
-         SHS(5, ABS_IND_Y_ADDR, mem_write, addr);
-         break;
-
-      case 0x9C:  /* SHY $nnnn,X */
-         SHY(5, ABS_IND_X_ADDR, mem_write, addr);
-         break;
-
-      case 0x9D:  /* STA $nnnn,X */
-         STA(5, ABS_IND_X_ADDR, mem_write, addr);
-         break;
-
-      case 0x9E:  /* SHX $nnnn,Y */
-         SHX(5, ABS_IND_Y_ADDR, mem_write, addr);
-         break;
-
-      case 0x9F:  /* SHA $nnnn,Y */
-         SHA(5, ABS_IND_Y_ADDR, mem_write, addr);
-         break;
-      
-      case 0xA0:  /* LDY #$nn */
-         LDY(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xA1:  /* LDA ($nn,X) */
-         LDA(6, INDIR_X_BYTE);
-         break;
-
-      case 0xA2:  /* LDX #$nn */
-         LDX(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xA3:  /* LAX ($nn,X) */
-         LAX(6, INDIR_X_BYTE);
-         break;
-
-      case 0xA4:  /* LDY $nn */
-         LDY(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xA5:  /* LDA $nn */
-         LDA(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xA6:  /* LDX $nn */
-         LDX(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xA7:  /* LAX $nn */
-         LAX(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xA8:  /* TAY */
-         TAY();
-         break;
-
-      case 0xA9:  /* LDA #$nn */
-         LDA(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xAA:  /* TAX */
-         TAX();
-         break;
-
-      case 0xAB:  /* LXA #$nn */
-         LXA(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xAC:  /* LDY $nnnn */
-         LDY(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xAD:  /* LDA $nnnn */
-         LDA(4, ABSOLUTE_BYTE);
-         break;
-      
-      case 0xAE:  /* LDX $nnnn */
-         LDX(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xAF:  /* LAX $nnnn */
-         LAX(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xB0:  /* BCS $nnnn */
-         BCS();
-         break;
-
-      case 0xB1:  /* LDA ($nn),Y */
-         LDA(5, INDIR_Y_BYTE);
-         break;
-
-      case 0xB3:  /* LAX ($nn),Y */
-         LAX(5, INDIR_Y_BYTE);
-         break;
-
-      case 0xB4:  /* LDY $nn,X */
-         LDY(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0xB5:  /* LDA $nn,X */
-         LDA(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0xB6:  /* LDX $nn,Y */
-         LDX(4, ZP_IND_Y_BYTE);
-         break;
-
-      case 0xB7:  /* LAX $nn,Y */
-         LAX(4, ZP_IND_Y_BYTE);
-         break;
-
-      case 0xB8:  /* CLV */
-         CLV();
-         break;
-
-      case 0xB9:  /* LDA $nnnn,Y */
-         LDA(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xBA:  /* TSX */
-         TSX();
-         break;
-
-      case 0xBB:  /* LAS $nnnn,Y */
-         LAS(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xBC:  /* LDY $nnnn,X */
-         LDY(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0xBD:  /* LDA $nnnn,X */
-         LDA(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0xBE:  /* LDX $nnnn,Y */
-         LDX(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xBF:  /* LAX $nnnn,Y */
-         LAX(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xC0:  /* CPY #$nn */
-         CPY(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xC1:  /* CMP ($nn,X) */
-         CMP(6, INDIR_X_BYTE);
-         break;
-
-      case 0xC3:  /* DCP ($nn,X) */
-         DCP(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0xC4:  /* CPY $nn */
-         CPY(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xC5:  /* CMP $nn */
-         CMP(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xC6:  /* DEC $nn */
-         DEC(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0xC7:  /* DCP $nn */
-         DCP(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0xC8:  /* INY */
-         INY();
-         break;
-
-      case 0xC9:  /* CMP #$nn */
-         CMP(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xCA:  /* DEX */
-         DEX();
-         break;
-
-      case 0xCB:  /* SBX #$nn */
-         SBX(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xCC:  /* CPY $nnnn */
-         CPY(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xCD:  /* CMP $nnnn */
-         CMP(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xCE:  /* DEC $nnnn */
-         DEC(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0xCF:  /* DCP $nnnn */
-         DCP(6, ABSOLUTE, mem_write, addr);
-         break;
-      
-      case 0xD0:  /* BNE $nnnn */
-         BNE();
-         break;
-
-      case 0xD1:  /* CMP ($nn),Y */
-         CMP(5, INDIR_Y_BYTE);
-         break;
-
-      case 0xD3:  /* DCP ($nn),Y */
-         DCP(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0xD5:  /* CMP $nn,X */
-         CMP(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0xD6:  /* DEC $nn,X */
-         DEC(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0xD7:  /* DCP $nn,X */
-         DCP(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0xD8:  /* CLD */
-         CLD();
-         break;
-
-      case 0xD9:  /* CMP $nnnn,Y */
-         CMP(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xDB:  /* DCP $nnnn,Y */
-         DCP(7, ABS_IND_Y, mem_write, addr);
-         break;                  
-
-      case 0xDD:  /* CMP $nnnn,X */
-         CMP(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0xDE:  /* DEC $nnnn,X */
-         DEC(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0xDF:  /* DCP $nnnn,X */
-         DCP(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0xE0:  /* CPX #$nn */
-         CPX(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xE1:  /* SBC ($nn,X) */
-         SBC(6, INDIR_X_BYTE);
-         break;
-
-      case 0xE3:  /* ISB ($nn,X) */
-         ISB(8, INDIR_X, mem_write, addr);
-         break;
-
-      case 0xE4:  /* CPX $nn */
-         CPX(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xE5:  /* SBC $nn */
-         SBC(3, ZERO_PAGE_BYTE);
-         break;
-
-      case 0xE6:  /* INC $nn */
-         INC(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0xE7:  /* ISB $nn */
-         ISB(5, ZERO_PAGE, ZP_WRITE, baddr);
-         break;
-
-      case 0xE8:  /* INX */
-         INX();
-         break;
-
-      case 0xE9:  /* SBC #$nn */
-      case 0xEB:  /* USBC #$nn */
-         SBC(2, IMMEDIATE_BYTE);
-         break;
-
-      case 0xEA:  /* NOP */
-         NOP();
-         break;
-
-      case 0xEC:  /* CPX $nnnn */
-         CPX(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xED:  /* SBC $nnnn */
-         SBC(4, ABSOLUTE_BYTE);
-         break;
-
-      case 0xEE:  /* INC $nnnn */
-         INC(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0xEF:  /* ISB $nnnn */
-         ISB(6, ABSOLUTE, mem_write, addr);
-         break;
-
-      case 0xF0:  /* BEQ $nnnn */
-         BEQ();
-         break;
-
-      case 0xF1:  /* SBC ($nn),Y */
-         SBC(5, INDIR_Y_BYTE);
-         break;
-
-      case 0xF3:  /* ISB ($nn),Y */
-         ISB(8, INDIR_Y, mem_write, addr);
-         break;
-
-      case 0xF5:  /* SBC $nn,X */
-         SBC(4, ZP_IND_X_BYTE);
-         break;
-
-      case 0xF6:  /* INC $nn,X */
-         INC(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0xF7:  /* ISB $nn,X */
-         ISB(6, ZP_IND_X, ZP_WRITE, baddr);
-         break;
-
-      case 0xF8:  /* SED */
-         SED();
-         break;
-
-      case 0xF9:  /* SBC $nnnn,Y */
-         SBC(4, ABS_IND_Y_BYTE);
-         break;
-
-      case 0xFB:  /* ISB $nnnn,Y */
-         ISB(7, ABS_IND_Y, mem_write, addr);
-         break;
-
-      case 0xFD:  /* SBC $nnnn,X */
-         SBC(4, ABS_IND_X_BYTE);
-         break;
-
-      case 0xFE:  /* INC $nnnn,X */
-         INC(7, ABS_IND_X, mem_write, addr);
-         break;
-
-      case 0xFF:  /* ISB $nnnn,X */
-         ISB(7, ABS_IND_X, mem_write, addr);
-         break;
-      }
-
-      /* Calculate remaining/elapsed clock cycles */
-      remaining_cycles -= instruction_cycles;
-      total_cycles += instruction_cycles;
-   }
-
-_execute_done:
-
-   /* restore local copy of regs */
-   SET_LOCAL_REGS();
-
-   /* Return our actual amount of executed cycles */
-   return (total_cycles - old_cycles);
+   if (cpu->track_access)
+      return execute_track(cpu, remaining_cycles);
+   return execute_lean(cpu, remaining_cycles);
 }
 
 /* Initialize tables, etc. */
@@ -2504,45 +1452,93 @@ void nes6502_init(void)
 
    for (index = 1; index < 256; index++)
       flag_table[index] = (index & 0x80) ? N_FLAG : 0;
-
-   reg_A = reg_X = reg_Y = 0;
-   reg_S = 0xFF;                             /* Stack grows down */
 }
 
 
 /* Issue a CPU Reset */
-void nes6502_reset(void)
+void nes6502_reset(nes6502_context *cpu)
 {
-   reg_P = Z_FLAG | R_FLAG | I_FLAG;         /* Reserved bit always 1 */
-   int_pending = dma_cycles = 0;             /* No pending interrupts */
-   reg_PC = bank_readaddress(RESET_VECTOR);  /* Fetch reset vector */
+   cpu->a_reg = cpu->x_reg = cpu->y_reg = 0;
+   cpu->s_reg = 0xFF;                             /* Stack grows down */
+   cpu->p_reg = Z_FLAG | R_FLAG | I_FLAG;         /* Reserved bit always 1 */
+   cpu->int_pending = cpu->dma_cycles = 0;        /* No pending interrupts */
+   cpu->pc_reg = cpu->track_access                /* Fetch reset vector */
+      ? _bank_readaddress_track(cpu, RESET_VECTOR)
+      : _bank_readaddress_lean(cpu, RESET_VECTOR);
    /* TODO: 6 cycles for RESET? */
 }
 
 /* Non-maskable interrupt */
-void nes6502_nmi(void)
+void nes6502_nmi(nes6502_context *cpu)
 {
-   int_pending |= NMI_MASK;
+   cpu->int_pending |= NMI_MASK;
 }
 
 /* Interrupt request */
-void nes6502_irq(void)
+void nes6502_irq(nes6502_context *cpu)
 {
-   int_pending |= IRQ_MASK;
+   cpu->int_pending |= IRQ_MASK;
 }
 
 /* Set dma period (in cycles) */
-void nes6502_setdma(int cycles)
+void nes6502_setdma(nes6502_context *cpu, int cycles)
 {
-   dma_cycles += cycles;
+   cpu->dma_cycles += cycles;
 }
 
-#ifdef NES6502_MEM_ACCESS_CTRL
-void nes6502_chk_mem_access(uint8 * access, int flags)
+void nes6502_chk_mem_access(nes6502_context *cpu, nes6502_accmap *map,
+                            uint32 offset, int flags)
 {
-  chk_mem_access(access, flags);
+  if (cpu->track_access)
+    _chk_mem_access(cpu, map, offset, flags);
+}
+
+int nes6502_accmap_init(nes6502_accmap *map, uint32 size)
+{
+   uint32 pages = (size + 0xFF) >> 8;
+
+   map->size = size;
+   map->words = pages * 8;
+   map->bits = malloc(NES6502_ACCESS_PLANES * map->words * sizeof(uint32));
+   map->dirty = malloc(((pages + 31) >> 5) * sizeof(uint32));
+   if (NULL == map->bits || NULL == map->dirty)
+      return -1;
+
+   memset(map->bits, 0, NES6502_ACCESS_PLANES * map->words * sizeof(uint32));
+   memset(map->dirty, 0, ((pages + 31) >> 5) * sizeof(uint32));
+   return 0;
+}
+
+void nes6502_accmap_free(nes6502_accmap *map)
+{
+   if (map->bits)
+      free(map->bits);
+   if (map->dirty)
+      free(map->dirty);
+   map->bits = map->dirty = NULL;
+}
+
+/* clear the pages the dirty summary points at, a word at a time */
+void nes6502_accmap_clear(nes6502_accmap *map)
+{
+   uint32 i, page, plane, pages = map->words / 8;
+
+   for (i = 0; i < (pages + 31) >> 5; i++)
+   {
+      if (0 == map->dirty[i])
+         continue;
+
+      for (page = i << 5; page < pages && page < (i + 1) << 5; page++)
+      {
+         if (0 == (map->dirty[i] & (1 << (page & 31))))
+            continue;
+         for (plane = 0; plane < NES6502_ACCESS_PLANES; plane++)
+            memset(map->bits + plane * map->words + page * 8, 0,
+                   8 * sizeof(uint32));
+      }
+      map->dirty[i] = 0;
+   }
 }
-#endif
 
 /*
 ** $Log: nes6502.c,v $
@@ -35,6 +35,17 @@
 /* Define this to enable decimal mode in ADC / SBC (not needed in NES) */
 /*#define  NES6502_DECIMAL*/
 
+/* Define this to dispatch opcodes through a table of label addresses
+** (computed goto) instead of a switch.  GCC only; ignored elsewhere.
+*/
+/*#define  NES6502_JUMPTABLE*/
+
+/* Define this to fast-forward loops that can only be left by running out
+** of cycles (spins, status polls, DEX / BNE delays) instead of
+** interpreting every pass
+*/
+/*#define  NES6502_IDLE_SKIP*/
+
 /* number of bank pointers the CPU emulation core handles */
 #ifdef NSF_PLAYER
 #define  NES6502_4KBANKS
@@ -52,15 +63,30 @@
 
 /* Add memory access control flags. This is a ram shadow memory that holds
  * for each memory bytes access flags for read, write and execute access.
- * The nes6502_mem_access holds all new access (all mode all location). It is 
- * used to determine if the player has loop in playing time calculation.
+ * The context mem_access field holds all new access (all mode all location)
+ * of the last nes6502_execute() call. It is used to determine if the player
+ * has loop in playing time calculation.
+ * Only done while the context's track_access is set, in which case every
+ * acc_map[] in use must point at a map; otherwise a separate copy of the
+ * core runs that does no tracking at all.
  */
-#ifdef NES6502_MEM_ACCESS_CTRL
-extern uint8 nes6502_mem_access;
-# define NES6502_READ_ACCESS 1
-# define NES6502_WRITE_ACCESS 2
-# define NES6502_EXE_ACCESS 4
-#endif /* #ifdef NES6502_MEM_ACCESS_CTRL */
+#define NES6502_READ_ACCESS 1
+#define NES6502_WRITE_ACCESS 2
+#define NES6502_EXE_ACCESS 4
+
+/* The shadow is bit-packed: one plane per access kind, one bit per byte,
+ * plus a summary bit per 256 byte page that has had something set since
+ * the map was last cleared, so clearing only touches those pages.
+ */
+#define NES6502_ACCESS_PLANES 3
+
+typedef struct
+{
+   uint32 *bits;     /* the planes, one after the other */
+   uint32 *dirty;    /* one bit per page with anything set */
+   uint32 size;      /* bytes covered */
+   uint32 words;     /* words per plane, a whole number of pages */
+} nes6502_accmap;
 
 /* P (flag) register bitmasks */
 #define  N_FLAG         0x80
@@ -87,55 +113,78 @@ extern uint8 nes6502_mem_access;
 /* Stack is located on 6502 page 1 */
 #define  STACK_OFFSET   0x0100
 
+/* Memory handlers get the userdata pointer of their table entry, which
+** is how they find the instance (NSF, APU, sound chip) they belong to.
+*/
 typedef struct
 {
    uint32 min_range, max_range;
-   uint8 (*read_func)(uint32 address);
+   uint8 (*read_func)(void *userdata, uint32 address);
+   void *userdata;
 } nes6502_memread;
 
 typedef struct
 {
    uint32 min_range, max_range;
-   void (*write_func)(uint32 address, uint8 value);
+   void (*write_func)(void *userdata, uint32 address, uint8 value);
+   void *userdata;
 } nes6502_memwrite;
 
+/* A complete CPU instance: every nes6502_ function works on one of these,
+** so any number of them can run side by side.
+*/
 typedef struct
 {
    uint8 * mem_page[NES6502_NUMBANKS];  /* memory page pointers */
-#ifdef NES6502_MEM_ACCESS_CTRL
-  uint8 * acc_mem_page[NES6502_NUMBANKS]; /* memory access page pointer */
-#endif
+   nes6502_accmap *acc_map[NES6502_NUMBANKS]; /* access map per bank */
+   uint32 acc_bit[NES6502_NUMBANKS];       /* offset of the bank in it */
+   uint8 mem_access;                       /* new access of last execute */
+   boolean track_access;                   /* run the tracking core */
    nes6502_memread *read_handler;
    nes6502_memwrite *write_handler;
+   nes6502_memread *read_page[256];        /* first handler per 6502 page */
+   nes6502_memwrite *write_page[256];      /* NULL: plain paged memory */
    int dma_cycles;
    uint32 pc_reg;
    uint8 a_reg, p_reg, x_reg, y_reg, s_reg;
    uint8 int_pending;
+   uint32 total_cycles;                    /* can be reset by user */
+#ifdef NES6502_IDLE_SKIP
+   int idle_ok;                            /* no writes since loop check */
+#endif
 } nes6502_context;
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
-/* Functions which govern the 6502's execution */
+/* Builds the shared lookup tables, call once before using any CPU */
 extern void nes6502_init(void);
-extern void nes6502_reset(void);
-extern int nes6502_execute(int total_cycles);
-extern void nes6502_nmi(void);
-extern void nes6502_irq(void);
-extern uint8 nes6502_getbyte(uint32 address);
-extern uint32 nes6502_getcycles(boolean reset_flag);
-extern void nes6502_setdma(int cycles);
-
-#ifdef NES6502_MEM_ACCESS_CTRL
-extern void nes6502_chk_mem_access(uint8 * access, int flags);
-#else
-#define nes6502_chk_mem_access(access,flags)
-#endif
 
-/* Context get/set */
-extern void nes6502_setcontext(nes6502_context *cpu);
-extern void nes6502_getcontext(nes6502_context *cpu);
+/* Functions which govern the 6502's execution */
+extern void nes6502_reset(nes6502_context *cpu);
+extern int nes6502_execute(nes6502_context *cpu, int total_cycles);
+extern void nes6502_nmi(nes6502_context *cpu);
+extern void nes6502_irq(nes6502_context *cpu);
+extern uint8 nes6502_getbyte(nes6502_context *cpu, uint32 address);
+extern uint32 nes6502_getcycles(nes6502_context *cpu, boolean reset_flag);
+extern void nes6502_setdma(nes6502_context *cpu, int cycles);
+
+/* Install handler lists (terminated by a min_range of -1); call again
+** whenever their contents change, as they are indexed per page here
+*/
+extern void nes6502_sethandlers(nes6502_context *cpu,
+                                nes6502_memread *read_handler,
+                                nes6502_memwrite *write_handler);
+
+/* does nothing unless track_access is set */
+extern void nes6502_chk_mem_access(nes6502_context *cpu, nes6502_accmap *map,
+                                   uint32 offset, int flags);
+
+/* access maps covering size bytes; init returns -1 when out of memory */
+extern int nes6502_accmap_init(nes6502_accmap *map, uint32 size);
+extern void nes6502_accmap_free(nes6502_accmap *map);
+extern void nes6502_accmap_clear(nes6502_accmap *map);
 
 #ifdef __cplusplus
 }
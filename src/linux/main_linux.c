@@ -4,14 +4,19 @@ UNIX systems */
 
 #include <SDL2/SDL.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -38,10 +43,50 @@ static nsf_t *nsf = 0;
 static uint32 freq = 44100;
 static uint16 bits = 8;
 
-/* sound */
-static int dataSize;
-static int bufferSize;
-static unsigned char *buffer = 0, *bufferPos = 0;
+/* sound.  While playing, a render thread owns nsf and fills audio_ring a frame
+at a time, and the SDL callback drains it.  The main thread only does the
+terminal; it talks to the render thread through cmd_ring.  Both rings are
+lock-free with a single producer and a single consumer. */
+typedef struct ring_s {
+    uint8 *data;
+    uint32 size; /* a power of two */
+    uint32 cap;  /* most bytes the ring may hold, at most size */
+    uint32 head; /* moved by the producer only */
+    uint32 tail; /* moved by the consumer only */
+} ring_t;
+
+enum { CMD_PLAY, CMD_CHANNELS, CMD_LIMIT };
+
+typedef struct cmd_s {
+    int type;
+    int track;  /* CMD_PLAY */
+    int limit;  /* CMD_PLAY, CMD_LIMIT: frames to play, 0 = unlimited */
+    bool channels[6];
+    long long stamp; /* when the key was pressed, 0 = not a key */
+} cmd_t;
+
+static ring_t audio_ring, cmd_ring;
+static int dataSize;      /* bytes of audio in one frame */
+static int ring_ms = 100; /* how far ahead the render thread may get */
+static uint8 silence;
+static SDL_AudioDeviceID audio_dev;
+
+/* -y: the latency to aim for, and the sizes picked to meet it */
+static int latency_ms = 0;
+static int device_samples = 1024; /* what the device takes at a time */
+static int chunk_samples;         /* what the render thread makes at a time */
+
+/* key-to-sound latency.  The render thread marks where in the audio stream
+a key's command took effect, and the callback times the moment it hands that
+sample to SDL.  Times are in microseconds */
+static long long mark_stamp;
+static uint32 mark_pos;
+static int mark_armed;
+static int lat_last = -1, lat_min, lat_max, lat_count;
+static long long lat_sum;
+
+static int quit_render;  /* set by the main thread */
+static int render_done;  /* CMD_PLAY count when the limit was last reached */
 
 static int *plimit_frames = NULL;
 
@@ -53,33 +98,155 @@ static struct termios oldterm;
 so that it could be displayed */
 static bool enabled[6] = {true, true, true, true, true, true};
 
+/* band-limited synthesis instead of point sampling */
+static int blep = 0;
+
+/* cheaper expansion sound, e.g. the N163's channels averaged */
+static int extfast = 0;
+
 static int pid = 1; /* something non-zero by default */
 
 /* takes the number of repetitions desired and returns the number of frames
 to play */
 static int get_time(int repetitions, char *filename, int track) {
-    /* raw result, with intro, without intro */
-    int result, wintro, wointro;
-
-    result = time_info(filename, track);
+    /* with intro, the loop on its own */
+    unsigned int frames, loop;
 
-    wintro = result / 0x1000;
-    wointro = result % 0x1000;
+    frames = time_info(filename, track, NULL, &loop);
 
-    return wintro + (repetitions - 1) * wointro;
+    return frames + (repetitions - 1) * loop;
 }
 
 void handle_auto_calc(char *filename, int track, int reps) {
     *plimit_frames = get_time(reps, filename, track);
 }
 
+/* the ring buffers.  head and tail only ever count up, wrapping at 2^32; the
+producer publishes data by storing head, the consumer frees it by storing
+tail, so neither side needs a lock */
+static int ring_init(ring_t *ring, uint32 cap) {
+    uint32 size = 1;
+
+    while (size < cap) {
+        size <<= 1;
+    }
+
+    ring->data = malloc(size);
+    if (!ring->data) {
+        return -1;
+    }
+
+    ring->size = size;
+    ring->cap = cap;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+static void ring_destroy(ring_t *ring) {
+    if (ring->data) {
+        free(ring->data);
+    }
+}
+
+static uint32 ring_used(ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer side; the caller checks ring_used() first, len must fit */
+static void ring_write(ring_t *ring, const void *src, uint32 len) {
+    uint32 pos = ring->head & (ring->size - 1);
+    uint32 first = ring->size - pos < len ? ring->size - pos : len;
+
+    memcpy(ring->data + pos, src, first);
+    memcpy(ring->data, (const uint8 *)src + first, len - first);
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+/* consumer side; returns how much was there, up to len */
+static uint32 ring_read(ring_t *ring, void *dst, uint32 len) {
+    uint32 used = ring_used(ring);
+    uint32 pos = ring->tail & (ring->size - 1);
+    uint32 first;
+
+    if (len > used) {
+        len = used;
+    }
+    first = ring->size - pos < len ? ring->size - pos : len;
+
+    memcpy(dst, ring->data + pos, first);
+    memcpy((uint8 *)dst + first, ring->data, len - first);
+    __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* called by SDL on its own thread whenever the device wants more.  If the
+render thread has fallen behind, play silence rather than wait for it */
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    ring_t *ring = (ring_t *)userdata;
+    uint32 tail = ring->tail;
+    uint32 got = ring_read(ring, stream, len);
+
+    if (got < (uint32)len) {
+        memset(stream + got, silence, len - got);
+    }
+
+    /* the marked sample is heard once the samples ahead of it in this buffer
+    have played, and SDL is done with the buffer it already has */
+    if (__atomic_load_n(&mark_armed, __ATOMIC_ACQUIRE) &&
+        mark_pos - tail < got) {
+        long long ahead = (mark_pos - tail) / (bits / 8) + device_samples;
+        int lat = now_us() - mark_stamp + ahead * 1000000 / freq;
+
+        if (lat_count == 0 || lat < lat_min) {
+            lat_min = lat;
+        }
+        if (lat_count == 0 || lat > lat_max) {
+            lat_max = lat;
+        }
+        lat_sum += lat;
+        lat_count++;
+
+        __atomic_store_n(&lat_last, lat, __ATOMIC_RELEASE);
+        __atomic_store_n(&mark_armed, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* the device buffer to ask for.  A -y target is shared between the device
+buffer, which costs up to two buffers of delay, and the ring, so it gets the
+largest power of two up to a third of the target */
+static int wanted_samples(void) {
+    int target = latency_ms * freq / 1000;
+    int samples = 64;
+
+    if (latency_ms <= 0) {
+        return 1024;
+    }
+
+    while (samples * 2 <= target / 3 && samples < 1024) {
+        samples *= 2;
+    }
+    return samples;
+}
+
+/* open the device, paused.  SDL converts the sample format for us but may
+pick its own rate and buffer size, and those are what we render at and time
+latency by */
 static void init_sdl(void) {
     if (SDL_Init(SDL_INIT_AUDIO)) {
         fprintf(stderr, "SDL_Init(): %s\n", SDL_GetError());
         exit(1);
     }
 
-    SDL_AudioSpec wanted;
+    SDL_AudioSpec wanted, obtained;
+    SDL_zero(wanted);
 
     int format;
 
@@ -87,41 +254,85 @@ static void init_sdl(void) {
         format = AUDIO_U8;
     } else if (bits == 16) {
         format = AUDIO_S16;
+    } else if (bits == 32) {
+        format = AUDIO_F32SYS;
     } else {
         printf("Bad sample depth: %i\n", bits);
         exit(1);
     }
 
+    silence = bits == 8 ? 0x80 : 0;
+
     wanted.freq = freq;
     wanted.format = format;
     wanted.channels = 1;
-    wanted.silence = 0;
-    wanted.samples = 1024;
-    wanted.callback = NULL;
-
-    if (SDL_OpenAudio(&wanted, NULL) < 0) {
-        fprintf(stderr, "SDL_OpenAudio(): %s\n", SDL_GetError());
+    wanted.silence = silence;
+    wanted.samples = wanted_samples();
+    wanted.callback = audio_callback;
+    wanted.userdata = &audio_ring;
+
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained,
+                                    SDL_AUDIO_ALLOW_FREQUENCY_CHANGE |
+                                        SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (audio_dev == 0) {
+        fprintf(stderr, "SDL_OpenAudioDevice(): %s\n", SDL_GetError());
         exit(1);
     }
 
-    SDL_PauseAudio(0);
+    freq = obtained.freq;
+    device_samples = obtained.samples;
+}
+
+/* pick the rendering sizes around the device buffer we got.  By default whole
+frames are rendered up to -k ms ahead.  With a -y target the ring gets what the
+device buffer leaves of it, and frames are rendered in device-sized pieces, so
+a key doesn't wait for the rest of a frame either */
+static void plan_latency(void) {
+    int frame = dataSize / (bits / 8);
+    int target = latency_ms * freq / 1000;
+
+    chunk_samples = frame;
+    if (latency_ms <= 0) {
+        return;
+    }
+
+    if (device_samples < chunk_samples) {
+        chunk_samples = device_samples;
+    }
+    /* nothing left for it if the device took more than we asked for */
+    ring_ms = (target - 2 * device_samples) * 1000 / (int)freq;
 }
 
-static void init_buffer() {
-    dataSize = freq / nsf->playback_rate * (bits / 8);
-    bufferSize = ((freq * bits) / 8) / 2;
-    buffer = malloc((bufferSize / dataSize + 1) * dataSize);
-    bufferPos = buffer;
-    memset(buffer, 0, bufferSize);
+/* size the rings.  The audio ring holds ring_ms of sound, but never less than
+one device buffer plus a chunk, or the callback would underrun every time */
+static void init_rings(void) {
+    int sample = bits / 8;
+    uint32 cap = ring_ms > 0 ? (uint32)ring_ms * freq / 1000 * sample : 0;
+    uint32 least = (device_samples + chunk_samples) * sample;
+
+    if (cap < least) {
+        cap = least;
+    }
+
+    if (ring_init(&audio_ring, cap) || ring_init(&cmd_ring, 16 * sizeof(cmd_t))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    if (latency_ms > 0) {
+        printf("Aiming for %d ms: device buffer %d samples, rendering %d "
+               "samples at a time, at most %d ms ahead\n\n",
+               latency_ms, device_samples, chunk_samples,
+               (int)(cap / sample * 1000 / freq));
+    }
 }
 
 /* close what we've opened */
 static void close_sdl(void) {
+    SDL_CloseAudioDevice(audio_dev);
     SDL_Quit();
-    free(buffer);
-    buffer = 0;
-    bufferSize = 0;
-    bufferPos = 0;
+    ring_destroy(&audio_ring);
+    ring_destroy(&cmd_ring);
 }
 
 static void show_help(void) {
@@ -133,15 +344,26 @@ static void show_help(void) {
     printf("\n\t-t x\tStart playing track x (default: 1)\n");
     printf("\t-s x\tPlay at x times the normal speed\n");
     printf("\t-f x\tUse x sampling rate (default: 44100)\n");
-    printf("\t-B x\tUse sample size of x bits (default: 8)\n");
+    printf("\t-B x\tUse sample size of x bits: 8, 16 or 32 (float) "
+           "(default: 8)\n");
     printf("\t-l x\tLimit total playing time to x seconds (0 = unlimited)\n");
     printf("\t-r x\tLimit total playing time to x frames (0 = unlimited)\n");
-    printf("\t-b x\tSkip the first x frames\n");
+    printf("\t-b x\tSkip the first x frames (through a keyframe index kept "
+           "in\n\t\tfilename.track.idx)\n");
     printf("\t-a x\tCalculate song length and play x repetitions (0 = intro "
            "only)\n");
     printf("\t-i\tJust print file information and exit\n");
     printf("\t-x\tStart with channel x disabled (-123456)\n");
-    printf("\t-o x\tOutput WAV files to directory x\n\n");
+    printf("\t-e\tUse band-limited (alias-free) synthesis\n");
+    printf("\t-n\tUse faster expansion sound (mix the N163's channels "
+           "rather than\n\t\ttime-slice them)\n");
+    printf("\t-k x\tRender at most x ms of sound ahead (default: 100)\n");
+    printf("\t-y x\tAim for x ms from a key press to its sound (sets -k)\n");
+    printf("\t-o x\tOutput WAV files to directory x\n");
+    printf("\t-j x\tWith -o or -L, work on x tracks or files at a time\n");
+    printf("\t-L x\tWork out the length of every track of the files and "
+           "directories\n\t\tgiven and write a report to x (- for stdout)\n");
+    printf("\t-m x\tBenchmark the CPU core over x frames and exit\n\n");
     printf("\nPlease send bug reports to quadong@users.sf.net\n");
 
     exit(0);
@@ -165,30 +387,41 @@ static void show_info(void) {
     exit(0);
 }
 
-static void printsonginfo(int current_frame, int total_frames, int limited) {
+static void printsonginfo(int song, int current_frame, int total_frames,
+                          int limited) {
     /*Why not printf directly?  Our termios hijinks for input kills the output*/
-    char *ui = (char *)malloc(255);
+    char ui[255];
 
     snprintf(
         ui, 254,
         total_frames != 0
             ? "Playing track %d/%d, channels %c%c%c%c%c%c, %d/%d sec, %d/%d "
-              "frames\r"
+              "frames"
             : (limited ? "Playing track %d/%d, channels %c%c%c%c%c%c, %d/? "
-                         "sec, %11$d/? frames (Working...)\r"
+                         "sec, %11$d/? frames (Working...)"
                        : "Playing track %d/%d, channels %c%c%c%c%c%c, %d "
-                         "sec, %11$d frames\r"),
-        nsf->current_song, nsf->num_songs, enabled[0] ? '1' : '-',
+                         "sec, %11$d frames"),
+        song, nsf->num_songs, enabled[0] ? '1' : '-',
         enabled[1] ? '2' : '-', enabled[2] ? '3' : '-', enabled[3] ? '4' : '-',
         enabled[4] ? '5' : '-', enabled[5] ? '6' : '-',
         abs((int)((float)(current_frame + nsf->playback_rate) /
                   (float)nsf->playback_rate) -
-            1), /* the sound gets buffered a lot... */
+            1),
         abs((int)((float)(total_frames + nsf->playback_rate) /
                   (float)nsf->playback_rate) -
             1), /* this is something of an estimate */
         current_frame, total_frames);
 
+    /* how long the last key took to be heard */
+    int lat = __atomic_load_n(&lat_last, __ATOMIC_ACQUIRE);
+    int len = strlen(ui);
+
+    if (lat >= 0) {
+        snprintf(ui + len, 254 - len, ", key %d ms\r", (lat + 500) / 1000);
+    } else {
+        snprintf(ui + len, 254 - len, "\r");
+    }
+
     if (!(current_frame % 10)) {
         char blank[82];
         memset(blank, ' ', 80);
@@ -198,26 +431,25 @@ static void printsonginfo(int current_frame, int total_frames, int limited) {
     }
 
     write(STDOUT_FILENO, (void *)ui, strlen(ui));
-    free(ui);
 }
 
-static void sync_channels(void) {
+static void sync_channels(nsf_t *target, const bool *channels) {
     /* this is going to get run when a track starts and all channels start out
        enabled, so just turn off the right ones */
     for (int channel = 0; channel < 6; channel++) {
-        if (!enabled[channel]) {
-            nsf_setchan(nsf, channel, enabled[channel]);
+        if (!channels[channel]) {
+            nsf_setchan(target, channel, channels[channel]);
         }
     }
-}
-
-/* start track, display which it is, and what channels are enabled */
-static void nsf_setupsong() {
-    printsonginfo(0, 0, 0);
-    nsf_playtrack(nsf, nsf->current_song, freq, bits, 0);
-    sync_channels();
 
-    return;
+    /* the apu is new too; band-limited output needs no smoothing */
+    if (blep) {
+        nsf_setsynth(target, NSF_SYNTH_BLEP);
+        nsf_setfilter(target, NSF_FILTER_NONE);
+    }
+    if (extfast) {
+        nsf_setextmode(target, NSF_EXTMODE_FAST);
+    }
 }
 
 /* display info about an NSF file */
@@ -238,45 +470,76 @@ static void nsf_displayinfo(void) {
     fflush(stdout);
 }
 
+/* hand a command to the render thread, which picks it up between chunks.
+Only the main thread calls this */
+static int plays_sent;
+static long long key_stamp; /* the key being handled, if any */
+
+static void send_cmd(int type, int track, int limit) {
+    cmd_t cmd;
+
+    cmd.type = type;
+    cmd.track = track;
+    cmd.limit = limit;
+    memcpy(cmd.channels, enabled, sizeof(cmd.channels));
+    cmd.stamp = key_stamp;
+
+    while (cmd_ring.cap - ring_used(&cmd_ring) < sizeof(cmd)) {
+        usleep(1000);
+    }
+    ring_write(&cmd_ring, &cmd, sizeof(cmd));
+
+    if (type == CMD_PLAY) {
+        plays_sent++;
+    }
+}
+
+/* start a track.  The render thread switches over straight away; the length
+calculation can take a while, so its result follows in a second command and
+the old track's sound keeps the device busy in the meantime */
+static void start_track(int song, int doautocalc, char *filename, int reps) {
+    if (!doautocalc) {
+        send_cmd(CMD_PLAY, song, *plimit_frames);
+        return;
+    }
+
+    send_cmd(CMD_PLAY, song, 0);
+    *plimit_frames = 0;
+    printsonginfo(song, 0, 0, 1);
+
+    handle_auto_calc(filename, song, reps);
+    key_stamp = 0;
+    send_cmd(CMD_LIMIT, song, *plimit_frames);
+}
+
 /* handle keypresses */
-static int nsf_handlekey(char ch, int doautocalc, char *filename, int reps) {
+static int nsf_handlekey(char ch, int *song, int doautocalc, char *filename,
+                         int reps) {
     ch = tolower(ch);
     switch (ch) {
     case 'q':
     case 27: /* escape */
         return 1;
     case 'x':
-        if (nsf->current_song == nsf->num_songs) {
-            nsf->current_song = 1;
+        if (*song == nsf->num_songs) {
+            *song = 1;
         } else {
-            nsf->current_song++;
-        }
-
-        nsf_setupsong();
-        frames = 0;
-
-        if (doautocalc) {
-            handle_auto_calc(filename, nsf->current_song, reps);
+            (*song)++;
         }
 
+        start_track(*song, doautocalc, filename, reps);
         break;
     case 'z':
-        if (nsf->current_song == 1) {
-            nsf->current_song = nsf->num_songs;
+        if (*song == 1) {
+            *song = nsf->num_songs;
         } else {
-            nsf->current_song--;
+            (*song)--;
         }
 
-        nsf_setupsong();
-        frames = 0;
-
-        if (doautocalc) {
-            handle_auto_calc(filename, nsf->current_song, reps);
-        }
+        start_track(*song, doautocalc, filename, reps);
         break;
     case '\n':
-        nsf_playtrack(nsf, nsf->current_song, freq, bits, 0);
-        sync_channels();
+        send_cmd(CMD_PLAY, *song, *plimit_frames);
         break;
     case '1':
     case '2':
@@ -285,7 +548,7 @@ static int nsf_handlekey(char ch, int doautocalc, char *filename, int reps) {
     case '5':
     case '6':
         enabled[ch - '1'] = !enabled[ch - '1'];
-        nsf_setchan(nsf, ch - '1', enabled[ch - '1']);
+        send_cmd(CMD_CHANNELS, *song, 0);
         break;
     }
 
@@ -317,76 +580,244 @@ static void setup_term() {
     fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL, 0) | O_NONBLOCK);
 }
 
+/* -b: keyframes every this many seconds, in a sidecar next to the file */
+#define INDEX_SECONDS 10
+
+/* take the track just started to frame target through its keyframe index,
+building the index (and saving it for next time) when there is none, it
+doesn't reach that far or it was made with other settings.  Returns the
+frame reached: target, or 0 if no index could be made */
+static int skip_frames(const char *filename, int track, int target) {
+    nsf_index_t *index;
+    char *name;
+    int reached = 0;
+
+    if (target <= 0) {
+        return 0;
+    }
+
+    name = malloc(strlen(filename) + 16);
+    if (!name) {
+        return 0;
+    }
+    sprintf(name, "%s.%d.idx", filename, track);
+
+    index = nsf_loadindex(nsf, name);
+    if (index && index->track == track && nsf_seek(nsf, index, target) == 0) {
+        reached = target;
+    } else {
+        /* a seek that fails leaves the track where it was, at its start */
+        nsf_freeindex(&index);
+        index = nsf_buildindex(nsf, INDEX_SECONDS * nsf->playback_rate,
+                               target);
+        if (index) {
+            nsf_saveindex(index, name);
+            reached = target;
+        }
+    }
+
+    nsf_freeindex(&index);
+    free(name);
+    return reached;
+}
+
+/* what play() hands the render thread */
+typedef struct render_args_s {
+    const char *filename;
+    int starting_frame;
+} render_args_t;
+
+/* the render thread.  It owns nsf from the first command until play() joins
+it.  It runs the CPU a frame at a time, and renders the frame's sound a chunk
+at a time whenever audio_ring has room for one */
+static void *render_thread(void *arg) {
+    const render_args_t *args = arg;
+    int starting_frame = args->starting_frame;
+    int sample = bits / 8;
+    int frame = dataSize / sample;
+    unsigned char *chunk = malloc(chunk_samples * sample);
+    useconds_t nap = 250000LL * chunk_samples / freq; /* a quarter chunk */
+    bool channels[6];
+    int limit = 0, count = 0, plays = 0, left = 0;
+    cmd_t cmd;
+
+    while (!__atomic_load_n(&quit_render, __ATOMIC_ACQUIRE)) {
+        while (ring_read(&cmd_ring, &cmd, sizeof(cmd)) == sizeof(cmd)) {
+            switch (cmd.type) {
+            case CMD_PLAY:
+                nsf_playtrack(nsf, cmd.track, freq, bits, 0);
+                memcpy(channels, cmd.channels, sizeof(channels));
+                sync_channels(nsf, channels);
+                limit = cmd.limit;
+                count = skip_frames(args->filename, cmd.track, starting_frame);
+                __atomic_store_n(&frames, count, __ATOMIC_RELEASE);
+                left = 0;
+                plays++;
+                break;
+            case CMD_CHANNELS:
+                for (int channel = 0; channel < 6; channel++) {
+                    if (channels[channel] != cmd.channels[channel]) {
+                        channels[channel] = cmd.channels[channel];
+                        nsf_setchan(nsf, channel, channels[channel]);
+                    }
+                }
+                break;
+            case CMD_LIMIT:
+                limit = cmd.limit;
+                break;
+            }
+
+            /* the next sample written is the first the key changed */
+            if (cmd.stamp && !__atomic_load_n(&mark_armed, __ATOMIC_ACQUIRE)) {
+                mark_stamp = cmd.stamp;
+                mark_pos = audio_ring.head;
+                __atomic_store_n(&mark_armed, 1, __ATOMIC_RELEASE);
+            }
+        }
+
+        if (left == 0) {
+            if (limit != 0 && count >= limit) {
+                __atomic_store_n(&render_done, plays, __ATOMIC_RELEASE);
+                usleep(nap);
+                continue;
+            }
+
+            nsf_frame(nsf);
+            count++;
+
+            /* skipping the slow way, if the index couldn't be had (not
+            rendering speeds it up a lot) */
+            if (count < starting_frame) {
+                __atomic_store_n(&frames, count, __ATOMIC_RELEASE);
+                continue;
+            }
+            left = frame;
+        }
+
+        int n = left < chunk_samples ? left : chunk_samples;
+
+        if (audio_ring.cap - ring_used(&audio_ring) < (uint32)(n * sample)) {
+            usleep(nap);
+            continue;
+        }
+
+        left -= n;
+        if (left) {
+            apu_render(nsf->apu, chunk, n);
+        } else {
+            apu_process(nsf->apu, chunk, n);
+        }
+        ring_write(&audio_ring, chunk, n * sample);
+
+        if (left == 0) {
+            __atomic_store_n(&frames, count, __ATOMIC_RELEASE);
+        }
+    }
+
+    free(chunk);
+    return NULL;
+}
+
 static void play(char *filename, int track, int doautocalc, int reps,
                  int starting_frame, int limited) {
-    int done = 0;
-    frames = 0;
+    pthread_t renderer;
+    render_args_t args = {filename, starting_frame};
+    struct pollfd pfd;
+    int done = 0, song, shown = -1;
 
     /* determine which track to play */
     if (track > nsf->num_songs || track < 1) {
-        nsf->current_song = nsf->start_song;
+        song = nsf->start_song;
 
         fprintf(stderr, "track %d out of range, playing track %d\n", track,
-                nsf->current_song);
+                song);
     } else {
-        nsf->current_song = track;
+        song = track;
     }
 
     /* display file information */
     nsf_displayinfo();
-    nsf_setupsong();
+    printsonginfo(song, 0, 0, 0);
+
+    send_cmd(CMD_PLAY, song, *plimit_frames);
+    if (pthread_create(&renderer, NULL, render_thread, &args)) {
+        fprintf(stderr, "Could not start the render thread\n");
+        return;
+    }
 
     setup_term();
 
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+
     while (!done) {
         char ch;
+        ssize_t got;
 
-        nsf_frame(nsf);
-        frames++;
-
-        printsonginfo(frames, *plimit_frames, limited);
+        /* show what is coming out of the speakers, not what was rendered */
+        int heard = __atomic_load_n(&frames, __ATOMIC_ACQUIRE) -
+                    (int)(ring_used(&audio_ring) / dataSize);
 
-        /* don't waste time if skipping frames (this check speeds it up a lot)
-         */
-        if (frames >= starting_frame) {
-            apu_process(bufferPos, dataSize / (bits / 8));
+        if (heard < 0) {
+            heard = 0;
         }
-
-        bufferPos += dataSize;
-
-        if (bufferPos >= buffer + bufferSize) {
-            if (frames >= starting_frame) {
-                SDL_QueueAudio(1, buffer, bufferPos - buffer);
-
-                float bytesPerSecond = (freq * bits) / 8;
-
-                SDL_Delay(
-                    ((int)(SDL_GetQueuedAudioSize(1) / bytesPerSecond * 1000)) /
-                    2);
-            }
-
-            bufferPos = buffer;
+        if (heard != shown) {
+            printsonginfo(song, heard, *plimit_frames, limited);
+            shown = heard;
         }
 
-        if (*plimit_frames != 0 && frames >= *plimit_frames) {
+        /* the limit was reached, and everything rendered has been played */
+        if (__atomic_load_n(&render_done, __ATOMIC_ACQUIRE) == plays_sent &&
+            ring_used(&audio_ring) == 0) {
             done = 1;
+            continue;
         }
 
-        if (fread((void *)&ch, 1, 1, stdin) == 1) {
-            done = nsf_handlekey(ch, doautocalc, filename, reps);
+        /* the terminal can stall as long as it likes; sound doesn't wait */
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+
+        got = read(STDIN_FILENO, &ch, 1);
+        if (got == 1) {
+            key_stamp = now_us();
+            done = nsf_handlekey(ch, &song, doautocalc, filename, reps);
+            key_stamp = 0;
+            shown = -1;
+        } else if (got == 0 || errno != EAGAIN) {
+            pfd.fd = -1; /* no more input; just play */
         }
     }
 
+    __atomic_store_n(&quit_render, 1, __ATOMIC_RELEASE);
+    pthread_join(renderer, NULL);
+
     tcsetattr(STDIN_FILENO, TCSANOW, &oldterm);
     fprintf(stderr, "\n");
-}
 
-static void dump(char* filename, char *dumpname, int track) {
-    memset(buffer, 0, bufferSize);
+    /* once paused, the callback is done with the figures */
+    SDL_PauseAudioDevice(audio_dev, 1);
+    if (lat_count) {
+        fprintf(stderr,
+                "Key to sound latency over %d keys: %.1f ms min, %.1f ms "
+                "average, %.1f ms max\n",
+                lat_count, lat_min / 1000.0, lat_sum / 1000.0 / lat_count,
+                lat_max / 1000.0);
+    }
+}
 
+/* render one track to a WAV file.  Everything here is local or belongs to
+target, so the -j workers can each run one on their own nsf at once */
+static void dump(nsf_t *target, char* filename, char *dumpname, int track) {
+    int dump_data = freq / target->playback_rate * (bits / 8);
+    int dump_size = ((freq * bits) / 8) / 2;
+    unsigned char *dump_buffer = malloc((dump_size / dump_data + 1) * dump_data);
+    unsigned char *dump_pos = dump_buffer;
+    int limit_frames;
+    int dump_frames = 0;
     int done = 0;
-    frames = 0;
-    bufferPos = buffer;
+
+    memset(dump_buffer, 0, dump_size);
 
     FILE *wavFile = fopen(dumpname, "wb");
 
@@ -400,7 +831,8 @@ static void dump(char* filename, char *dumpname, int track) {
     uint32 headerSize = 16;
     fwrite(&headerSize, sizeof(uint32), 1, wavFile);
 
-    uint16 type = 1;
+    /* PCM, or IEEE float */
+    uint16 type = (bits == 32) ? 3 : 1;
     fwrite(&type, sizeof(uint16), 1, wavFile);
 
     uint16 channels = 1;
@@ -419,23 +851,23 @@ static void dump(char* filename, char *dumpname, int track) {
     fwrite("data", 4, 1, wavFile);
     fwrite(&size, sizeof(uint32), 1, wavFile);
 
-    handle_auto_calc(filename, nsf->current_song, 1);
-    nsf_playtrack(nsf, nsf->current_song, freq, bits, 0);
-    sync_channels();
+    limit_frames = get_time(1, filename, target->current_song);
+    nsf_playtrack(target, target->current_song, freq, bits, 0);
+    sync_channels(target, enabled);
 
     while (!done) {
-        nsf_frame(nsf);
-        frames++;
-        apu_process(bufferPos, dataSize / (bits / 8));
-        bufferPos += dataSize;
-
-        if (bufferPos >= buffer + bufferSize) {
-            fwrite(buffer, 1, bufferPos - buffer, wavFile);
-            size += bufferPos - buffer;
-            bufferPos = buffer;
+        nsf_frame(target);
+        dump_frames++;
+        apu_process(target->apu, dump_pos, dump_data / (bits / 8));
+        dump_pos += dump_data;
+
+        if (dump_pos >= dump_buffer + dump_size) {
+            fwrite(dump_buffer, 1, dump_pos - dump_buffer, wavFile);
+            size += dump_pos - dump_buffer;
+            dump_pos = dump_buffer;
         }
 
-        if (frames >= 50 && frames >= *plimit_frames) {
+        if (dump_frames >= 50 && dump_frames >= limit_frames) {
             done = 1;
         }
     }
@@ -448,6 +880,123 @@ static void dump(char* filename, char *dumpname, int track) {
     fwrite(&size, sizeof(uint32), 1, wavFile);
 
     fclose(wavFile);
+    free(dump_buffer);
+}
+
+/* render track number i of target into dir/i.wav */
+static void dump_track(nsf_t *target, char *filename, char *dumpwavdir,
+                       int i) {
+    target->current_song = i;
+
+    // 3 digits, WAV extension, slash, dot and NULL
+    char* dumpname = malloc(strlen(dumpwavdir) + 9);
+    sprintf(dumpname, "%s/%d.wav", dumpwavdir, target->current_song);
+
+    dump(target, filename, dumpname, i);
+
+    free(dumpname);
+}
+
+/* tracks still to be exported with -j, handed out one at a time */
+typedef struct {
+    pthread_mutex_t lock;
+    nsf_t *nsf;
+    char *filename;
+    char *dumpwavdir;
+    int next_track;
+    int end_track;
+} dump_queue_t;
+
+/* a -j worker: makes its own instance of the nsf, sharing the loaded data,
+then exports tracks until the queue runs dry */
+static void *dump_worker(void *arg) {
+    dump_queue_t *queue = arg;
+    nsf_t *own = nsf_clone(queue->nsf);
+    int i;
+
+    if (!own) {
+        printf("Error opening \"%s\"\n", queue->filename);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        i = queue->next_track++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->end_track) {
+            break;
+        }
+
+        dump_track(own, queue->filename, queue->dumpwavdir, i);
+    }
+
+    nsf_free(&own);
+    return NULL;
+}
+
+/* export tracks first_track up to end_track of target with jobs threads */
+static void dump_parallel(nsf_t *target, char *filename, char *dumpwavdir,
+                          int first_track, int end_track, int jobs) {
+    dump_queue_t queue;
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+
+    pthread_mutex_init(&queue.lock, NULL);
+    queue.nsf = target;
+    queue.filename = filename;
+    queue.dumpwavdir = dumpwavdir;
+    queue.next_track = first_track;
+    queue.end_track = end_track;
+
+    for (int j = 0; j < jobs; j++) {
+        if (pthread_create(&workers[started], NULL, dump_worker, &queue)) {
+            break;
+        }
+        started++;
+    }
+
+    /* couldn't get any threads at all, so do it ourselves */
+    if (!started) {
+        dump_worker(&queue);
+    }
+
+    for (int j = 0; j < started; j++) {
+        pthread_join(workers[j], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    free(workers);
+}
+
+/* run the play routine flat out, without sound output, and report how fast
+the 6502 core went */
+static void benchmark(int track, int bench_frames) {
+    struct timeval start, end;
+    double seconds, mhz;
+    uint64 cycles = 0;
+    int i;
+
+    nsf_playtrack(nsf, track, freq, bits, 0);
+    nes6502_getcycles(nsf->cpu, TRUE);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < bench_frames; i++) {
+        nsf_frame(nsf);
+        cycles += nes6502_getcycles(nsf->cpu, TRUE);
+    }
+    gettimeofday(&end, NULL);
+
+    seconds = (end.tv_sec - start.tv_sec) +
+              (end.tv_usec - start.tv_usec) / 1000000.0;
+    if (seconds <= 0)
+        seconds = 1e-6;
+    mhz = cycles / seconds / 1000000.0;
+
+    printf("%d frames, %llu cycles in %.3f s\n", bench_frames,
+           (unsigned long long) cycles, seconds);
+    printf("%.2f emulated MHz (%.1fx realtime)\n", mhz,
+           mhz * 1000000.0 / (NES_MASTER_CLOCK / NTSC_SUBCARRIER_DIV));
 }
 
 /* free what we've allocated */
@@ -463,12 +1012,15 @@ int main(int argc, char **argv) {
     int done = 0;
     int justdisplayinfo = 0;
     int dumpwav = 0;
+    int bench_frames = 0;
+    int jobs = 1;
+    char *report = NULL;
     int doautocalc = 0;
     int reps = 0, limit_time = 0, starting_frame = 0;
     int limited = 0;
     float speed_multiplier = 1;
 
-    const char *opts = "123456hvit:f:B:s:l:r:b:a:o:";
+    const char *opts = "123456hvient:f:B:s:l:r:b:a:o:j:m:L:k:y:";
 
     plimit_frames = (int *)malloc(sizeof(int));
     plimit_frames[0] = 0;
@@ -506,6 +1058,18 @@ int main(int argc, char **argv) {
         case 'i':
             justdisplayinfo = 1;
             break;
+        case 'e':
+            blep = 1;
+            break;
+        case 'n':
+            extfast = 1;
+            break;
+        case 'k':
+            ring_ms = atoi(optarg);
+            break;
+        case 'y':
+            latency_ms = atoi(optarg);
+            break;
         case 'l':
             limit_time = atoi(optarg);
             limited = 1;
@@ -526,6 +1090,15 @@ int main(int argc, char **argv) {
             dumpwav = 1;
             dumpwavdir = optarg;
             break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'm':
+            bench_frames = atoi(optarg);
+            break;
+        case 'L':
+            report = optarg;
+            break;
         case 'h':
         case ':':
         case '?':
@@ -535,6 +1108,26 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* batch length scan: files and directories come after the options */
+    if (report) {
+        FILE *out = strcmp(report, "-") ? fopen(report, "w") : stdout;
+        int failed;
+
+        if (argc <= optind) {
+            show_help();
+        }
+        if (!out) {
+            perror(report);
+            return 1;
+        }
+
+        failed = time_batch(argv + optind, argc - optind, jobs, out);
+        if (out != stdout) {
+            fclose(out);
+        }
+        return failed ? 1 : 0;
+    }
+
     show_warranty();
 
     /* filename comes after all other options */
@@ -558,25 +1151,25 @@ int main(int argc, char **argv) {
 
     if (justdisplayinfo) {
         nsf_displayinfo();
+    } else if (bench_frames > 0) {
+        benchmark(track, bench_frames);
     } else if (dumpwav) {
-        init_buffer();
-
         mkdir(dumpwavdir, 0777);
 
-        for (int i = track; i < nsf->num_songs; i++) {
-            nsf->current_song = i;
-
-            // 3 digits, WAV extension, slash, dot and NULL
-            char* dumpname = malloc(strlen(dumpwavdir) + 9);
-            sprintf(dumpname, "%s/%d.wav", dumpwavdir, nsf->current_song);
-
-            dump(filename, dumpname, i);
-
-            free(dumpname);
+        if (jobs > 1) {
+            dump_parallel(nsf, filename, dumpwavdir, track, nsf->num_songs,
+                          jobs);
+        } else {
+            for (int i = track; i < nsf->num_songs; i++) {
+                dump_track(nsf, filename, dumpwavdir, i);
+            }
         }
     } else {
-        init_buffer();
         init_sdl();
+        dataSize = freq / nsf->playback_rate * (bits / 8);
+        plan_latency();
+        init_rings();
+        SDL_PauseAudioDevice(audio_dev, 0);
 
         if (limit_time != 0) {
             *plimit_frames = limit_time * nsf->playback_rate;
@@ -587,7 +1180,7 @@ int main(int argc, char **argv) {
 
     close_nsf_file();
 
-    if (!justdisplayinfo && !dumpwav) {
+    if (!justdisplayinfo && !dumpwav && bench_frames <= 0) {
         close_sdl();
     }
 
@@ -35,179 +35,269 @@
 #include "vrc7_snd.h"
 #include "mmc5_snd.h"
 #include "fds_snd.h"
+#include "n163_snd.h"
+#include "fme07_snd.h"
+
+#ifdef NSF_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-/* TODO: bleh! should encapsulate in NSF */
-#define  MAX_ADDRESS_HANDLERS    32
-static nes6502_memread nsf_readhandler[MAX_ADDRESS_HANDLERS];
-static nes6502_memwrite nsf_writehandler[MAX_ADDRESS_HANDLERS];
-
-static nsf_t *cur_nsf = NULL;
-
-static void nsf_setcontext(nsf_t *nsf)
+static uint8 read_mirrored_ram(void *userdata, uint32 address)
 {
-   ASSERT(nsf);
-   cur_nsf = nsf;
-}
+  nsf_t *nsf = (nsf_t *) userdata;
 
-static uint8 read_mirrored_ram(uint32 address)
-{
-  nes6502_chk_mem_access(&cur_nsf->cpu->acc_mem_page[0][address & 0x7FF],
+  nes6502_chk_mem_access(nsf->cpu, nsf->cpu->acc_map[0], address & 0x7FF,
 			 NES6502_READ_ACCESS);
-  return cur_nsf->cpu->mem_page[0][address & 0x7FF];
+  return nsf->cpu->mem_page[0][address & 0x7FF];
 }
 
-static void write_mirrored_ram(uint32 address, uint8 value)
+static void write_mirrored_ram(void *userdata, uint32 address, uint8 value)
 {
-  nes6502_chk_mem_access(&cur_nsf->cpu->acc_mem_page[0][address & 0x7FF],
+  nsf_t *nsf = (nsf_t *) userdata;
+
+  nes6502_chk_mem_access(nsf->cpu, nsf->cpu->acc_map[0], address & 0x7FF,
 			 NES6502_WRITE_ACCESS);
-  cur_nsf->cpu->mem_page[0][address & 0x7FF] = value;
+  nsf->cpu->mem_page[0][address & 0x7FF] = value;
 }
 
 /* can be used for both banked and non-bankswitched NSFs */
-static void nsf_bankswitch(uint32 address, uint8 value)
+static void nsf_bankswitch(void *userdata, uint32 address, uint8 value)
 {
+   nsf_t *nsf = (nsf_t *) userdata;
    int cpu_page;
    int roffset;
    uint8 *offset;
 
    cpu_page = address & 0x0F;
-   roffset = -(cur_nsf->load_addr & 0x0FFF) + ((int)value << 12);
-   offset = cur_nsf->data + roffset;
+   roffset = -(nsf->load_addr & 0x0FFF) + ((int)value << 12);
+   /* a bank past the end of the data gets the zero bank after it */
+   if (roffset > (int) nsf->length)
+      roffset = nsf->length;
+   offset = nsf->data + roffset;
+
+   /* $6000-$7FFF is RAM (FDS tunes bank code into it), so it gets a copy
+   ** of the bank: the data is shared with our clones and stays untouched
+   */
+   if (6 == cpu_page || 7 == cpu_page)
+   {
+      memcpy(nsf->cpu->mem_page[cpu_page], offset, 0x1000);
+      return;
+   }
 
-   nes6502_getcontext(cur_nsf->cpu);
-   cur_nsf->cpu->mem_page[cpu_page] = offset;
-#ifdef NES6502_MEM_ACCESS_CTRL
-   cur_nsf->cpu->acc_mem_page[cpu_page] = offset + cur_nsf->length;
-#endif
-   nes6502_setcontext(cur_nsf->cpu);
+   nsf->cpu->mem_page[cpu_page] = offset;
+   if (nsf->acc_maps)
+   {
+      nsf->cpu->acc_map[cpu_page] = &nsf->acc_maps[NSF_ACC_DATA];
+      nsf->cpu->acc_bit[cpu_page] = (uint32) roffset;
+   }
 }
 
+/* these two don't need the nsf_t they're handed */
+static uint8 invalid_read(void *userdata, uint32 address)
+{
+   (void) userdata;
+#ifdef NOFRENDO_DEBUG
+   log_printf("filthy NSF read from $%04X\n", address);
+#else /* !NOFRENDO_DEBUG */
+   (void) address;
+#endif /* !NOFRENDO_DEBUG */
+
+   return 0xFF;
+}
+
+static void invalid_write(void *userdata, uint32 address, uint8 value)
+{
+   (void) userdata;
+#ifdef NOFRENDO_DEBUG
+   log_printf("filthy NSF tried to write $%02X to $%04X\n", value, address);
+#else /* !NOFRENDO_DEBUG */
+   (void) address;
+   (void) value;
+#endif /* !NOFRENDO_DEBUG */
+}
+
+/* handlers bound to the nsf_t */
 static nes6502_memread default_readhandler[] =
 {
    { 0x0800, 0x1FFF, read_mirrored_ram },
-   { 0x4000, 0x4017, apu_read },
    { -1,     -1,     NULL }
 };
 
 static nes6502_memwrite default_writehandler[] =
 {
    { 0x0800, 0x1FFF, write_mirrored_ram },
-   { 0x4000, 0x4017, apu_write },
    { 0x5FF6, 0x5FFF, nsf_bankswitch },
    { -1,     -1,     NULL}
 };
 
-static uint8 invalid_read(uint32 address)
+/* handlers bound to the apu_t */
+static nes6502_memread apu_readhandler[] =
 {
-#ifdef NOFRENDO_DEBUG
-   log_printf("filthy NSF read from $%04X\n", address);
-#endif /* NOFRENDO_DEBUG */
+   { 0x4000, 0x4017, apu_read },
+   { -1,     -1,     NULL }
+};
 
-   return 0xFF;
-}
+static nes6502_memwrite apu_writehandler[] =
+{
+   { 0x4000, 0x4017, apu_write },
+   { -1,     -1,     NULL}
+};
 
-static void invalid_write(uint32 address, uint8 value)
+/* handlers that catch anything nobody else claimed */
+static nes6502_memread invalid_readhandler[] =
 {
-#ifdef NOFRENDO_DEBUG
-   log_printf("filthy NSF tried to write $%02X to $%04X\n", value, address);
-#endif /* NOFRENDO_DEBUG */
-}
+   { 0x2000, 0x5BFF, invalid_read },
+   { -1,     -1,     NULL }
+};
 
-/* set up the address handlers that the CPU uses */
-static void build_address_handlers(nsf_t *nsf)
+static nes6502_memwrite invalid_writehandler[] =
 {
-   int count, num_handlers;
+   { 0x2000, 0x5BFF, invalid_write },
+   /* protect region at $8000-$FFFF */
+   { 0x8000, 0xFFFF, invalid_write },
+   { -1,     -1,     NULL}
+};
 
-   memset(nsf_readhandler, 0, sizeof(nsf_readhandler));
-   memset(nsf_writehandler, 0, sizeof(nsf_writehandler));
- 
-   num_handlers = 0;
-   for (count = 0; num_handlers < MAX_ADDRESS_HANDLERS; count++, num_handlers++)
+/* append a handler list to the nsf's tables, binding it to userdata */
+static int add_readhandlers(nsf_t *nsf, int num_handlers,
+                            const nes6502_memread *src, void *userdata)
+{
+   for (; num_handlers < MAX_ADDRESS_HANDLERS - 1; src++, num_handlers++)
    {
-      if (NULL == default_readhandler[count].read_func)
+      if (NULL == src->read_func)
          break;
 
-      memcpy(&nsf_readhandler[num_handlers], &default_readhandler[count],
-             sizeof(nes6502_memread));
+      nsf->readhandler[num_handlers] = *src;
+      nsf->readhandler[num_handlers].userdata = userdata;
    }
 
-   if (nsf->apu->ext)
+   return num_handlers;
+}
+
+static int add_writehandlers(nsf_t *nsf, int num_handlers,
+                             const nes6502_memwrite *src, void *userdata)
+{
+   for (; num_handlers < MAX_ADDRESS_HANDLERS - 1; src++, num_handlers++)
    {
-      if (NULL != nsf->apu->ext->mem_read)
-      {
-         for (count = 0; num_handlers < MAX_ADDRESS_HANDLERS; count++, num_handlers++)
-         {
-            if (NULL == nsf->apu->ext->mem_read[count].read_func)
-               break;
+      if (NULL == src->write_func)
+         break;
 
-            memcpy(&nsf_readhandler[num_handlers], &nsf->apu->ext->mem_read[count],
-                   sizeof(nes6502_memread));
-         }
-      }
+      nsf->writehandler[num_handlers] = *src;
+      nsf->writehandler[num_handlers].userdata = userdata;
    }
 
-   /* catch-all for bad reads */
-   nsf_readhandler[num_handlers].min_range = 0x2000; /* min address */
-   nsf_readhandler[num_handlers].max_range = 0x5BFF; /* max address */
-   nsf_readhandler[num_handlers].read_func = invalid_read; /* handler */
-   num_handlers++;
-   nsf_readhandler[num_handlers].min_range = -1;
-   nsf_readhandler[num_handlers].max_range = -1;
-   nsf_readhandler[num_handlers].read_func = NULL;
-   num_handlers++;
-   ASSERT(num_handlers <= MAX_ADDRESS_HANDLERS);
-
-   num_handlers = 0;
-   for (count = 0; num_handlers < MAX_ADDRESS_HANDLERS; count++, num_handlers++)
+   return num_handlers;
+}
+
+/* whether any chip but the ext'th also answers writes to src's range */
+static boolean ext_write_shared(apu_t *apu, int ext, const apu_memwrite *src)
+{
+   const apu_memwrite *pmw;
+   int i;
+
+   for (i = 0; i < apu->num_ext; i++)
    {
-      if (NULL == default_writehandler[count].write_func)
-         break;
+      if (i == ext)
+         continue;
 
-      memcpy(&nsf_writehandler[num_handlers], &default_writehandler[count],
-             sizeof(nes6502_memwrite));
+      for (pmw = apu->ext[i]->mem_write; pmw && pmw->write_func; pmw++)
+      {
+         if (pmw->min_range <= src->max_range
+             && pmw->max_range >= src->min_range)
+            return TRUE;
+      }
    }
 
-   if (nsf->apu->ext)
+   return FALSE;
+}
+
+/* add every expansion chip's write handlers; a range some other chip
+** shares goes through apu_extwrite() instead, so both chips see it
+*/
+static int add_extwritehandlers(nsf_t *nsf, int num_handlers)
+{
+   apu_t *apu = nsf->apu;
+   const apu_memwrite *pmw;
+   nes6502_memwrite one[2];
+   int i;
+
+   one[1].min_range = one[1].max_range = -1;
+   one[1].write_func = NULL;
+
+   for (i = 0; i < apu->num_ext; i++)
    {
-      if (NULL != nsf->apu->ext->mem_write)
+      for (pmw = apu->ext[i]->mem_write; pmw && pmw->write_func; pmw++)
       {
-         for (count = 0; num_handlers < MAX_ADDRESS_HANDLERS; count++, num_handlers++)
-         {
-            if (NULL == nsf->apu->ext->mem_write[count].write_func)
-               break;
+         one[0].min_range = pmw->min_range;
+         one[0].max_range = pmw->max_range;
 
-            memcpy(&nsf_writehandler[num_handlers], &nsf->apu->ext->mem_write[count],
-                   sizeof(nes6502_memwrite));
+         if (ext_write_shared(apu, i, pmw))
+         {
+            one[0].write_func = apu_extwrite;
+            num_handlers = add_writehandlers(nsf, num_handlers, one, apu);
+         }
+         else
+         {
+            one[0].write_func = pmw->write_func;
+            num_handlers = add_writehandlers(nsf, num_handlers, one,
+                                             apu->ext_data[i]);
          }
       }
    }
 
-   /* catch-all for bad writes */
-   nsf_writehandler[num_handlers].min_range = 0x2000; /* min address */
-   nsf_writehandler[num_handlers].max_range = 0x5BFF; /* max address */
-   nsf_writehandler[num_handlers].write_func = invalid_write; /* handler */
-   num_handlers++;
-   /* protect region at $8000-$FFFF */
-   nsf_writehandler[num_handlers].min_range = 0x8000; /* min address */
-   nsf_writehandler[num_handlers].max_range = 0xFFFF; /* max address */
-   nsf_writehandler[num_handlers].write_func = invalid_write; /* handler */
-   num_handlers++;
-   nsf_writehandler[num_handlers].min_range = -1;
-   nsf_writehandler[num_handlers].max_range = -1;
-   nsf_writehandler[num_handlers].write_func = NULL;
-   num_handlers++;
-   ASSERT(num_handlers <= MAX_ADDRESS_HANDLERS);
+   return num_handlers;
+}
+
+/* set up the address handlers that the CPU uses */
+static void build_address_handlers(nsf_t *nsf)
+{
+   int num_handlers, i;
+
+   memset(nsf->readhandler, 0, sizeof(nsf->readhandler));
+   memset(nsf->writehandler, 0, sizeof(nsf->writehandler));
+
+   num_handlers = add_readhandlers(nsf, 0, default_readhandler, nsf);
+   num_handlers = add_readhandlers(nsf, num_handlers, apu_readhandler,
+                                   nsf->apu);
+   /* apu_memread has the same layout as nes6502_memread */
+   for (i = 0; i < nsf->apu->num_ext; i++)
+   {
+      if (nsf->apu->ext[i]->mem_read)
+         num_handlers = add_readhandlers(nsf, num_handlers,
+                           (nes6502_memread *) nsf->apu->ext[i]->mem_read,
+                           nsf->apu->ext_data[i]);
+   }
+   num_handlers = add_readhandlers(nsf, num_handlers, invalid_readhandler,
+                                   nsf);
+   nsf->readhandler[num_handlers].min_range = -1;
+   nsf->readhandler[num_handlers].max_range = -1;
+   nsf->readhandler[num_handlers].read_func = NULL;
+
+   num_handlers = add_writehandlers(nsf, 0, default_writehandler, nsf);
+   num_handlers = add_writehandlers(nsf, num_handlers, apu_writehandler,
+                                    nsf->apu);
+   num_handlers = add_extwritehandlers(nsf, num_handlers);
+   num_handlers = add_writehandlers(nsf, num_handlers, invalid_writehandler,
+                                    nsf);
+   nsf->writehandler[num_handlers].min_range = -1;
+   nsf->writehandler[num_handlers].max_range = -1;
+   nsf->writehandler[num_handlers].write_func = NULL;
+
+   nes6502_sethandlers(nsf->cpu, nsf->readhandler, nsf->writehandler);
 }
 
 #define  NSF_ROUTINE_LOC   0x5000
 
 /* sets up a simple loop that calls the desired routine and spins */
-static void nsf_setup_routine(uint32 address, uint8 a_reg, uint8 x_reg)
+static void nsf_setup_routine(nsf_t *nsf, uint32 address, uint8 a_reg,
+                              uint8 x_reg)
 {
    uint8 *mem;
 
-   nes6502_getcontext(cur_nsf->cpu);
-   mem = cur_nsf->cpu->mem_page[NSF_ROUTINE_LOC >> 12] + (NSF_ROUTINE_LOC & 0x0FFF);
+   mem = nsf->cpu->mem_page[NSF_ROUTINE_LOC >> 12] + (NSF_ROUTINE_LOC & 0x0FFF);
 
    /* our lovely 4-byte 6502 NSF player */
    mem[0] = 0x20;            /* JSR address */
@@ -215,38 +305,45 @@ static void nsf_setup_routine(uint32 address, uint8 a_reg, uint8 x_reg)
    mem[2] = address >> 8;
    mem[3] = 0xF2;            /* JAM (cpu kill op) */
 
-   cur_nsf->cpu->pc_reg = NSF_ROUTINE_LOC;
-   cur_nsf->cpu->a_reg = a_reg;
-   cur_nsf->cpu->x_reg = x_reg;
-   cur_nsf->cpu->y_reg = 0;
-   cur_nsf->cpu->s_reg = 0xFF;
-
-   nes6502_setcontext(cur_nsf->cpu);
+   nsf->cpu->pc_reg = NSF_ROUTINE_LOC;
+   nsf->cpu->a_reg = a_reg;
+   nsf->cpu->x_reg = x_reg;
+   nsf->cpu->y_reg = 0;
+   nsf->cpu->s_reg = 0xFF;
 }
 
-/* retrieve any external soundchip driver */
-static apuext_t *nsf_getext(nsf_t *nsf)
+/* external soundchip drivers, by header bit */
+static const struct
 {
-   switch (nsf->ext_sound_type)
-   {
-   case EXT_SOUND_VRCVI:
-      return &vrcvi_ext;
-
-   case EXT_SOUND_VRCVII:
-      return &vrc7_ext;
+   uint8 type;
+   apuext_t *ext;
+} nsf_exts[] =
+{
+   { EXT_SOUND_VRCVI,         &vrcvi_ext },
+   { EXT_SOUND_VRCVII,        &vrc7_ext },
+   { EXT_SOUND_FDS,           &fds_ext },
+   { EXT_SOUND_MMC5,          &mmc5_ext },
+   { EXT_SOUND_NAMCO106,      &n163_ext },
+   { EXT_SOUND_SUNSOFT_FME07, &fme07_ext },
+   { EXT_SOUND_NONE,          NULL }
+};
 
-   case EXT_SOUND_FDS:
-      return &fds_ext;
+/* attach a driver for every external soundchip the header asks for */
+static int nsf_setexts(nsf_t *nsf)
+{
+   int i;
 
-   case EXT_SOUND_MMC5:
-      return &mmc5_ext;
+   if (apu_setext(nsf->apu, NULL))
+      return -1;
 
-   case EXT_SOUND_NAMCO106:
-   case EXT_SOUND_SUNSOFT_FME07:
-   case EXT_SOUND_NONE:
-   default:
-      return NULL;
+   for (i = 0; nsf_exts[i].ext; i++)
+   {
+      if ((nsf->ext_sound_type & nsf_exts[i].type)
+          && apu_addext(nsf->apu, nsf_exts[i].ext))
+         return -1;
    }
+
+   return 0;
 }
 
 static void nsf_inittune(nsf_t *nsf)
@@ -258,12 +355,22 @@ static void nsf_inittune(nsf_t *nsf)
    memset(nsf->cpu->mem_page[6], 0, 0x1000);
    memset(nsf->cpu->mem_page[7], 0, 0x1000);
 
-#ifdef NES6502_MEM_ACCESS_CTRL
-   memset(nsf->cpu->acc_mem_page[0], 0, 0x800);
-   memset(nsf->cpu->acc_mem_page[6], 0, 0x1000);
-   memset(nsf->cpu->acc_mem_page[7], 0, 0x1000);
-   memset(nsf->data+nsf->length, 0, nsf->length);
-#endif
+   if (nsf->acc_maps)
+   {
+      int i;
+
+      for (i = 0; i < NSF_ACC_MAPS; i++)
+         nes6502_accmap_clear(&nsf->acc_maps[i]);
+   }
+
+   /* whatever played before, start from the cpu state of a freshly
+   ** loaded file: the apu queue's timestamps count from zero again
+   */
+   nes6502_getcycles(nsf->cpu, TRUE);
+   nsf->cpu->dma_cycles = 0;
+   nsf->cpu->int_pending = 0;
+   nsf->cpu->p_reg = 0;
+
    nsf->cur_frame = 0;
 /*    nsf->last_access_frame = 0; */
    nsf->cur_frame_end = !nsf->song_frames
@@ -273,14 +380,14 @@ static void nsf_inittune(nsf_t *nsf)
    if (nsf->bankswitched)
    {
       /* the first hack of the NSF spec! */
-      if (EXT_SOUND_FDS == nsf->ext_sound_type)
+      if (nsf->ext_sound_type & EXT_SOUND_FDS)
       {
-         nsf_bankswitch(0x5FF6, nsf->bankswitch_info[6]);
-         nsf_bankswitch(0x5FF7, nsf->bankswitch_info[7]);
+         nsf_bankswitch(nsf, 0x5FF6, nsf->bankswitch_info[6]);
+         nsf_bankswitch(nsf, 0x5FF7, nsf->bankswitch_info[7]);
       }
 
       for (bank = 0; bank < 8; bank++)
-         nsf_bankswitch(0x5FF8 + bank, nsf->bankswitch_info[bank]);
+         nsf_bankswitch(nsf, 0x5FF8 + bank, nsf->bankswitch_info[bank]);
    }
    else
    {
@@ -289,13 +396,13 @@ static void nsf_inittune(nsf_t *nsf)
 
       /* avoid ripper filth */
       for (bank = 0; bank < 8; bank++)
-         nsf_bankswitch(0x5FF8 + bank, bank);
+         nsf_bankswitch(nsf, 0x5FF8 + bank, bank);
 
       start_bank = nsf->load_addr >> 12;
       num_banks = ((nsf->load_addr + nsf->length - 1) >> 12) - start_bank + 1;
 
       for (bank = 0; bank < num_banks; bank++)
-         nsf_bankswitch(0x5FF0 + start_bank + bank, bank);
+         nsf_bankswitch(nsf, 0x5FF0 + start_bank + bank, bank);
    }
 
    /* determine PAL/NTSC compatibility shite */
@@ -305,40 +412,29 @@ static void nsf_inittune(nsf_t *nsf)
       x_reg = 0;
 
    /* execute 1 frame or so; let init routine run free */
-   nsf_setup_routine(nsf->init_addr, (uint8) (nsf->current_song - 1), x_reg);
-   nes6502_execute((int) NES_FRAME_CYCLES);
+   nsf_setup_routine(nsf, nsf->init_addr, (uint8) (nsf->current_song - 1),
+                     x_reg);
+   nes6502_execute(nsf->cpu, (int) NES_FRAME_CYCLES);
 }
 
 void nsf_frame(nsf_t *nsf)
 {
-    // This is how Matthew Conte left it
-    //nsf_setcontext(nsf); /* future expansion =) */
-
-    // This was suggested by Arne Morten Kvarving, who says:
-/*	Also, I fixed a bug that prevented Nosefart to play multiple tunes at
-	one time (actually it was just a few missing setcontext calls in the
-	playback routine, it had a nice TODO commented beside it. You had to set
-	the cpu and apu contexts not just the nsf context).
-
-	it will affect any player that tries to use nosefart to play more than one
-	tune at a time.
-*/
-    nsf_setcontext(nsf);
-    apu_setcontext(nsf->apu);
-    nes6502_setcontext(nsf->cpu);
+   /* every nsf carries its own cpu and apu, so there is no context to
+   ** swap in here; any number of tunes can play at once
+   */
 
    /* one frame of NES processing */
-   nsf_setup_routine(nsf->play_addr, 0, 0);
-   nes6502_execute((int) NES_FRAME_CYCLES);
+   nsf_setup_routine(nsf, nsf->play_addr, 0, 0);
+   nes6502_execute(nsf->cpu, (int) NES_FRAME_CYCLES);
 
    ++nsf->cur_frame;
-#if defined(NES6502_MEM_ACCESS_CTRL) && 0
-   if (nes6502_mem_access) {
+#if 0
+   if (nsf->cpu->mem_access) {
      uint32 sec =
        (nsf->last_access_frame + nsf->playback_rate - 1) / nsf->playback_rate;
      nsf->last_access_frame = nsf->cur_frame;
      fprintf(stderr,"nsf : memory access [%x] at frame #%u [%u:%02u]\n",
-		nes6502_mem_access,
+		nsf->cpu->mem_access,
 		nsf->last_access_frame,
 		sec/60, sec%60);
    }
@@ -366,25 +462,23 @@ void nes_shutdown(nsf_t *nsf)
 	}
       }
 
-#ifdef NES6502_MEM_ACCESS_CTRL
-      if (nsf->cpu->acc_mem_page[0])
-	{
- 	  free(nsf->cpu->acc_mem_page[0]);
-	}
-      for (i = 5; i <= 7; i++) {
-	if (nsf->cpu->acc_mem_page[i])
-	  {
-		free(nsf->cpu->acc_mem_page[i]);
-	  }
-      }
-#endif
       free(nsf->cpu);
    }
 }
 
+/* builds the tables every instance shares, and does nothing after the
+** first successful call -- make that one before starting any threads
+*/
 int nsf_init(void)
 {
+   static boolean inited = FALSE;
+
+   if (inited)
+      return 0;
+
    nes6502_init();
+
+   inited = TRUE;
    return 0;
 }
 
@@ -411,22 +505,6 @@ static int nsf_cpuinit(nsf_t *nsf)
          return -1;
    }
 
-#ifdef NES6502_MEM_ACCESS_CTRL
-   nsf->cpu->acc_mem_page[0] = malloc(0x800);
-   if (NULL == nsf->cpu->acc_mem_page[0])
-      return -1;
-   /* allocate some space for the NSF "player" MMC5 EXRAM, and WRAM */
-   for (i = 5; i <= 7; i++)
-   {
-      nsf->cpu->acc_mem_page[i] = malloc(0x1000);
-      if (NULL == nsf->cpu->acc_mem_page[i])
-         return -1;
-   }
-#endif
-
-   nsf->cpu->read_handler = nsf_readhandler;
-   nsf->cpu->write_handler = nsf_writehandler;
-
    return 0;
 }
 
@@ -579,17 +657,203 @@ static const char * nfs_fname_file(struct nsf_loader_t *loader)
   return floader->fname ? floader->fname : "<null>";
 }
 
-static struct nsf_file_loader_t nsf_file_loader = {
+#ifndef NSF_MMAP
+static const struct nsf_file_loader_t nsf_file_loader = {
   {
     nfs_open_file,
     nfs_close_file,
     nfs_read_file,
     nfs_length_file,
     nfs_skip_file,
-    nfs_fname_file
+    nfs_fname_file,
+    0
   },
   0,0,0
 };
+#endif /* !NSF_MMAP */
+
+#ifdef NSF_MMAP
+/* mmap() loader : the FILE loader, with the file mapped so the NSF data is
+ * used in place instead of being read into a buffer. The mapping sits
+ * between zero pages so banks running off either end of the data stay
+ * readable, and once the data is handed over everything around it is
+ * zeroed too (see nfs_map_mmap), so the cpu sees what it would in a
+ * buffer. Where the file cannot be mapped it falls back on plain reads.
+ */
+struct nsf_mmap_loader_t {
+  struct nsf_file_loader_t file;
+  nsf_map_t map;
+  uint8 *mem;
+  unsigned long cur;
+  unsigned long len;
+  uint8 *tail; /* past the data handed over, to zero on close */
+};
+
+static void nfs_unmap(nsf_map_t *map)
+{
+  if (map->base) {
+    munmap(map->base, map->size);
+    map->base = 0;
+    map->size = 0;
+  }
+}
+
+static int nfs_open_mmap(struct nsf_loader_t *loader)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  struct stat st;
+  unsigned long pad, size;
+  uint8 *base;
+
+  mloader->map.base = 0;
+  mloader->mem = 0;
+  mloader->cur = 0;
+  mloader->len = 0;
+  mloader->tail = 0;
+  if (nfs_open_file(loader) < 0) {
+    return -1;
+  }
+
+  if (fstat(fileno(mloader->file.fp), &st) || st.st_size <= 0) {
+    return 0;
+  }
+  pad = sysconf(_SC_PAGESIZE);
+  if (pad < 0x1000) {
+    pad = 0x1000;
+  }
+  size = (st.st_size + pad - 1) & ~(pad - 1);
+
+  /* reserve zeros all around, then lay the file over the middle */
+  base = mmap(0, pad + size + pad, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == base) {
+    return 0;
+  }
+  if (MAP_FAILED == mmap(base + pad, st.st_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED, fileno(mloader->file.fp), 0)) {
+    munmap(base, pad + size + pad);
+    return 0;
+  }
+  mloader->map.base = base;
+  mloader->map.size = pad + size + pad;
+  mloader->mem = base + pad;
+  mloader->len = st.st_size;
+
+  /* the mapping outlives the descriptor */
+  fclose(mloader->file.fp);
+  mloader->file.fp = 0;
+  return 0;
+}
+
+/* zero the part of [from, to) that isn't data: whole pages are replaced
+ * by anonymous ones, the rest is cleared in our private copy */
+static void nfs_zero_mmap(uint8 *from, uint8 *to)
+{
+  unsigned long pg = sysconf(_SC_PAGESIZE);
+  uint8 *first = (uint8 *) (((unsigned long) from + pg - 1) & ~(pg - 1));
+  uint8 *last = (uint8 *) ((unsigned long) to & ~(pg - 1));
+
+  if (first < last
+      && MAP_FAILED != mmap(first, last - first, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)) {
+    memset(from, 0, first - from);
+    memset(last, 0, to - last);
+  } else {
+    memset(from, 0, to - from);
+  }
+}
+
+static void nfs_close_mmap(struct nsf_loader_t *loader)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  if (mloader->tail) {
+    nfs_zero_mmap(mloader->tail, mloader->mem + mloader->len);
+    mloader->tail = 0;
+  }
+  nfs_unmap(&mloader->map);
+  mloader->mem = 0;
+  nfs_close_file(loader);
+}
+
+static int nfs_read_mmap(struct nsf_loader_t *loader, void *data, int n)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  int rem;
+  if (!mloader->mem) {
+    return nfs_read_file(loader, data, n);
+  }
+  if (n <= 0) {
+    return n;
+  }
+  rem = mloader->len - mloader->cur;
+  if (rem > n) {
+    rem = n;
+  }
+  memcpy(data, mloader->mem + mloader->cur, rem);
+  mloader->cur += rem;
+  return n - rem;
+}
+
+static int nfs_length_mmap(struct nsf_loader_t *loader)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  if (!mloader->mem) {
+    return nfs_length_file(loader);
+  }
+  return mloader->len;
+}
+
+static int nfs_skip_mmap(struct nsf_loader_t *loader, int n)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  unsigned long goal = mloader->cur + n;
+  if (!mloader->mem) {
+    return nfs_skip_file(loader, n);
+  }
+  mloader->cur = (goal > mloader->len) ? mloader->len : goal;
+  return goal - mloader->cur;
+}
+
+static uint8 * nfs_map_mmap(struct nsf_loader_t *loader, int n,
+			    nsf_map_t *map)
+{
+  struct nsf_mmap_loader_t * mloader = (struct nsf_mmap_loader_t *)loader;
+  uint8 *data;
+  if (!mloader->mem || n <= 0
+      || (unsigned long) n > mloader->len - mloader->cur) {
+    return 0;
+  }
+  data = mloader->mem + mloader->cur;
+  mloader->cur += n;
+
+  /* a bank that runs off either end of the data has to see zeros, not
+   * the header or the chunks after it; those are still to be read, so
+   * they go when the loader is closed */
+  nfs_zero_mmap(mloader->mem, data);
+  mloader->tail = data + n;
+  /* hand it over; reads of what follows go on from the same memory */
+  *map = mloader->map;
+  mloader->map.base = 0;
+  mloader->map.size = 0;
+  return data;
+}
+
+static const struct nsf_mmap_loader_t nsf_mmap_loader = {
+  {
+    {
+      nfs_open_mmap,
+      nfs_close_mmap,
+      nfs_read_mmap,
+      nfs_length_mmap,
+      nfs_skip_mmap,
+      nfs_fname_file,
+      nfs_map_mmap
+    },
+    0,0,0
+  },
+  {0,0},0,0,0,0
+};
+#endif /* NSF_MMAP */
 
 struct nsf_mem_loader_t {
   struct nsf_loader_t loader;
@@ -658,8 +922,9 @@ static const char * nfs_fname_mem(struct nsf_loader_t *loader)
   return mloader->fname;
 }
 
-static struct nsf_mem_loader_t nsf_mem_loader = {
-  { nfs_open_mem, nfs_close_mem, nfs_read_mem, nfs_length_mem, nfs_skip_mem },
+static const struct nsf_mem_loader_t nsf_mem_loader = {
+  { nfs_open_mem, nfs_close_mem, nfs_read_mem, nfs_length_mem, nfs_skip_mem,
+    nfs_fname_mem, 0 },
   0,0,0
 };
 
@@ -767,27 +1032,44 @@ nsf_t * nsf_load_extended(struct nsf_loader_t * loader)
     goto error;
   }
 
-  /* Allocate NSF space, and load it up! */
-  {
-    int len = temp_nsf->length;
-#ifdef NES6502_MEM_ACCESS_CTRL
-    /* $$$ twice memory for access control shadow mem. */
-    len <<= 1;
-#endif
-   temp_nsf->data = malloc(len);
-  }
-  if (NULL == temp_nsf->data) {
-    log_printf("nsf : [%s] error allocating nsf data\n",
+  temp_nsf->rom = malloc(sizeof(nsf_rom_t));
+  if (NULL == temp_nsf->rom) {
+    log_printf("nsf : [%s] error allocating nsf rom\n",
 	       loader->fname(loader));
     goto error;
   }
+  memset(temp_nsf->rom, 0, sizeof(nsf_rom_t));
+  temp_nsf->rom->length = temp_nsf->length;
+  temp_nsf->rom->refcount = 1;
+
+  /* Use the data where the loader has it, if it can tell us */
+  if (loader->map) {
+    temp_nsf->rom->data = loader->map(loader, temp_nsf->length,
+				      &temp_nsf->rom->map);
+  }
 
-  /* Read data */
-  if (loader->read(loader, temp_nsf->data, temp_nsf->length)) {
-    log_printf("nsf : [%s] error reading NSF data\n",
-	       loader->fname(loader));
-    goto error;
+  if (NULL == temp_nsf->rom->data) {
+    /* Allocate NSF space, and load it up! */
+    /* with a bank of zeros either side of it, for first and last banks
+     * that run past the ends of the data */
+    temp_nsf->rom->block = malloc(0x1000 + temp_nsf->length + 0x1000);
+    if (NULL == temp_nsf->rom->block) {
+      log_printf("nsf : [%s] error allocating nsf data\n",
+		 loader->fname(loader));
+      goto error;
+    }
+    temp_nsf->rom->data = (uint8 *) temp_nsf->rom->block + 0x1000;
+    memset(temp_nsf->rom->block, 0, 0x1000);
+    memset(temp_nsf->rom->data + temp_nsf->length, 0, 0x1000);
+
+    /* Read data */
+    if (loader->read(loader, temp_nsf->rom->data, temp_nsf->length)) {
+      log_printf("nsf : [%s] error reading NSF data\n",
+		 loader->fname(loader));
+      goto error;
+    }
   }
+  temp_nsf->data = temp_nsf->rom->data;
 
   /* Here comes the second part of spec > 1 : get extension */
   while (!loader->read(loader, &nsf_file_ext, sizeof(nsf_file_ext))
@@ -896,21 +1178,102 @@ nsf_t * nsf_load_extended(struct nsf_loader_t * loader)
 /* Load a ROM image into memory */
 nsf_t *nsf_load(const char *filename, void *source, int length)
 {
+  /* loaders live on the stack so concurrent loads do not collide */
+#ifdef NSF_MMAP
+  struct nsf_mmap_loader_t mmap_loader = nsf_mmap_loader;
+#else
+  struct nsf_file_loader_t file_loader = nsf_file_loader;
+#endif
+  struct nsf_mem_loader_t mem_loader = nsf_mem_loader;
   struct nsf_loader_t * loader = 0;
 
   /* $$$ ben : new loader */
   if (filename) {
-    nsf_file_loader.fname = (char *)filename;
-    loader = &nsf_file_loader.loader;
+#ifdef NSF_MMAP
+    mmap_loader.file.fname = (char *)filename;
+    loader = &mmap_loader.file.loader;
+#else
+    file_loader.fname = (char *)filename;
+    loader = &file_loader.loader;
+#endif
   } else {
-    nsf_mem_loader.data = source;
-    nsf_mem_loader.len = length;
-    nsf_mem_loader.fname[0] = 0;
-    loader = &nsf_mem_loader.loader;
+    mem_loader.data = source;
+    mem_loader.len = length;
+    mem_loader.fname[0] = 0;
+    loader = &mem_loader.loader;
   }
   return nsf_load_extended(loader);
 }
 
+#ifdef __GNUC__
+#define  ROM_ADDREF(rom, n)   __sync_add_and_fetch(&(rom)->refcount, (n))
+#else /* !__GNUC__ */
+/* no atomics: clones of one NSF mustn't be made or freed concurrently */
+#define  ROM_ADDREF(rom, n)   ((rom)->refcount += (n))
+#endif /* !__GNUC__ */
+
+/* drop a reference to the NSF data, and free it with the last one */
+static void nsf_rom_release(nsf_rom_t *rom)
+{
+   if (NULL == rom || ROM_ADDREF(rom, -1) > 0)
+      return;
+
+#ifdef NSF_MMAP
+   if (rom->map.base)
+      nfs_unmap(&rom->map);
+#endif /* NSF_MMAP */
+   if (rom->block)
+      free(rom->block);
+   free(rom);
+}
+
+/* Make another instance of a loaded NSF.  It shares the data with nsf,
+** and gets RAM, WRAM, the player page and, once playing, an APU of its
+** own: about 24KB, most of it the 12KB of pages 5-7 and the 4KB cpu
+** context, plus whatever its sound chips need.  It can play in another
+** thread.
+*/
+nsf_t *nsf_clone(nsf_t *nsf)
+{
+   nsf_t *clone;
+
+   if (NULL == nsf || NULL == nsf->rom)
+      return NULL;
+
+   clone = malloc(sizeof(nsf_t));
+   if (NULL == clone)
+      return NULL;
+
+   /* header and settings come along, anything the instance owns doesn't */
+   memcpy(clone, nsf, sizeof(nsf_t));
+   ROM_ADDREF(clone->rom, 1);
+   clone->acc_maps = NULL;
+   clone->song_frames = NULL;
+   clone->cpu = NULL;
+   clone->apu = NULL;
+   memset(clone->readhandler, 0, sizeof(clone->readhandler));
+   memset(clone->writehandler, 0, sizeof(clone->writehandler));
+
+   if (nsf->song_frames)
+   {
+      size_t size = sizeof(*nsf->song_frames) * (nsf->num_songs + 1);
+
+      clone->song_frames = malloc(size);
+      if (NULL == clone->song_frames)
+         goto error;
+      memcpy(clone->song_frames, nsf->song_frames, size);
+   }
+
+   if (nsf_cpuinit(clone))
+      goto error;
+
+   return clone;
+
+ error:
+   nsf_free(&clone);
+   return NULL;
+}
+
 /* Free an NSF */
 void nsf_free(nsf_t **pnsf)
 {
@@ -931,8 +1294,14 @@ void nsf_free(nsf_t **pnsf)
 
     nes_shutdown(nsf);
     
-    if (nsf->data)
-      free(nsf->data);
+    nsf_rom_release(nsf->rom);
+
+    if (nsf->acc_maps) {
+      int i;
+      for (i = 0; i < NSF_ACC_MAPS; i++)
+	nes6502_accmap_free(&nsf->acc_maps[i]);
+      free(nsf->acc_maps);
+    }
 
     if (nsf->song_frames)
       free (nsf->song_frames);
@@ -941,13 +1310,567 @@ void nsf_free(nsf_t **pnsf)
   }
 }
 
+/* Switch on memory access tracking for the playing time calculation: the
+** CPU runs its tracking core from now on, with access maps for RAM,
+** EXRAM/WRAM and the NSF data.  Call it before nsf_playtrack().
+*/
+int nsf_trackaccess(nsf_t *nsf)
+{
+   int i;
+
+   if (!nsf || !nsf->cpu)
+      return -1;
+   if (nsf->cpu->track_access)
+      return 0;
+
+   /* nsf_free() takes care of it if any of this fails */
+   nsf->acc_maps = malloc(NSF_ACC_MAPS * sizeof(nes6502_accmap));
+   if (NULL == nsf->acc_maps)
+      return -1;
+   memset(nsf->acc_maps, 0, NSF_ACC_MAPS * sizeof(nes6502_accmap));
+
+   if (nes6502_accmap_init(&nsf->acc_maps[NSF_ACC_RAM], 0x800)
+       || nes6502_accmap_init(&nsf->acc_maps[NSF_ACC_DATA],
+                              nsf->length + 0x1000))
+      return -1;
+   nsf->cpu->acc_map[0] = &nsf->acc_maps[NSF_ACC_RAM];
+   nsf->cpu->acc_bit[0] = 0;
+
+   for (i = 5; i <= 7; i++)
+   {
+      if (nes6502_accmap_init(&nsf->acc_maps[NSF_ACC_PAGE5 + i - 5], 0x1000))
+         return -1;
+      nsf->cpu->acc_map[i] = &nsf->acc_maps[NSF_ACC_PAGE5 + i - 5];
+      nsf->cpu->acc_bit[i] = 0;
+   }
+
+   nsf->cpu->track_access = TRUE;
+   return 0;
+}
+
+/* what nsf_snapshot() writes: this, then RAM, the $5000-$7FFF pages and
+** the apu state
+*/
+#define  NSF_STATE_MAGIC   "NSFs"
+
+typedef struct nsf_state_s
+{
+   uint8  magic[4];
+   uint32 size;               /* all of it */
+   uint32 length;             /* of the NSF data it was taken with */
+   uint32 cur_frame;
+   uint8  current_song;
+   uint8  a_reg, p_reg, x_reg, y_reg, s_reg;
+   uint8  int_pending;
+   uint8  pad;
+   uint32 pc_reg;
+   int32  dma_cycles;
+   uint32 total_cycles;
+   int32  bank[8];            /* offset into the data of $8000-$FFFF */
+} nsf_state_t;
+
+#define  NSF_STATE_MEM     (0x800 + 3 * 0x1000)
+
+/* Save the whole machine of a playing NSF into buf: CPU, memory, bank
+** mapping, APU and expansion chip.  Returns the bytes written, or with a
+** NULL buf the bytes needed; -1 if it isn't playing or buf is too small.
+*/
+int nsf_snapshot(nsf_t *nsf, void *buf, int size)
+{
+   nsf_state_t *state = (nsf_state_t *) buf;
+   nes6502_context *cpu;
+   uint8 *mem;
+   int need, i;
+
+   if (NULL == nsf || NULL == nsf->cpu || NULL == nsf->apu)
+      return -1;
+
+   need = sizeof(nsf_state_t) + NSF_STATE_MEM + apu_statesize(nsf->apu);
+   if (NULL == buf)
+      return need;
+   if (size < need)
+      return -1;
+
+   cpu = nsf->cpu;
+   memcpy(state->magic, NSF_STATE_MAGIC, 4);
+   state->size = need;
+   state->length = nsf->length;
+   state->cur_frame = nsf->cur_frame;
+   state->current_song = nsf->current_song;
+   state->a_reg = cpu->a_reg;
+   state->p_reg = cpu->p_reg;
+   state->x_reg = cpu->x_reg;
+   state->y_reg = cpu->y_reg;
+   state->s_reg = cpu->s_reg;
+   state->int_pending = cpu->int_pending;
+   state->pad = 0;
+   state->pc_reg = cpu->pc_reg;
+   state->dma_cycles = cpu->dma_cycles;
+   state->total_cycles = cpu->total_cycles;
+   for (i = 0; i < 8; i++)
+      state->bank[i] = cpu->mem_page[8 + i] - nsf->data;
+
+   mem = (uint8 *) (state + 1);
+   memcpy(mem, cpu->mem_page[0], 0x800);
+   for (i = 5; i <= 7; i++)
+      memcpy(mem + 0x800 + (i - 5) * 0x1000, cpu->mem_page[i], 0x1000);
+
+   apu_savestate(nsf->apu, mem + NSF_STATE_MEM);
+   return need;
+}
+
+/* Put back a snapshot of this NSF.  It has to be playing, through
+** nsf_playtrack() with the same sample and playback rates; the track is
+** the snapshot's.  Returns -1, changing nothing, if the state won't fit.
+*/
+int nsf_restore(nsf_t *nsf, const void *buf, int size)
+{
+   const nsf_state_t *state = (const nsf_state_t *) buf;
+   nes6502_context *cpu;
+   const uint8 *mem;
+   int i;
+
+   if (NULL == nsf || NULL == nsf->cpu || NULL == nsf->apu || NULL == buf
+       || size < (int) (sizeof(nsf_state_t) + NSF_STATE_MEM)
+       || memcmp(state->magic, NSF_STATE_MAGIC, 4)
+       || state->size != (uint32) size
+       || state->length != nsf->length
+       || state->current_song < 1 || state->current_song > nsf->num_songs)
+      return -1;
+
+   for (i = 0; i < 8; i++)
+      if (state->bank[i] < -0x0FFF || state->bank[i] > (int32) nsf->length)
+         return -1;
+
+   mem = (const uint8 *) (state + 1);
+   if (apu_loadstate(nsf->apu, mem + NSF_STATE_MEM,
+                     size - sizeof(nsf_state_t) - NSF_STATE_MEM))
+      return -1;
+
+   cpu = nsf->cpu;
+   memcpy(cpu->mem_page[0], mem, 0x800);
+   for (i = 5; i <= 7; i++)
+      memcpy(cpu->mem_page[i], mem + 0x800 + (i - 5) * 0x1000, 0x1000);
+
+   for (i = 0; i < 8; i++)
+   {
+      cpu->mem_page[8 + i] = nsf->data + state->bank[i];
+      if (nsf->acc_maps)
+      {
+         cpu->acc_map[8 + i] = &nsf->acc_maps[NSF_ACC_DATA];
+         cpu->acc_bit[8 + i] = (uint32) state->bank[i];
+      }
+   }
+
+   cpu->a_reg = state->a_reg;
+   cpu->p_reg = state->p_reg;
+   cpu->x_reg = state->x_reg;
+   cpu->y_reg = state->y_reg;
+   cpu->s_reg = state->s_reg;
+   cpu->int_pending = state->int_pending;
+   cpu->pc_reg = state->pc_reg;
+   cpu->dma_cycles = state->dma_cycles;
+   cpu->total_cycles = state->total_cycles;
+#ifdef NES6502_IDLE_SKIP
+   cpu->idle_ok = 0;
+#endif
+
+   nsf->current_song = state->current_song;
+   nsf->cur_frame = state->cur_frame;
+   nsf->cur_frame_end = !nsf->song_frames
+     ? 0
+     : nsf->song_frames[nsf->current_song];
+   return 0;
+}
+
+/* snapshots are mostly zeros (untouched RAM and WRAM), so keyframes are
+** stored as runs: a 16-bit count of literal bytes, the bytes, then a
+** 16-bit count of zeros.  Packing never grows a state by more than
+** NSF_PACK_SLACK bytes.
+*/
+#define  NSF_PACK_SLACK(size)    (4 * ((size) / 0xFFFF + 2))
+
+static int nsf_packstate(const uint8 *src, int size, uint8 *dst)
+{
+   int in = 0, out = 0;
+
+   while (in < size)
+   {
+      int lit = 0, zero = 0;
+
+      /* literals, up to a run of zeros worth a run of its own */
+      while (in + lit < size && lit < 0xFFFF)
+      {
+         if (in + lit + 4 <= size && 0 == src[in + lit]
+             && 0 == src[in + lit + 1] && 0 == src[in + lit + 2]
+             && 0 == src[in + lit + 3])
+            break;
+         lit++;
+      }
+      dst[out++] = lit & 0xFF;
+      dst[out++] = lit >> 8;
+      memcpy(dst + out, src + in, lit);
+      out += lit;
+      in += lit;
+
+      while (in < size && 0 == src[in] && zero < 0xFFFF)
+      {
+         in++;
+         zero++;
+      }
+      dst[out++] = zero & 0xFF;
+      dst[out++] = zero >> 8;
+   }
+
+   return out;
+}
+
+/* returns the unpacked size, or -1 if it's corrupt or won't fit in max */
+static int nsf_unpackstate(const uint8 *src, int size, uint8 *dst, int max)
+{
+   int in = 0, out = 0;
+
+   while (in < size)
+   {
+      int lit, zero;
+
+      if (in + 2 > size)
+         return -1;
+      lit = src[in] | (src[in + 1] << 8);
+      in += 2;
+      if (in + lit + 2 > size || out + lit > max)
+         return -1;
+      memcpy(dst + out, src + in, lit);
+      in += lit;
+      out += lit;
+
+      zero = src[in] | (src[in + 1] << 8);
+      in += 2;
+      if (out + zero > max)
+         return -1;
+      memset(dst + out, 0, zero);
+      out += zero;
+   }
+
+   return out;
+}
+
+/* ties an index to the header and data it was made from */
+static uint32 nsf_datahash(nsf_t *nsf)
+{
+   uint32 hash = 2166136261U;
+   uint32 i;
+
+   for (i = 0; i < NSF_HEADER_SIZE; i++)
+      hash = (hash ^ ((uint8 *) nsf)[i]) * 16777619U;
+   for (i = 0; i < nsf->length; i++)
+      hash = (hash ^ nsf->data[i]) * 16777619U;
+   return hash ^ nsf->length;
+}
+
+/* one frame of play, with the sound rendered and thrown away */
+static void nsf_runframe(nsf_t *nsf, void *samples)
+{
+   nsf_frame(nsf);
+   apu_process(nsf->apu, samples, nsf->apu->num_samples);
+}
+
+/* largest snapshot the nsf can produce: a full apu queue */
+static int nsf_maxstatesize(nsf_t *nsf)
+{
+   return nsf_snapshot(nsf, NULL, 0) + APUQUEUE_MAX * sizeof(apudata_t);
+}
+
+void nsf_freeindex(nsf_index_t **pindex)
+{
+   nsf_index_t *index;
+
+   if (NULL == pindex || NULL == *pindex)
+      return;
+
+   index = *pindex;
+   *pindex = NULL;
+   if (index->offset)
+      free(index->offset);
+   if (index->data)
+      free(index->data);
+   free(index);
+}
+
+/* Play frames frames of the track nsf has just started (nsf_playtrack()),
+** keeping a keyframe every interval frames for nsf_seek().  The sound is
+** rendered as the player would, and dropped.  NULL if out of memory.
+*/
+nsf_index_t *nsf_buildindex(nsf_t *nsf, uint32 interval, uint32 frames)
+{
+   nsf_index_t *index;
+   uint8 *state = NULL, *packed = NULL, *samples = NULL;
+   uint32 used = 0, room = 0x10000, frame;
+   int max, keys;
+
+   if (NULL == nsf || NULL == nsf->apu || 0 != nsf->cur_frame
+       || 0 == interval)
+      return NULL;
+
+   index = malloc(sizeof(nsf_index_t));
+   if (NULL == index)
+      return NULL;
+   memset(index, 0, sizeof(nsf_index_t));
+   index->hash = nsf_datahash(nsf);
+   index->track = nsf->current_song;
+   index->interval = interval;
+
+   keys = frames / interval + 1;
+   max = nsf_maxstatesize(nsf);
+   index->offset = malloc((keys + 1) * sizeof(uint32));
+   index->data = malloc(room);
+   state = malloc(max);
+   packed = malloc(max + NSF_PACK_SLACK(max));
+   samples = malloc(nsf->apu->num_samples * 4);
+   if (NULL == index->offset || NULL == index->data || NULL == state
+       || NULL == packed || NULL == samples)
+      goto error;
+
+   for (frame = 0; frame <= frames; frame++)
+   {
+      if (0 == frame % interval)
+      {
+         int size = nsf_snapshot(nsf, state, max);
+         int psize;
+
+         if (size < 0)
+            goto error;
+         psize = nsf_packstate(state, size, packed);
+         if (used + psize > room)
+         {
+            uint8 *grown;
+
+            while (used + psize > room)
+               room *= 2;
+            grown = malloc(room);
+            if (NULL == grown)
+               goto error;
+            memcpy(grown, index->data, used);
+            free(index->data);
+            index->data = grown;
+         }
+         memcpy(index->data + used, packed, psize);
+         index->offset[index->count++] = used;
+         used += psize;
+         if (size > index->state_size)
+            index->state_size = size;
+      }
+
+      if (frame < frames)
+         nsf_runframe(nsf, samples);
+   }
+   index->offset[index->count] = used;
+
+   free(state);
+   free(packed);
+   free(samples);
+   return index;
+
+ error:
+   if (state)
+      free(state);
+   if (packed)
+      free(packed);
+   if (samples)
+      free(samples);
+   nsf_freeindex(&index);
+   return NULL;
+}
+
+/* Take nsf, playing with the settings the index was built with, to frame
+** of the indexed track: from where it is if that's on the way, else from
+** the keyframe before it.  At most interval frames get played, so frame
+** has to come before count * interval; -1 if not, or if the index wasn't
+** made from nsf's data.
+*/
+int nsf_seek(nsf_t *nsf, const nsf_index_t *index, uint32 frame)
+{
+   uint8 *samples;
+   uint32 key;
+
+   if (NULL == nsf || NULL == nsf->apu || NULL == index || 0 == index->count
+       || index->hash != nsf_datahash(nsf))
+      return -1;
+
+   key = frame / index->interval;
+   if (key >= (uint32) index->count)
+      return -1;
+
+   if (nsf->current_song != index->track
+       || nsf->cur_frame > frame
+       || nsf->cur_frame < key * index->interval)
+   {
+      uint8 *state = malloc(index->state_size);
+      int size;
+
+      if (NULL == state)
+         return -1;
+      size = nsf_unpackstate(index->data + index->offset[key],
+                             index->offset[key + 1] - index->offset[key],
+                             state, index->state_size);
+      if (size < 0 || nsf_restore(nsf, state, size))
+      {
+         free(state);
+         return -1;
+      }
+      free(state);
+   }
+
+   samples = malloc(nsf->apu->num_samples * 4);
+   if (NULL == samples)
+      return -1;
+   while (nsf->cur_frame < frame)
+      nsf_runframe(nsf, samples);
+   free(samples);
+
+   return 0;
+}
+
+/* index sidecar files: a header of the magic and then hash, track,
+** interval, count, state size and data size, the keyframe offsets, then
+** the keyframes.  The numbers are little endian whatever the host; the
+** keyframes are snapshots in the host's own layout, which nsf_restore()
+** turns away anywhere else.
+*/
+#define  NSF_INDEX_MAGIC   "NSFi"
+#define  NSF_INDEX_HEAD    (4 + 6 * 4)
+
+static void nsf_putlong(uint8 *p, uint32 value)
+{
+   p[0] = (uint8) value;
+   p[1] = (uint8) (value >> 8);
+   p[2] = (uint8) (value >> 16);
+   p[3] = (uint8) (value >> 24);
+}
+
+static uint32 nsf_getlong(const uint8 *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+int nsf_saveindex(const nsf_index_t *index, const char *filename)
+{
+   uint8 head[NSF_INDEX_HEAD];
+   uint8 *offsets;
+   uint32 data_size;
+   FILE *fp;
+   int i, err;
+
+   if (NULL == index || NULL == filename)
+      return -1;
+
+   data_size = index->offset[index->count];
+   memcpy(head, NSF_INDEX_MAGIC, 4);
+   nsf_putlong(head + 4, index->hash);
+   nsf_putlong(head + 8, index->track);
+   nsf_putlong(head + 12, index->interval);
+   nsf_putlong(head + 16, index->count);
+   nsf_putlong(head + 20, index->state_size);
+   nsf_putlong(head + 24, data_size);
+
+   offsets = malloc((index->count + 1) * 4);
+   if (NULL == offsets)
+      return -1;
+   for (i = 0; i <= index->count; i++)
+      nsf_putlong(offsets + i * 4, index->offset[i]);
+
+   fp = fopen(filename, "wb");
+   if (NULL == fp)
+   {
+      free(offsets);
+      return -1;
+   }
+   err = 1 != fwrite(head, sizeof(head), 1, fp)
+         || (size_t) index->count + 1
+            != fwrite(offsets, 4, index->count + 1, fp)
+         || data_size != fwrite(index->data, 1, data_size, fp);
+   free(offsets);
+   if (fclose(fp) || err)
+   {
+      remove(filename);
+      return -1;
+   }
+   return 0;
+}
+
+/* NULL if it can't be read, or wasn't made from nsf's data */
+nsf_index_t *nsf_loadindex(nsf_t *nsf, const char *filename)
+{
+   uint8 head[NSF_INDEX_HEAD];
+   nsf_index_t *index = NULL;
+   uint32 hash, track, interval, count, state_size, data_size;
+   FILE *fp;
+   uint32 i;
+
+   if (NULL == nsf || NULL == filename)
+      return NULL;
+
+   fp = fopen(filename, "rb");
+   if (NULL == fp)
+      return NULL;
+
+   if (1 != fread(head, sizeof(head), 1, fp)
+       || memcmp(head, NSF_INDEX_MAGIC, 4))
+      goto error;
+
+   hash = nsf_getlong(head + 4);
+   track = nsf_getlong(head + 8);
+   interval = nsf_getlong(head + 12);
+   count = nsf_getlong(head + 16);
+   state_size = nsf_getlong(head + 20);
+   data_size = nsf_getlong(head + 24);
+   if (hash != nsf_datahash(nsf) || track > 0xFF
+       || 0 == interval || 0 == count || count > 0x1000000
+       || state_size > 0x1000000 || data_size > 0x40000000)
+      goto error;
+
+   index = malloc(sizeof(nsf_index_t));
+   if (NULL == index)
+      goto error;
+   memset(index, 0, sizeof(nsf_index_t));
+   index->hash = hash;
+   index->track = (uint8) track;
+   index->interval = interval;
+   index->count = count;
+   index->state_size = state_size;
+   index->offset = malloc((count + 1) * sizeof(uint32));
+   index->data = malloc(data_size ? data_size : 1);
+   if (NULL == index->offset || NULL == index->data
+       || count + 1 != fread(index->offset, 4, count + 1, fp)
+       || data_size != fread(index->data, 1, data_size, fp))
+      goto error;
+
+   /* read as bytes, each offset in its own slot; the offsets have to run
+   ** in order through the data
+   */
+   for (i = 0; i <= count; i++)
+      index->offset[i] = nsf_getlong((uint8 *) &index->offset[i]);
+   for (i = 0; i < count; i++)
+      if (index->offset[i] > index->offset[i + 1])
+         goto error;
+   if (index->offset[count] != data_size)
+      goto error;
+
+   fclose(fp);
+   return index;
+
+ error:
+   fclose(fp);
+   nsf_freeindex(&index);
+   return NULL;
+}
+
 int nsf_setchan(nsf_t *nsf, int chan, boolean enabled)
 {
-   if (!nsf)
+   if (!nsf || !nsf->apu)
      return -1;
 
-   nsf_setcontext(nsf);
-   return apu_setchan(chan, enabled);
+   return apu_setchan(nsf->apu, chan, enabled);
 }
 
 int nsf_playtrack(nsf_t *nsf, int track, int sample_rate, int sample_bits,
@@ -957,15 +1880,13 @@ int nsf_playtrack(nsf_t *nsf, int track, int sample_rate, int sample_bits,
     return -1;
   }
 
-  /* make this NSF the current context */
-  nsf_setcontext(nsf);
-
   /* create the APU */
   if (nsf->apu) {
     apu_destroy(nsf->apu);
   }
 
-  nsf->apu = apu_create(sample_rate, nsf->playback_rate, sample_bits, stereo);
+  nsf->apu = apu_create(nsf->cpu, sample_rate, nsf->playback_rate,
+                        sample_bits, stereo);
   if (NULL == nsf->apu)
     {
       /* $$$ ben : from my point of view this is not clean. Function should
@@ -975,15 +1896,14 @@ int nsf_playtrack(nsf_t *nsf, int track, int sample_rate, int sample_bits,
       return -1;
     }
 
-  apu_setext(nsf->apu, nsf_getext(nsf));
+  if (nsf_setexts(nsf))
+    return -1;
 
   /* go ahead and init all the read/write handlers */
   build_address_handlers(nsf);
   
   /* convenience? */
   nsf->process = nsf->apu->process;
-  
-  nes6502_setcontext(nsf->cpu);
 
   if (track > nsf->num_songs)
     track = nsf->num_songs;
@@ -992,7 +1912,7 @@ int nsf_playtrack(nsf_t *nsf, int track, int sample_rate, int sample_bits,
 
   nsf->current_song = track;
    
-  apu_reset();
+  apu_reset(nsf->apu);
 
   nsf_inittune(nsf);
 
@@ -1001,11 +1921,26 @@ int nsf_playtrack(nsf_t *nsf, int track, int sample_rate, int sample_bits,
 
 int nsf_setfilter(nsf_t *nsf, int filter_type)
 {
-  if (!nsf) {
+  if (!nsf || !nsf->apu) {
+    return -1;
+  }
+  return apu_setfilter(nsf->apu, filter_type);
+}
+
+int nsf_setsynth(nsf_t *nsf, int synth_type)
+{
+  if (!nsf || !nsf->apu || synth_type >= NSF_SYNTH_MAX) {
+    return -1;
+  }
+  return apu_setsynth(nsf->apu, synth_type);
+}
+
+int nsf_setextmode(nsf_t *nsf, int mode)
+{
+  if (!nsf || !nsf->apu || mode >= NSF_EXTMODE_MAX) {
     return -1;
   }
-  nsf_setcontext(nsf);
-  return apu_setfilter(filter_type);
+  return apu_setextmode(nsf->apu, mode);
 }
 
 /*
@@ -46,6 +46,8 @@
 
 #define  NSF_HEADER_SIZE         0x80
 
+#define  MAX_ADDRESS_HANDLERS    32
+
 /* 60 Hertz refresh (NTSC) */
 #define  NES_MASTER_CLOCK     21477272.7272
 #define  NTSC_REFRESH         60
@@ -64,6 +66,49 @@ enum
    NSF_FILTER_MAX, /* $$$ ben : add this one for range chacking */
 };
 
+/* access maps kept by nsf_trackaccess(): RAM, the $5000, $6000 and
+** $7000 pages, and the NSF data
+*/
+#define  NSF_ACC_RAM    0
+#define  NSF_ACC_PAGE5  1
+#define  NSF_ACC_DATA   4
+#define  NSF_ACC_MAPS   5
+
+/* synthesis modes, see nes_apu.h */
+enum
+{
+   NSF_SYNTH_POINT,
+   NSF_SYNTH_BLEP,
+   NSF_SYNTH_MAX
+};
+
+/* expansion sound modes, see nes_apu.h */
+enum
+{
+   NSF_EXTMODE_ACCURATE,
+   NSF_EXTMODE_FAST,
+   NSF_EXTMODE_MAX
+};
+
+/* memory the NSF data was mapped into, rather than read into */
+typedef struct nsf_map_s
+{
+   void *base;
+   unsigned long size;
+} nsf_map_t;
+
+/* the NSF data as loaded: nothing writes to it after that, so every nsf_t
+** made from it with nsf_clone() shares it
+*/
+typedef struct nsf_rom_s
+{
+   uint8  *data;              /* a zero bank either side of it */
+   uint32 length;
+   void   *block;             /* what data was malloc()ed as, or */
+   nsf_map_t map;             /* what it was mapped into */
+   int    refcount;
+} nsf_rom_t;
+
 typedef struct nsf_s
 {
    /* NESM header */
@@ -85,7 +130,9 @@ typedef struct nsf_s
    uint8  reserved[4]         __PACKED__; /* reserved */
 
    /* things that the NSF player needs */
-   uint8  *data;              /* actual NSF data */
+   uint8  *data;              /* actual NSF data, rom->data */
+   nsf_rom_t *rom;            /* shared with our clones */
+   nes6502_accmap *acc_maps;  /* NSF_ACC_MAPS of them, when tracking */
    uint32 length;             /* length of data */
    uint32 playback_rate;      /* current playback rate */
    uint8  current_song;       /* current song */
@@ -103,10 +150,28 @@ typedef struct nsf_s
    nes6502_context *cpu;
    apu_t *apu;
 
+   /* memory handlers the cpu walks, bound to this nsf/apu/ext */
+   nes6502_memread readhandler[MAX_ADDRESS_HANDLERS];
+   nes6502_memwrite writehandler[MAX_ADDRESS_HANDLERS];
+
    /* our main processing routine, calls all external mixing routines */
-   void (*process)(void *buffer, int num_samples);
+   void (*process)(apu_t *apu, void *buffer, int num_samples);
 } nsf_t;
 
+/* keyframes of one track, every interval frames from its start, for
+** nsf_seek(); see nsf_buildindex()
+*/
+typedef struct nsf_index_s
+{
+   uint32 hash;               /* of the NSF they belong to */
+   uint8  track;
+   uint32 interval;
+   int    count;              /* of keyframes */
+   int    state_size;         /* largest one, unpacked */
+   uint32 *offset;            /* count + 1 of them, into data */
+   uint8  *data;              /* the keyframes, packed */
+} nsf_index_t;
+
 /* $$$ ben : Generic loader struct */
 struct nsf_loader_t {
   /* Init and open. */
@@ -129,6 +194,13 @@ struct nsf_loader_t {
   /* Get filename (for debug). */
   const char * (*fname) (struct nsf_loader_t * loader);
 
+  /* Optional (may be NULL). Return the next n bytes in place and skip them,
+   * handing over the memory they live in through map; it is released
+   * with the last nsf_t using it. The memory must stay readable a bank (0x1000 bytes) before and
+   * after them. Return NULL and read() is used instead.
+   */
+  uint8 * (*map) (struct nsf_loader_t * loader, int n, nsf_map_t * map);
+
 };
 
 /* Function prototypes */
@@ -136,6 +208,7 @@ extern int nsf_init(void);
 
 extern nsf_t * nsf_load_extended(struct nsf_loader_t * loader);
 extern nsf_t *nsf_load(const char *filename, void *source, int length);
+extern nsf_t *nsf_clone(nsf_t *nsf);
 extern void nsf_free(nsf_t **nsf_info);
 
 extern int nsf_playtrack(nsf_t *nsf, int track, int sample_rate,
@@ -143,6 +216,17 @@ extern int nsf_playtrack(nsf_t *nsf, int track, int sample_rate,
 extern void nsf_frame(nsf_t *nsf);
 extern int nsf_setchan(nsf_t *nsf, int chan, boolean enabled);
 extern int nsf_setfilter(nsf_t *nsf, int filter_type);
+extern int nsf_setsynth(nsf_t *nsf, int synth_type);
+extern int nsf_setextmode(nsf_t *nsf, int mode);
+extern int nsf_trackaccess(nsf_t *nsf);
+extern int nsf_snapshot(nsf_t *nsf, void *buf, int size);
+extern int nsf_restore(nsf_t *nsf, const void *buf, int size);
+extern nsf_index_t *nsf_buildindex(nsf_t *nsf, uint32 interval,
+                                   uint32 frames);
+extern int nsf_seek(nsf_t *nsf, const nsf_index_t *index, uint32 frame);
+extern int nsf_saveindex(const nsf_index_t *index, const char *filename);
+extern nsf_index_t *nsf_loadindex(nsf_t *nsf, const char *filename);
+extern void nsf_freeindex(nsf_index_t **index);
 
 #endif /* _NSF_H_ */
 
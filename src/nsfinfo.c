@@ -37,7 +37,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "nes6502.h"
 #include "types.h"
@@ -46,21 +53,6 @@
 
 static int quiet = 0;
 
-#ifdef NSF_PLAYER
-#define  NES6502_4KBANKS
-#endif
-
-#ifdef NES6502_4KBANKS
-#define  NES6502_NUMBANKS  16
-#define  NES6502_BANKSHIFT 12
-#else
-#define  NES6502_NUMBANKS  8
-#define  NES6502_BANKSHIFT 13
-#endif
-
-extern uint8 *acc_nes6502_banks[NES6502_NUMBANKS];
-extern int max_access[NES6502_NUMBANKS];
-
 static void info_show_help(void)
 {
    printf("\n"
@@ -146,16 +138,32 @@ static void lpoke(uint8 *p, int v)
   p[3] = v >> 24;
 }
 
+/* nsf_load() left the 16 bit header fields in host order */
+static void wpoke(uint16 *p, int v)
+{
+  ((uint8 *)p)[0] = v;
+  ((uint8 *)p)[1] = v >> 8;
+}
+
 static int nsf_write_file(const char * fname,
 			  const nsf_t * header,
-			  const char * buffer, int len,
 			  unsigned int * timeinfo)
 {
   int err = -1;
-  FILE *f;
+  FILE *f = 0;
   nsf_t nsf;
   int i, songs;
   unsigned int total_time;
+  int len = header->length;
+  char * buffer;
+
+  /* the data may be mapped from the very file about to be truncated */
+  buffer = malloc(len);
+  if (!buffer) {
+    perror(fname);
+    goto error;
+  }
+  memcpy(buffer, header->data, len);
 
   msg("Creating nsf version 2 [%s]\n", fname);
   f = fopen(fname,"wb");
@@ -166,6 +174,11 @@ static int nsf_write_file(const char * fname,
 
   /* Copy header. */
   memcpy(&nsf, header, 128);
+  wpoke(&nsf.load_addr, header->load_addr);
+  wpoke(&nsf.init_addr, header->init_addr);
+  wpoke(&nsf.play_addr, header->play_addr);
+  wpoke(&nsf.ntsc_speed, header->ntsc_speed);
+  wpoke(&nsf.pal_speed, header->pal_speed);
   /* Set new version. */
   nsf.version = 2;
   /* Set data length (24 bit). */
@@ -225,42 +238,235 @@ static int nsf_write_file(const char * fname,
   if (f) {
     fclose(f);
   }
+  if (buffer) {
+    free(buffer);
+  }
   return err;
 }
 
 
 static int nsf_playback_rate(nsf_t * nsf)
 {
-  uint8 * p;
   unsigned int def, v;
   
   
   if (nsf->pal_ntsc_bits & NSF_DEDICATED_PAL) {
-    p = (uint8*)&nsf->pal_speed;
+    v = nsf->pal_speed;
     def = 50;
   } else {
-    p = (uint8*)&nsf->ntsc_speed;
+    v = nsf->ntsc_speed;
     def = 60;
   }
-  v = p[0] | (p[1]<<8);
   return v ? 1000000 / v : def;
 }
 
-static int nsf_inited = 0;
+/* Loop detection by machine state.
+ *
+ * After every frame everything the player can read back -- CPU registers,
+ * RAM, EXRAM/WRAM, the bank mapping, the 2A03's length counters and
+ * status and the expansion chips' readable state (apu_peek()) -- is
+ * hashed, along with the last value written to each 2A03 register.  The
+ * first time a hash comes up again the machine looks to be back where it
+ * was, so everything from the earlier frame on repeats: that frame ends
+ * the intro and the distance between the two is the loop.  It is only
+ * taken once the loop has been played through again and every frame of
+ * it matched, which catches a hash that only looked the same.
+ *
+ * That is what ends the search.  Songs that never repeat exactly (a
+ * driver with a free running counter, say) are left to the "no new
+ * memory touched" search, which runs alongside: once it has its answer
+ * the state search gets one more fragment to find a repeat, then it has
+ * the last word.
+ */
+typedef unsigned long long state_hash_t;
+
+typedef struct
+{
+  state_hash_t hash;   /* 0 marks a free slot */
+  unsigned int frame;
+} state_seen_t;
+
+typedef struct
+{
+  state_seen_t * slot;
+  unsigned int size;   /* power of two */
+  unsigned int used;
+  state_hash_t * log;  /* every frame's hash, for checking a repeat */
+  unsigned int log_size;
+} state_table_t;
+
+#define STATE_TABLE_INIT 4096
+
+static state_hash_t state_mix(state_hash_t h, state_hash_t v)
+{
+  h ^= v;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+static state_hash_t state_mix_mem(state_hash_t h, const uint8 * p, int len)
+{
+  state_hash_t v;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&v, p, 8);
+    h = state_mix(h, v);
+  }
+  if (len > 0) {
+    v = 0;
+    memcpy(&v, p, len);
+    h = state_mix(h, v);
+  }
+  return h;
+}
+
+/* note the 2A03 writes queued this frame into regs, before rendering
+ * takes them off the queue */
+static void state_apu_writes(apu_t * apu, uint8 * regs)
+{
+  int i;
+
+  for (i = apu->q_tail; i != apu->q_head; i = (i + 1) & APUQUEUE_MASK(apu)) {
+    apudata_t * d = &apu->queue[i];
+    regs[(d->address - 0x4000) & 0x1F] = d->value;
+  }
+}
+
+static state_hash_t state_hash(nsf_t * nsf, const uint8 * apu_regs,
+			       const uint8 * peek, int peek_size)
+{
+  nes6502_context * cpu = nsf->cpu;
+  state_hash_t h = 0xcbf29ce484222325ULL;
+  int i;
 
+  h = state_mix(h, cpu->pc_reg);
+  h = state_mix(h, cpu->a_reg | cpu->x_reg << 8 | cpu->y_reg << 16
+		| (state_hash_t)cpu->s_reg << 24 | (state_hash_t)cpu->p_reg << 32);
+  h = state_mix_mem(h, cpu->mem_page[0], 0x800);
+  for (i = 5; i < NES6502_NUMBANKS; i++) {
+    h = state_mix(h, (state_hash_t)(cpu->mem_page[i] - nsf->data));
+  }
+  /* the FDS has RAM all the way up */
+  for (i = 5; i < ((nsf->ext_sound_type & EXT_SOUND_FDS) ? 16 : 8); i++) {
+    h = state_mix_mem(h, cpu->mem_page[i], 0x1000);
+  }
+  h = state_mix_mem(h, apu_regs, 0x20);
+  h = state_mix_mem(h, peek, peek_size);
+  return h ? h : 1;
+}
+
+static void state_table_free(state_table_t * t)
+{
+  if (t->slot) {
+    free(t->slot);
+    t->slot = 0;
+  }
+  if (t->log) {
+    free(t->log);
+    t->log = 0;
+  }
+}
+
+static int state_table_init(state_table_t * t)
+{
+  t->size = STATE_TABLE_INIT;
+  t->used = 0;
+  t->log_size = STATE_TABLE_INIT;
+  t->slot = malloc(t->size * sizeof(*t->slot));
+  t->log = malloc(t->log_size * sizeof(*t->log));
+  if (!t->slot || !t->log) {
+    return -1;
+  }
+  memset(t->slot, 0, t->size * sizeof(*t->slot));
+  return 0;
+}
+
+/* frame where hash was first seen, -1 after adding it, or -2 when out of
+ * memory */
+static int state_table_add(state_table_t * t, state_hash_t hash,
+			   unsigned int frame)
+{
+  unsigned int i, mask = t->size - 1;
+
+  if (frame >= t->log_size) {
+    state_hash_t * old = t->log;
+
+    t->log = malloc(t->log_size * 2 * sizeof(*t->log));
+    if (!t->log) {
+      t->log = old;
+      return -2;
+    }
+    memcpy(t->log, old, t->log_size * sizeof(*t->log));
+    t->log_size *= 2;
+    free(old);
+  }
+  t->log[frame] = hash;
+
+  for (i = (unsigned int)hash & mask; t->slot[i].hash; i = (i + 1) & mask) {
+    if (t->slot[i].hash == hash) {
+      return t->slot[i].frame;
+    }
+  }
+  t->slot[i].hash = hash;
+  t->slot[i].frame = frame;
+
+  /* keep it at most half full */
+  if (++t->used * 2 > t->size) {
+    state_seen_t * old = t->slot;
+    unsigned int j, old_size = t->size;
+
+    t->slot = malloc(old_size * 2 * sizeof(*t->slot));
+    if (!t->slot) {
+      t->slot = old;
+      return -2;
+    }
+    memset(t->slot, 0, old_size * 2 * sizeof(*t->slot));
+    t->size = old_size * 2;
+    mask = t->size - 1;
+    for (j = 0; j < old_size; j++) {
+      if (old[j].hash) {
+	for (i = (unsigned int)old[j].hash & mask; t->slot[i].hash;
+	     i = (i + 1) & mask)
+	  ;
+	t->slot[i] = old[j];
+      }
+    }
+    free(old);
+  }
+  return -1;
+}
+
+/* Frames to play: the intro, once round the loop and a little room.  The
+ * intro and the loop on their own go in *intro and *loop, both 0 when
+ * only the length is known (from the file's time chunk, unless force).
+ * why, if not NULL, says what went wrong when 1 comes back. */
 static unsigned int nsf_calc_time(nsf_t * src,
-  int len,  int track,  unsigned int frame_frag, int force)
+  int track,  unsigned int frame_frag, int force,
+  unsigned int * intro, unsigned int * loop,
+  const char ** why)
 {
-  unsigned int result1 = 0, result2 = 0;
+  unsigned int frames = 1;
   nsf_t * nsf = 0;
-  float sec; 
   unsigned int playback_rate = nsf_playback_rate(src);
   int err;
   unsigned int max_frag;
+  state_table_t states;
+  uint8 apu_regs[0x20];
+  void * samples = 0;
+  uint8 * peek = 0;
+  int peek_size;
 
   // trouble with zelda2:7?
   int default_frag_size = 20 * playback_rate; // 2 * 60 * playback_rate; 
 
+  states.slot = 0;
+  states.log = 0;
+  *intro = *loop = 0;
+  memset(apu_regs, 0, sizeof(apu_regs));
+  if (why) {
+    *why = "ok";
+  }
+
   if (track < 0 || track > src->num_songs) {
     fprintf(stderr, "nsfinfo : calc time, track #%d out of range.\n", track);
   }
@@ -268,25 +474,36 @@ static unsigned int nsf_calc_time(nsf_t * src,
   frame_frag = frame_frag ? frame_frag : default_frag_size;
   max_frag = 60 * 60 * playback_rate;
 
-  if (!nsf_inited) {
-    //msg("nsfinfo : init nosefart engine...\n");
-    if (nsf_init() == -1) {
-      fprintf(stderr, "nsfinfo :  init failed.\n");
-      goto error;
+  /* only does anything the first time */
+  //msg("nsfinfo : init nosefart engine...\n");
+  if (nsf_init() == -1) {
+    fprintf(stderr, "nsfinfo :  init failed.\n");
+    if (why) {
+      *why = "init failed";
     }
-    nsf_inited = 1;
-    //msg("nsfinfo : nosefart engine initialized\n");
+    goto error;
   }
 
-  //msg("nsfinfo : loading nsf...\n");
-  nsf = nsf_load(0, src, len);
+  /* an instance of our own, sharing the data with src */
+  nsf = nsf_clone(src);
   if (!nsf) {
-    fprintf(stderr,"nsfinfo: load failed\n");
+    fprintf(stderr,"nsfinfo: out of memory\n");
+    if (why) {
+      *why = "out of memory";
+    }
+    goto error;
+  }
+  /* the "no new memory touched" search needs the access map */
+  if (nsf_trackaccess(nsf)) {
+    fprintf(stderr,"nsfinfo: out of memory\n");
+    if (why) {
+      *why = "out of memory";
+    }
     goto error;
   }
   if (!force && nsf->song_frames && nsf->song_frames[track]) {
-    result1 = nsf->song_frames[track];
-    goto error; /* Not en error :) */
+    frames = nsf->song_frames[track];
+    goto done;
   }
 
   //msg("nsfinfo : init [%s] #%d...\n", nsf->song_name, track);
@@ -295,14 +512,30 @@ static unsigned int nsf_calc_time(nsf_t * src,
    */
   err = nsf_playtrack(nsf, track, 8000, 8, 1);
   if (err != track) {
-    if (err == -1) {
-      /* $$$ ben : Becoz nsf_playtrack() kicks nsf ass :( */
-      nsf = 0;
-    }
     fprintf(stderr,"nsfinfo: track %d not initialized\n", track);
+    if (why) {
+      *why = "track not initialized";
+    }
+    goto error;
+  }
+
+  /* it is rendered after all, and thrown away: what the cpu reads back
+   * of the sound chips has to move on as it does when playing */
+  samples = malloc(nsf->apu->num_samples * 4);
+  peek_size = apu_peeksize(nsf->apu);
+  peek = malloc(peek_size);
+  if (!samples || !peek) {
+    fprintf(stderr,"nsfinfo: out of memory\n");
+    if (why) {
+      *why = "out of memory";
+    }
     goto error;
   }
 
+  if (state_table_init(&states)) {
+    state_table_free(&states);
+  }
+
   /* the way this works is that it finds the last place that new memory 
      is accessed.  The time it takes to do this is the length of the song.
      Well, sorta.  It's the time after which no new material is played.
@@ -311,126 +544,315 @@ static unsigned int nsf_calc_time(nsf_t * src,
      length of A B C.  I don't think I've encountered this, however, 
      although I think it could happen.)
      -matt s. 
+
+     A second pass from there finds the length of the song _without_ the
+     intro.  Both only stand when the machine state never repeats.
   */
   {
-    int done = 0;
+    int pass = 0; /* of the memory search: with intro, without, done */
     uint32 last_accessed_frame = 0, prev_frag = 0, starting_frame = 0;
+    uint32 with_intro = 0;
+    uint32 repeat_frame = 0, repeat_loop = 0; /* a repeat being checked */
+    uint32 state_frames = 0; /* when the state search gives up */
 
     //msg("nsfinfo : Emulating up to %u frames (%d hz)\n", frame_frag, playback_rate);
 
-    while (!done) 
+    for (;;)
     {
       nsf_frame(nsf); /* advance one frame. -matt s. */
-
-      //msg("%d ", nsf->cur_frame);
-      if (nes6502_mem_access)
-      {
-        //msg("!");
-	last_accessed_frame = nsf->cur_frame;
+      state_apu_writes(nsf->apu, apu_regs);
+      apu_process(nsf->apu, samples, nsf->apu->num_samples);
+
+      /* been here before: intro and loop are both known, once the loop
+	 has come round again just the same */
+      if (states.slot) {
+	state_hash_t hash;
+	int seen;
+
+	apu_peek(nsf->apu, peek);
+	hash = state_hash(nsf, apu_regs, peek, peek_size);
+	seen = state_table_add(&states, hash, nsf->cur_frame);
+	if (seen == -2) {
+	  state_table_free(&states);
+	  repeat_loop = 0;
+	} else {
+	  if (repeat_loop
+	      && hash != states.log[nsf->cur_frame - repeat_loop]) {
+	    repeat_loop = 0; /* it only looked like one */
+	  }
+	  if (repeat_loop && nsf->cur_frame == repeat_frame + repeat_loop) {
+	    frames = repeat_frame + 16 /* fudge room */;
+	    *intro = repeat_frame - repeat_loop;
+	    *loop = repeat_loop;
+	    goto done;
+	  }
+	  if (!repeat_loop && seen >= 0) {
+	    repeat_frame = nsf->cur_frame;
+	    repeat_loop = nsf->cur_frame - seen;
+	  }
+	}
       }
-      //msg("\n");
 
-      if (nsf->cur_frame > frame_frag) 
+      if (pass < 2)
       {
-        if (last_accessed_frame > prev_frag) 
-        {
-	  prev_frag = nsf->cur_frame;
-	  frame_frag += default_frag_size;
-	  //msg("nsfinfo : memory was accessed, enlarging search to next %u frames\n",
-	  //    default_frag_size);
+	//msg("%d ", nsf->cur_frame - starting_frame);
+	if (nsf->cpu->mem_access)
+	{
+	  //msg("!");
+	  last_accessed_frame = nsf->cur_frame;
+	}
+	//msg("\n");
+
+	if (nsf->cur_frame > frame_frag) 
+	{
+	  if (last_accessed_frame > prev_frag) 
+	  {
+	    prev_frag = nsf->cur_frame;
+	    frame_frag += default_frag_size;
+	    //msg("nsfinfo : memory was accessed, enlarging search to next %u frames\n",
+	    //    default_frag_size);
 	  
-          if (frame_frag >= max_frag) 
-          {
-	    msg("\nnsfinfo : unable to find end of music within %u frames, giving up!\n", max_frag);
-	    goto error;
+	    if (frame_frag >= max_frag) 
+	    {
+	      if (!pass) {
+		msg("\nnsfinfo : unable to find end of music within %u frames, giving up!\n", max_frag);
+	      } else {
+		msg("\nnsfinfo : unable to find end of music within %u frames\n\tgiving up!", max_frag);
+	      }
+	      if (why) {
+		*why = pass ? "no loop found" : "no end found";
+	      }
+	      goto error;
+	    }
+	  } 
+	  else if (!pass)
+	  {
+	    with_intro = last_accessed_frame;
+
+	    /* clear out the memory access information.  This is a kludge
+	       because I, matt s, don't totally understand what ben is doing! 
+	       RAM is left alone, as it always was: the driver's variables
+	       would all look new again. */
+	    {
+	      int a;
+	      for(a = NSF_ACC_RAM + 1; a < NSF_ACC_MAPS; a++)
+	      {
+		nes6502_accmap_clear(&nsf->acc_maps[a]);
+	      }
+	    }
+
+	    /* don't want to count what we've already looked at */
+	    starting_frame = nsf->cur_frame;
+	    last_accessed_frame = 0;
+	    prev_frag = 0;
+	    pass = 1;
 	  }
-	} 
-        else 
-	  done = 1;
+	  else
+	  {
+	    *loop = last_accessed_frame > starting_frame
+	      ? last_accessed_frame - starting_frame : 0;
+	    pass = 2;
+	    state_frames = nsf->cur_frame + default_frag_size;
+	  }
+	}
+      }
+
+      /* the state search has had its chance */
+      if (2 == pass && !repeat_loop
+	  && (!states.slot || nsf->cur_frame >= state_frames)) {
+	frames = with_intro + 16 /* fudge room */;
+	*intro = with_intro > *loop ? with_intro - *loop : 0;
+	break;
       }
     }
-    result1 = last_accessed_frame + 16 /* fudge room */;
-    sec = (float)(result1 + nsf->playback_rate - 1) / (float)nsf->playback_rate;
-    //printf("track %d with intro is %u frames, %.2f seconds\n",
-	//track, result1, sec);
+  }
 
-    // doesn't make a difference
-    //nsf->cur_frame = last_accessed_frame;
+ done:
+  state_table_free(&states);
+  if (samples) {
+    free(samples);
+  }
+  if (peek) {
+    free(peek);
   }
+  nsf_free(&nsf);
+  return frames;
 
-  /* clear out the memory access information.  This is a kludge
-     because I, matt s, don't totally understand what ben is doing! 
-     max_access information is collected in src/cpu/nes6502/nes6502.c */
-  {
-    int a;
-    for(a = 0; a < NES6502_NUMBANKS; a++)
-    {
-	//msg("max_access[%d] = %d\n", a, max_access[a]);
-  	memset(acc_nes6502_banks[a], 0, max_access[a]);
-    }
+ error:
+  state_table_free(&states);
+  if (samples) {
+    free(samples);
+  }
+  if (peek) {
+    free(peek);
   }
+  nsf_free(&nsf);
+  fprintf(stderr, "Error with time calculation, bailing out!\n");
+  *intro = *loop = 0;
+  return 0x00000001; /* something small, but non-zero (zero means unlimited) */
+}
 
-  //msg("starting second run\n");
 
-  /* This finds the length of the song _without_ the intro. -matt s */
-  {
-    /* don't want to count what we've already looked at */
-    int starting_frame = nsf->cur_frame; 
+/* Song length cache.
+ *
+ * Working out a track's length means emulating it until it stops
+ * touching new memory, which can take minutes of emulated audio.  Results
+ * are kept in $XDG_CACHE_HOME/nosefart/lengths (or ~/.cache/...), one
+ * "hash track force frames intro loop" line each, keyed by a hash of the NSF's
+ * header, data and time chunk and of the player version, so a changed
+ * file or player never reuses a stale length.  force tells a full calculation from one that
+ * may have come from the file's own time chunk.  Delete the file to
+ * start over.
+ *
+ * Lines are appended with a single write() on an O_APPEND descriptor, so
+ * several threads or players can share the cache; a reader just skips
+ * anything it can't parse, and the last matching line wins.
+ */
 
-    int done = 0;
-    uint32 last_accessed_frame = 0, prev_frag = 0;
+/* bump when the length calculation changes */
+#define TIME_CACHE_VERSION "5"
 
-    //msg("nsfinfo : Emulating up to %u frames (%d hz)\n", frame_frag, playback_rate);
+typedef unsigned long long time_hash_t;
 
-    while (!done) 
-    {
-      nsf_frame(nsf); /* advance one frame. -matt s. */
+/* 64-bit FNV-1a */
+static time_hash_t time_cache_mix(time_hash_t h, const void * p, int len)
+{
+  const uint8 * b = p;
+  int i;
 
-      //msg("%d ", nsf->cur_frame - starting_frame);
-      if (nes6502_mem_access)
-      {
-        //msg("!");
-	last_accessed_frame = nsf->cur_frame;
-      }
-      //msg("\n");
+  for (i = 0; i < len; ++i) {
+    h = (h ^ b[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
 
-      if (nsf->cur_frame > frame_frag) 
-      {
-        if (last_accessed_frame > prev_frag) 
-        {
-	  prev_frag = nsf->cur_frame;
-	  frame_frag += default_frag_size;
-	  //msg("nsfinfo : memory was accessed, enlarging search to next %u frames\n",
-	  //    default_frag_size);
-	  
-          if (frame_frag >= max_frag) 
-          {
-	    msg("\nnsfinfo : unable to find end of music within %u frames\n\tgiving up!", max_frag);
-	    goto error;
-	  }
-	} 
-        else 
-	  done = 1;
-      }
+/* of nsf as loaded, before anything edits its header */
+static time_hash_t time_cache_hash(const nsf_t * nsf)
+{
+  static const char * key = VERSION "/" TIME_CACHE_VERSION;
+  time_hash_t h = 0xcbf29ce484222325ULL;
+
+  h = time_cache_mix(h, key, strlen(key));
+  h = time_cache_mix(h, nsf, 128);
+  h = time_cache_mix(h, nsf->data, nsf->length);
+  if (nsf->song_frames) {
+    h = time_cache_mix(h, nsf->song_frames,
+		       sizeof(*nsf->song_frames) * (nsf->num_songs + 1));
+  }
+  return h;
+}
+
+/* path of the cache file, creating its directory when make_dir is set;
+   0 if there is nowhere to keep it */
+static char * time_cache_path(char * path, int max, int make_dir)
+{
+  const char * base = getenv("XDG_CACHE_HOME");
+  const char * sub = "/nosefart";
+
+  if (!base || !base[0]) {
+    base = getenv("HOME");
+    if (!base || !base[0]) {
+      return 0;
     }
-    result2 = last_accessed_frame - starting_frame + 16 /* fudge room */;
-    sec = (float)(result2 + nsf->playback_rate - 1) / (float)nsf->playback_rate;
-    //printf("track %d without intro is %u frames, %.2f seconds\n",
-//	track, result2, sec);
+    sub = "/.cache/nosefart";
+  }
+  if (strlen(base) + strlen(sub) + sizeof("/lengths") > (size_t)max) {
+    return 0;
   }
 
-  /* Want to get both results back to nosefart.  Neither should be 
-     larger than 2^16, so let's shove them together into one int.
-     the high order bits are result1 (with intro) and the lower order
-     bits are result2 (without intro) */
-	return (result1 * 0x1000 + result2);
+  strcpy(path, base);
+  strcat(path, sub);
+  if (make_dir) {
+    /* the .cache level may not exist either */
+    char * slash = strrchr(path, '/');
+    *slash = 0;
+    mkdir(path, 0755);
+    *slash = '/';
+    mkdir(path, 0755);
+  }
+  strcat(path, "/lengths");
+  return path;
+}
 
- error:
-  nsf_free(&nsf);
-  fprintf(stderr, "Error with time calculation, bailing out!\n");
-  return 0x00000001; /* something small, but non-zero (zero means unlimited) */
+/* 0 and the cached lengths, or -1 if there aren't any */
+static int time_cache_get(time_hash_t hash, int track, int force,
+			  unsigned int * frames, unsigned int * intro,
+			  unsigned int * loop)
+{
+  char path[1024], line[64];
+  FILE * f;
+  int found = -1;
+
+  if (!time_cache_path(path, sizeof(path), 0) || !(f = fopen(path, "r"))) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    time_hash_t h;
+    int t, fo;
+    unsigned int f, i, l;
+
+    if (sscanf(line, "%llx %d %d %x %x %x", &h, &t, &fo, &f, &i, &l) == 6
+	&& h == hash && t == track && fo == force) {
+      *frames = f;
+      *intro = i;
+      *loop = l;
+      found = 0;
+    }
+  }
+  fclose(f);
+  return found;
 }
 
+static void time_cache_put(time_hash_t hash, int track, int force,
+			   unsigned int frames, unsigned int intro,
+			   unsigned int loop)
+{
+  char path[1024], line[64];
+  int fd, len;
+
+  if (!time_cache_path(path, sizeof(path), 1)) {
+    return;
+  }
+  fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd == -1) {
+    return;
+  }
+  len = sprintf(line, "%016llx %d %d %x %x %x\n", hash, track, !!force,
+		frames, intro, loop);
+  if (write(fd, line, len) != len) {
+    msg("nsfinfo : could not write length cache %s\n", path);
+  }
+  close(fd);
+}
+
+/* nsf_calc_time(), through the cache; intro and loop may be NULL */
+static unsigned int nsf_cached_time(nsf_t * nsf, int track,
+				    time_hash_t hash, int force,
+				    unsigned int * intro, unsigned int * loop,
+				    const char ** why)
+{
+  unsigned int frames, i, l;
+
+  force = !!force;
+  if (!time_cache_get(hash, track, force, &frames, &i, &l)) {
+    if (why) {
+      *why = "ok";
+    }
+  } else {
+    frames = nsf_calc_time(nsf, track, 0, force, &i, &l, why);
+    /* 1 is what the calculation gives back when it failed */
+    if (frames != 1) {
+      time_cache_put(hash, track, force, frames, i, l);
+    }
+  }
+  if (intro) {
+    *intro = i;
+  }
+  if (loop) {
+    *loop = l;
+  }
+  return frames;
+}
 
 static char * clean_string(char *d, const char *s, int max)
 {
@@ -542,17 +964,48 @@ static int read_track_list(char **trackList, int max, int *from, int *to)
   return 1;
 }
 
+/* Load an NSF file, mapping it where the player was built to (NSF_MMAP);
+ * every track is then played on a clone of it.  why, if not NULL, says
+ * what went wrong when NULL comes back. */
+static nsf_t * nsf_open_file(const char * iname, const char ** why)
+{
+  nsf_t * nsf;
+  FILE * f;
+
+  nsf = nsf_load(iname, 0, 0);
+  if (nsf) {
+    return nsf;
+  }
+
+  /* nsf_load() doesn't say why, so see whether the file was there at all */
+  f = fopen(iname, "rb");
+  if (!f) {
+    perror(iname);
+    if (why) {
+      *why = "open failed";
+    }
+    return 0;
+  }
+  fclose(f);
+  fprintf(stderr, "nsfinfo : %s not an nsf file.\n", iname);
+  if (why) {
+    *why = "not an nsf file";
+  }
+  return 0;
+}
+
 int nsf_info_main(int na, char **a)
 {
   int i;
   const char * iname;
-  char * buffer = 0;
-  int len = 0;
   nsf_t * nsf;
   int cursong, err, loopArg, toTrack, curTrack;
   char *trackList, *trackListBase;
+  time_hash_t hash;
+  const char * why;
 
-  static unsigned int times[256];
+  /* not static: the front end runs this from several threads at once */
+  unsigned int times[256];
  
   /* First loop search for --help, --warranty ,--quiet */
   for (i=1; i<na; ++i) {
@@ -575,62 +1028,22 @@ int nsf_info_main(int na, char **a)
   }
   iname = a[1];
 
-  //msg("Loading [%s] file.\n", iname);
-  /* Load whole file. */
-  {
-    FILE * f = fopen(iname, "rb");
-    if (!f) {
-      perror(iname);
-      return 2;
-    }
-
-    if (fseek(f,0,SEEK_END) == -1) {
-      perror(iname);
-    } else {
-      len = ftell(f);
-      if (len == -1) {
-	perror(iname);
-      } else if (len < 128) {
-	fprintf(stderr, "nsfinfo : %s not an nsf file (too small).\n", iname);
-      } else {
-	char tmp_hd[128];
-	int err;
-	//msg("File length is %d bytes.\n", len);
-	err = fseek(f,0,SEEK_SET);
-	if (err != -1) {
-	  err = fread(tmp_hd, 1, 128, f);
-	}
-	if (err != 128) {
-	  perror(iname);
-	} else if (memcmp(tmp_hd,NSF_MAGIC,5)) {
-	  fprintf(stderr, "nsfinfo : %s not an nsf file (invalid magic).\n",
-		  iname);
-	} else {
-	  //msg("Looks like a valid NSF file, loading data ...\n");
-	  buffer = malloc(len);
-	  if (!buffer) {
-	    perror(iname);
-	  } else {
-	    int err;
-	    memcpy(buffer, tmp_hd, 128);
-	    err = fread(buffer+128, 1, len-128, f);
-	    if (err != len-128) {
-	      perror(iname);
-	      free(buffer);
-	      buffer = 0;
-	    }
-	  }
-	}
-      }
-    }
-    fclose(f);
-  }
-  if (!buffer) {
+  /* only does anything the first time */
+  if (nsf_init() == -1) {
+    fprintf(stderr, "nsfinfo :  init failed.\n");
     return 3;
   }
+
+  //msg("Loading [%s] file.\n", iname);
+  nsf = nsf_open_file(iname, &why);
+  if (!nsf) {
+    return strcmp(why, "open failed") ? 3 : 2;
+  }
   //msg("Successfully loaded [%s].\n", iname);
 
-  nsf = (nsf_t *)buffer;
+  /* before anything below edits the header */
+  hash = time_cache_hash(nsf);
+
   cursong = nsf->start_song % (nsf->num_songs+1);
   clean_string((char*)nsf->song_name, (char*)nsf->song_name, sizeof(nsf->song_name));
   clean_string((char*)nsf->artist_name, (char*)nsf->artist_name, sizeof(nsf->artist_name));
@@ -705,9 +1118,9 @@ int nsf_info_main(int na, char **a)
 
     if (!strcmp(arg,"--AT")) {
       unsigned int nf;
-      //nf = nsf_calc_time(nsf, len, cursong, 0, 1);
-      return nsf_calc_time(nsf, len, cursong, 0, 1);
-     if (nf) {
+      //nf = nsf_calc_time(nsf, cursong, 0, 1);
+      nf = nsf_cached_time(nsf, cursong, hash, 1, 0, 0, 0);
+      if (nf) {
 	times[cursong] = nf;
       }
 
@@ -744,7 +1157,7 @@ int nsf_info_main(int na, char **a)
 
       time = times[cursong]
 	? times[cursong]
-	: nsf_calc_time(nsf, len, cursong, 0, 0);
+	: nsf_cached_time(nsf, cursong, hash, 0, 0, 0, 0);
 
       if (!times[cursong] && time) {
 	times[cursong] = time;
@@ -784,7 +1197,7 @@ int nsf_info_main(int na, char **a)
     } else if (!strcmp(arg,"--w") || strstr(arg,"--w=") == arg) {
       const char * oname = iname;
       oname = !strcmp(arg,"--w") ? iname : arg + 4;
-      err = nsf_write_file(oname, nsf, buffer+128, len-128, times);
+      err = nsf_write_file(oname, nsf, times);
     } else if (strstr(arg,"--p=") == arg) {
       fputs(arg+4,stdout);
     } else if (err >= 0) {
@@ -797,52 +1210,267 @@ int nsf_info_main(int na, char **a)
       break;
     }
   }
-  free (buffer);
+  nsf_free(&nsf);
   return (err < 0) ? 255 : 0;
 }
 
-void itoa(int n, char * res)
+/* frames with intro (1 if it couldn't be worked out), and the intro and
+   loop on their own in *intro and *loop, either of which may be NULL */
+unsigned int time_info(char * filename, int track,
+		       unsigned int * intro, unsigned int * loop)
 {
-        if(n < 10)
-        {
-                res[0] = (char)(n) + '0';
-                res[1] = '\0';
-        }
-        else if(n < 100)
-        {
-                res[0] = (char)(n/10) + '0';
-                res[1] = (char)(n%10) + '0';
-                res[2] = '\0';
-        }
-        else if(n < 1000)
-        {
-                res[0] = (char)(n/100) + '0';
-                res[1] = (char)((n/10) % 10)+ '0';
-                res[2] = (char)(n%10) + '0';
-        }
-        else
-                fprintf(stderr, "I'm too dumb to handle numbers over 1000\n");  
+  nsf_t * nsf;
+  unsigned int frames;
+
+  if (intro) {
+    *intro = 0;
+  }
+  if (loop) {
+    *loop = 0;
+  }
+  /* only does anything the first time */
+  if (nsf_init() == -1) {
+    fprintf(stderr, "nsfinfo :  init failed.\n");
+    return 1;
+  }
+  nsf = nsf_open_file(filename, 0);
+  if (!nsf) {
+    return 1;
+  }
+  frames = nsf_cached_time(nsf, track, time_cache_hash(nsf), 1,
+			   intro, loop, 0);
+  nsf_free(&nsf);
+  return frames;
 }
 
-/* returns an int whose top bits are the length with introduction
-   and bottom bits are the length without introduction */
-unsigned int time_info(char * filename, int track)
+/* Batch length scanning.
+ *
+ * time_batch() works out every track of every file it is given, walking
+ * directories for *.nsf files, on a pool of threads that each take the
+ * next file off a shared list.  A file's lines are written in one go, so
+ * the report only interleaves between files.  Lengths are always worked
+ * out afresh, bypassing the cache: re-indexing after a change to the
+ * emulator is what this is for.
+ */
+typedef struct
+{
+  char ** files;
+  int count, max;
+  int next;              /* next file to hand out */
+  int failed;            /* tracks that could not be worked out */
+  FILE * out;
+  pthread_mutex_t lock;
+} time_batch_t;
+
+typedef struct
 {
-        char * argv[4];
-        char argv1[] = "--   ";
-        unsigned int frames, result, wintro, wointro;
-        char num[] = "   ";
+  unsigned int frames, intro, loop;
+  long ms;
+  const char * why;
+} time_batch_track_t;
 
-        itoa(track, num);
+static int batch_add(time_batch_t * b, const char * path)
+{
+  char * name;
 
-        argv1[2] = num[0];
-        argv1[3] = num[1];
-        argv1[4] = num[2];
+  if (b->count == b->max) {
+    int max = b->max ? b->max * 2 : 256;
+    char ** files = malloc(max * sizeof(*files));
 
-        argv[0] = "nsfinfo";
-        argv[1] = filename;
-        argv[2] = argv1;
-        argv[3] = "--AT";
+    if (!files) {
+      return -1;
+    }
+    if (b->files) {
+      memcpy(files, b->files, b->count * sizeof(*files));
+      free(b->files);
+    }
+    b->files = files;
+    b->max = max;
+  }
+  name = malloc(strlen(path) + 1);
+  if (!name) {
+    return -1;
+  }
+  strcpy(name, path);
+  b->files[b->count++] = name;
+  return 0;
+}
+
+static int batch_is_nsf(const char * path)
+{
+  int len = strlen(path);
+  return len > 4 && !strcasecmp(path + len - 4, ".nsf");
+}
+
+/* add path, or every *.nsf below it when it is a directory.  Links to
+ * directories are not followed below the top, so loops can't happen. */
+static void batch_walk(time_batch_t * b, const char * path, int top)
+{
+  struct stat st;
+  DIR * dir;
+  struct dirent * e;
+
+  if ((top ? stat(path, &st) : lstat(path, &st))) {
+    /* named outright: let it show up in the report as failed */
+    if (top) {
+      batch_add(b, path);
+    } else {
+      perror(path);
+    }
+    return;
+  }
+  if (S_ISLNK(st.st_mode) && (stat(path, &st) || S_ISDIR(st.st_mode))) {
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (top || batch_is_nsf(path)) {
+      batch_add(b, path);
+    }
+    return;
+  }
+
+  dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return;
+  }
+  while ((e = readdir(dir)) != 0) {
+    char * sub;
+
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+      continue;
+    }
+    sub = malloc(strlen(path) + strlen(e->d_name) + 2);
+    if (!sub) {
+      break;
+    }
+    sprintf(sub, "%s/%s", path, e->d_name);
+    batch_walk(b, sub, 0);
+    free(sub);
+  }
+  closedir(dir);
+}
+
+static int batch_cmp(const void * a, const void * b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void batch_file(time_batch_t * b, const char * path)
+{
+  time_batch_track_t tracks[256];
+  nsf_t * nsf;
+  const char * why;
+  int songs, track, failed = 0;
+
+  nsf = nsf_open_file(path, &why);
+  if (!nsf) {
+    pthread_mutex_lock(&b->lock);
+    fprintf(b->out, "%s\t0\t0\t0\t0\t0\t%s\n", path, why);
+    b->failed++;
+    pthread_mutex_unlock(&b->lock);
+    return;
+  }
+
+  songs = nsf->num_songs;
+  for (track = 1; track <= songs; ++track) {
+    time_batch_track_t * t = &tracks[track-1];
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    t->frames = nsf_calc_time(nsf, track, 0, 1, &t->intro, &t->loop,
+			      &t->why);
+    gettimeofday(&end, NULL);
+    t->ms = (end.tv_sec - start.tv_sec) * 1000
+      + (end.tv_usec - start.tv_usec) / 1000;
+    failed += (t->frames == 1);
+  }
+  nsf_free(&nsf);
+
+  pthread_mutex_lock(&b->lock);
+  for (track = 1; track <= songs; ++track) {
+    time_batch_track_t * t = &tracks[track-1];
+
+    fprintf(b->out, "%s\t%d\t%u\t%u\t%u\t%ld\t%s\n", path, track,
+	    t->frames == 1 ? 0 : t->frames, t->intro, t->loop, t->ms, t->why);
+  }
+  b->failed += failed;
+  pthread_mutex_unlock(&b->lock);
+}
 
-        return nsf_info_main(4, argv);
+static void * batch_worker(void * arg)
+{
+  time_batch_t * b = arg;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+
+    if (i >= b->count) {
+      break;
+    }
+    batch_file(b, b->files[i]);
+  }
+  return 0;
+}
+
+/* Work out every track of the NSF files (or directories of them) in
+ * paths on jobs threads and write a tab separated report to out: file,
+ * track, frames with intro, intro frames, loop frames, milliseconds spent
+ * and "ok" or what went wrong.  Returns the number of failures. */
+int time_batch(char ** paths, int count, int jobs, FILE * out)
+{
+  time_batch_t b;
+  pthread_t * workers;
+  int i, started = 0;
+
+  memset(&b, 0, sizeof(b));
+  b.out = out;
+  for (i = 0; i < count; ++i) {
+    batch_walk(&b, paths[i], 1);
+  }
+  if (b.count > 1) {
+    qsort(b.files, b.count, sizeof(*b.files), batch_cmp);
+  }
+
+  /* nsf_init()'s guard isn't thread safe, so get it done up front */
+  if (nsf_init() == -1) {
+    fprintf(stderr, "nsfinfo :  init failed.\n");
+    return b.count;
+  }
+
+  fprintf(out, "# file\ttrack\tframes\tintro\tloop\tms\tstatus\n");
+  pthread_mutex_init(&b.lock, NULL);
+
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  workers = malloc(jobs * sizeof(*workers));
+  for (i = 0; workers && i < jobs; ++i) {
+    if (pthread_create(&workers[started], NULL, batch_worker, &b)) {
+      break;
+    }
+    started++;
+  }
+  /* couldn't get any threads at all, so do it ourselves */
+  if (!started) {
+    batch_worker(&b);
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  if (workers) {
+    free(workers);
+  }
+
+  pthread_mutex_destroy(&b.lock);
+  for (i = 0; i < b.count; ++i) {
+    free(b.files[i]);
+  }
+  if (b.files) {
+    free(b.files);
+  }
+  return b.failed;
 }
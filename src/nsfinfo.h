@@ -17,10 +17,21 @@
 ** must bear this legend.
 */
 
+#include <stdio.h>
+
 /* Pretty simple.  Give it a file name and a track and it returns the
-time (in frames) of the track with its intro in the first 2 bytes and
-the time without intro in the last 2 bytes. It's mostly accurate and
+time (in frames) of the track with its intro, once round the loop and a
+little room to spare, and puts the frames of the intro and of the loop
+in *intro and *loop (either may be NULL).  It's mostly accurate and
 pretty fast. */
 
-unsigned int time_info(char * filename, int track);
+unsigned int time_info(char * filename, int track,
+		       unsigned int * intro, unsigned int * loop);
+
 
+/* Work out every track of the given NSF files, and of every *.nsf below
+the given directories, on jobs threads.  One tab separated line per track
+goes to out: file, track, frames with intro, intro frames, loop frames,
+milliseconds spent and "ok" or the reason it failed.  Returns the number
+of failures. */
+int time_batch(char ** paths, int count, int jobs, FILE * out);
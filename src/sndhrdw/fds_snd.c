@@ -23,41 +23,324 @@
 ** $Id: fds_snd.c,v 1.1 2003/04/08 20:53:00 ben Exp $
 */
 
+#include <string.h>
 #include "types.h"
 #include "nes_apu.h"
 #include "fds_snd.h"
 
-static int32 fds_incsize = 0;
+#define  FDS_PHASE_MASK  0x3FFFFF  /* 64 positions, 16 bits of fraction */
 
-/* mix sound channels together */
-static int32 fds_process(void)
+/* master volume, $4089 bits 0-1: 2/2, 2/3, 2/4 and 2/5 */
+static const int32 master_lut[4] = { 240, 160, 120, 96 };
+
+/* $4088 table steps; 4 resets the counter instead */
+static const int mod_lut[8] = { 0, 1, 2, 4, 0, -4, -2, -1 };
+
+/* phase step per sample for a 12-bit frequency, which is what the
+** accumulator gains per cpu cycle
+*/
+static uint32 fds_step(fdssnd_t *fds, uint32 freq)
+{
+   return freq * (fds->incsize >> 16) + ((freq * (fds->incsize & 0xFFFF)) >> 16);
+}
+
+/* bend the wave frequency by the modulator, the way the 2C33 does it:
+** counter times gain, rounded oddly, wrapped, then scaled by the pitch
+*/
+static void fds_pitch(fdssnd_t *fds)
+{
+   int32 temp, rem, pitch;
+
+   pitch = fds->wave_freq;
+   temp = fds->mod_counter * fds->mod_env.gain;
+   rem = temp & 0x0F;
+   temp >>= 4;
+   if (rem && 0 == (temp & 0x80))
+      temp += (fds->mod_counter < 0) ? -1 : 2;
+
+   if (temp >= 192)
+      temp -= 256;
+   else if (temp < -64)
+      temp += 256;
+
+   temp *= pitch;
+   rem = temp & 0x3F;
+   temp >>= 6;
+   if (rem >= 32)
+      temp++;
+
+   pitch += temp;
+   fds->wave_inc = (pitch > 0) ? fds_step(fds, pitch) : 0;
+}
+
+/* both envelopes tick every 8 * (speed + 1) * $408A cpu cycles, too many
+** for 16.16 fixed point, so the timers count whole cycles
+*/
+INLINE boolean fds_envelope(fdssnd_t *fds, fdsenv_t *env, int32 cycles)
+{
+   int32 period;
+   boolean changed = FALSE;
+
+   if (env->reg & 0x80)
+      return FALSE;
+
+   period = ((env->reg & 0x3F) + 1) * fds->env_speed * 8;
+   env->timer += cycles;
+   while (env->timer >= period)
+   {
+      env->timer -= period;
+      if ((env->reg & 0x40) && env->gain < 32)
+      {
+         env->gain++;
+         changed = TRUE;
+      }
+      else if (0 == (env->reg & 0x40) && env->gain > 0)
+      {
+         env->gain--;
+         changed = TRUE;
+      }
+   }
+
+   return changed;
+}
+
+/* step the modulator over the table positions it passed this sample */
+INLINE boolean fds_modulate(fdssnd_t *fds)
 {
-   int32 output;
-   output = 0;
+   uint32 pos, end;
+
+   pos = fds->mod_phase >> 16;
+   fds->mod_phase += fds->mod_inc;
+   end = fds->mod_phase >> 16;
+   fds->mod_phase &= FDS_PHASE_MASK;
+   if (pos == end)
+      return FALSE;
+
+   for (; pos != end; pos++)
+   {
+      int step = fds->mod_table[pos & 0x3F];
+
+      if (4 == step)
+         fds->mod_counter = 0;
+      else
+         fds->mod_counter = ((fds->mod_counter + mod_lut[step] + 64) & 0x7F) - 64;
+   }
+
+   return TRUE;
+}
+
+/* add count samples of the channel into mix.  Every increment is worked
+** out when a register or envelope changes it, so the loop itself is just
+** adds, a table lookup and the filter
+*/
+static void fds_process_block(void *ext, int32 *mix, int count)
+{
+   fdssnd_t *fds = (fdssnd_t *) ext;
+   boolean envelopes = !fds->env_halt && !fds->wave_halt && fds->env_speed;
+   int32 gain;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      boolean bend = FALSE;
+
+      if (envelopes)
+      {
+         int32 cycles;
+
+         fds->env_frac += fds->incsize;
+         cycles = APU_FROM_FIXED(fds->env_frac);
+         fds->env_frac -= APU_TO_FIXED(cycles);
+         fds_envelope(fds, &fds->vol_env, cycles);
+         bend = fds_envelope(fds, &fds->mod_env, cycles);
+      }
+
+      if (fds->mod_inc)
+         bend |= fds_modulate(fds);
+
+      if (bend)
+         fds_pitch(fds);
 
-   return output;
+      if (FALSE == fds->wave_halt && FALSE == fds->wave_write)
+      {
+         fds->wave_phase = (fds->wave_phase + fds->wave_inc) & FDS_PHASE_MASK;
+
+         gain = fds->vol_env.gain < 32 ? fds->vol_env.gain : 32;
+         fds->output = ((fds->wave[fds->wave_phase >> 16] - 32) * gain
+                        * master_lut[fds->master_vol]) >> 5;
+      }
+
+      /* the 2C33's output goes through a low pass around 2 kHz */
+      fds->filter += ((fds->output - fds->filter) * fds->filter_k) >> 16;
+      mix[i] += fds->filter;
+   }
 }
 
 /* write to registers */
-static void fds_write(uint32 address, uint8 value)
+static void fds_write(void *userdata, uint32 address, uint8 value)
+{
+   fdssnd_t *fds = (fdssnd_t *) userdata;
+
+   if (address < 0x4080)
+   {
+      if (fds->wave_write)
+         fds->wave[address & 0x3F] = value & 0x3F;
+      return;
+   }
+
+   switch (address)
+   {
+   case 0x4080:
+   case 0x4084:
+      {
+         fdsenv_t *env = (0x4080 == address) ? &fds->vol_env : &fds->mod_env;
+
+         env->reg = value;
+         env->timer = 0;
+         if (value & 0x80)
+            env->gain = value & 0x3F;
+         fds_pitch(fds);
+      }
+      break;
+
+   case 0x4082:
+      fds->wave_freq = (fds->wave_freq & 0xF00) | value;
+      fds_pitch(fds);
+      break;
+
+   case 0x4083:
+      fds->wave_freq = ((value & 0x0F) << 8) | (fds->wave_freq & 0xFF);
+      fds->wave_halt = (value & 0x80) ? TRUE : FALSE;
+      fds->env_halt = (value & 0x40) ? TRUE : FALSE;
+      if (fds->wave_halt)
+         fds->wave_phase = 0;
+      if (fds->env_halt)
+         fds->vol_env.timer = fds->mod_env.timer = 0;
+      fds_pitch(fds);
+      break;
+
+   case 0x4085:
+      fds->mod_counter = ((value + 64) & 0x7F) - 64;
+      fds_pitch(fds);
+      break;
+
+   case 0x4086:
+   case 0x4087:
+      if (0x4086 == address)
+      {
+         fds->mod_freq = (fds->mod_freq & 0xF00) | value;
+      }
+      else
+      {
+         fds->mod_freq = ((value & 0x0F) << 8) | (fds->mod_freq & 0xFF);
+         fds->mod_halt = (value & 0x80) ? TRUE : FALSE;
+         if (fds->mod_halt)
+            fds->mod_phase &= 0x3F0000;
+      }
+      fds->mod_inc = fds->mod_halt ? 0 : fds_step(fds, fds->mod_freq);
+      break;
+
+   case 0x4088:
+      /* the table only takes writes while the modulator is halted, at
+      ** the position it was halted on
+      */
+      if (fds->mod_halt)
+      {
+         uint32 pos = fds->mod_phase >> 16;
+
+         fds->mod_table[pos & 0x3F] = value & 7;
+         fds->mod_table[(pos + 1) & 0x3F] = value & 7;
+         fds->mod_phase = (fds->mod_phase + 0x20000) & FDS_PHASE_MASK;
+      }
+      break;
+
+   case 0x4089:
+      fds->wave_write = (value & 0x80) ? TRUE : FALSE;
+      fds->master_vol = value & 3;
+      break;
+
+   case 0x408A:
+      fds->env_speed = value;
+      break;
+
+   default:
+      break;
+   }
+}
+
+static uint8 fds_read(void *userdata, uint32 address)
 {
+   fdssnd_t *fds = (fdssnd_t *) userdata;
+
+   if (address < 0x4080)
+      return fds->wave[address & 0x3F] | 0x40;
+   else if (0x4090 == address)
+      return fds->vol_env.gain | 0x40;
+   else if (0x4092 == address)
+      return fds->mod_env.gain | 0x40;
+
+   return 0x40;
 }
 
-/* reset state of vrcvi sound channels */
-static void fds_reset(void)
+/* what fds_read() can see: the wave RAM and both gains */
+#define  FDS_PEEK_SIZE  (64 + 2)
+
+static void fds_peek(void *ext, void *buf)
 {
-   fds_incsize = apu_getcyclerate();
+   fdssnd_t *fds = (fdssnd_t *) ext;
+   uint8 *peek = (uint8 *) buf;
+
+   memcpy(peek, fds->wave, 64);
+   peek[64] = fds->vol_env.gain;
+   peek[65] = fds->mod_env.gain;
 }
 
-static void fds_init(void)
+/* reset state of fds sound channel */
+static void fds_reset(void *ext)
 {
+   fdssnd_t *fds = (fdssnd_t *) ext;
+   int32 incsize = fds->incsize;
+   int32 filter_k = fds->filter_k;
+
+   memset(fds, 0, sizeof(fdssnd_t));
+   fds->incsize = incsize;
+   fds->filter_k = filter_k;
+
+   fds_write(fds, 0x4080, 0x80);
+   fds_write(fds, 0x4084, 0x80);
+   fds_write(fds, 0x4087, 0x80);
+   fds_write(fds, 0x408A, 0xE8);
+}
+
+static void *fds_init(apu_t *apu)
+{
+   fdssnd_t *fds;
+
+   fds = malloc(sizeof(fdssnd_t));
+   if (NULL == fds)
+      return NULL;
+   memset(fds, 0, sizeof(fdssnd_t));
+
+   fds->incsize = apu_getcyclerate(apu);
+
+   /* one pole at 2 kHz: k = w / (w + rate), w = 2 * pi * 2000 */
+   fds->filter_k = (int32) (65536.0 * 12566.0 / (12566.0 + apu->sample_rate));
+
+   return fds;
 }
 
 /* TODO: bleh */
-static void fds_shutdown(void)
+static void fds_shutdown(void *ext)
 {
+   free(ext);
 }
 
+static apu_memread fds_memread[] =
+{
+   { 0x4040, 0x4092, fds_read },
+   {     -1,     -1, NULL }
+};
+
 static apu_memwrite fds_memwrite[] =
 {
    { 0x4040, 0x4092, fds_write }, 
@@ -69,9 +352,16 @@ apuext_t fds_ext =
    fds_init,
    fds_shutdown,
    fds_reset,
-   fds_process,
-   NULL, /* no reads */
-   fds_memwrite
+   NULL, /* see fds_process_block */
+   fds_memread,
+   fds_memwrite,
+   sizeof(fdssnd_t),
+   NULL, /* plain copies */
+   NULL,
+   fds_process_block,
+   NULL, /* one mode */
+   FDS_PEEK_SIZE,
+   fds_peek
 };
 
 /*
@@ -28,6 +28,36 @@
 
 #include "nes_apu.h"
 
+/* $4080 volume / $4084 modulator envelope */
+typedef struct fdsenv_s
+{
+   uint8 reg;        /* 7=direct gain, 6=increase, 0-5=speed or gain */
+   int gain;         /* 0-63 */
+   int32 timer;      /* whole cpu cycles since the last tick */
+} fdsenv_t;
+
+typedef struct fdssnd_s
+{
+   int32 incsize;    /* cpu cycles per sample, fixed point */
+
+   uint8 wave[64];      /* 6-bit samples, $4040-$407F */
+   uint8 mod_table[64]; /* 3-bit steps, two per write to $4088 */
+
+   /* phases count in 16.16ths of a table position, mod 64 positions */
+   uint32 wave_freq, wave_phase, wave_inc;
+   uint32 mod_freq, mod_phase, mod_inc;
+   int mod_counter;     /* 7 bits, signed */
+
+   boolean wave_halt, env_halt, mod_halt, wave_write;
+   int master_vol;
+   uint8 env_speed;     /* $408A, scales both envelopes */
+   fdsenv_t vol_env, mod_env;
+   int32 env_frac;      /* cpu cycles the timers are owed, fixed point */
+
+   int32 output;        /* held while the wave is halted or written */
+   int32 filter, filter_k; /* output low pass, k in 16.16 */
+} fdssnd_t;
+
 extern apuext_t fds_ext;
 
 
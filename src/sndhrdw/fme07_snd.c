@@ -0,0 +1,320 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** fme07_snd.c
+**
+** Sunsoft FME-07 / 5B sound emulation
+**
+** The 5B is a YM2149 (AY-3-8910) core: three squares, a noise shift
+** register and a 32 step envelope, clocked at half the cpu rate.  Its
+** squares can run far above the output rate, so rather than oversample
+** it the chip is stepped from one counter event to the next, and each
+** change of the summed output is laid down as a band-limited step.
+*/
+
+#include <string.h>
+#include "types.h"
+#include "nes_apu.h"
+#include "fme07_snd.h"
+
+/* DAC levels, 1.5dB apart; a 4-bit volume v plays at 2v+1 */
+static const int32 fme07_lut[32] =
+{
+      0,   23,   27,   33,   39,   46,   55,   65,
+     77,   92,  109,  130,  154,  183,  217,  258,
+    307,  365,  434,  516,  613,  728,  866, 1029,
+   1223, 1453, 1727, 2053, 2440, 2900, 3446, 4096
+};
+
+/* counter periods in cpu cycles; a period of 0 acts as 1 */
+INLINE int32 fme07_toneperiod(fme07snd_t *fme07, int chan)
+{
+   int32 period = fme07->regs[chan << 1] | ((fme07->regs[(chan << 1) + 1] & 0x0F) << 8);
+
+   return (period ? period : 1) << 4;
+}
+
+INLINE int32 fme07_noiseperiod(fme07snd_t *fme07)
+{
+   int32 period = fme07->regs[6] & 0x1F;
+
+   return (period ? period : 1) << 5;
+}
+
+INLINE int32 fme07_envperiod(fme07snd_t *fme07)
+{
+   int32 period = fme07->regs[0x0B] | (fme07->regs[0x0C] << 8);
+
+   return (period ? period : 1) << 4;
+}
+
+/* cycles to the next counter event */
+INLINE int32 fme07_next(fme07snd_t *fme07)
+{
+   int32 step = fme07->noise_count;
+   int chan;
+
+   for (chan = 0; chan < 3; chan++)
+   {
+      if (fme07->tone_count[chan] < step)
+         step = fme07->tone_count[chan];
+   }
+
+   if (FALSE == fme07->env_holding && fme07->env_count < step)
+      step = fme07->env_count;
+
+   return step;
+}
+
+static void fme07_env_clock(fme07snd_t *fme07)
+{
+   if (--fme07->env_step >= 0)
+      return;
+
+   if (fme07->env_alt)
+      fme07->env_attack ^= 0x1F;
+
+   if (fme07->env_hold)
+   {
+      fme07->env_holding = TRUE;
+      fme07->env_step = 0;
+   }
+   else
+   {
+      fme07->env_step &= 0x1F;
+   }
+}
+
+/* run the counters on by cycles, firing any that reach zero */
+INLINE void fme07_run(fme07snd_t *fme07, int32 cycles)
+{
+   int chan;
+
+   for (chan = 0; chan < 3; chan++)
+   {
+      fme07->tone_count[chan] -= cycles;
+      if (0 == fme07->tone_count[chan])
+      {
+         fme07->tone_count[chan] = fme07_toneperiod(fme07, chan);
+         fme07->tones ^= 1 << chan;
+      }
+   }
+
+   fme07->noise_count -= cycles;
+   if (0 == fme07->noise_count)
+   {
+      fme07->noise_count = fme07_noiseperiod(fme07);
+      fme07->noise_sreg ^= ((fme07->noise_sreg ^ (fme07->noise_sreg >> 3)) & 1) << 17;
+      fme07->noise_sreg >>= 1;
+   }
+
+   if (FALSE == fme07->env_holding)
+   {
+      fme07->env_count -= cycles;
+      if (0 == fme07->env_count)
+      {
+         fme07->env_count = fme07_envperiod(fme07);
+         fme07_env_clock(fme07);
+      }
+   }
+}
+
+/* summed output of the three channels */
+static int32 fme07_output(fme07snd_t *fme07)
+{
+   uint8 mixer = fme07->regs[7];
+   int noise = fme07->noise_sreg & 1;
+   int32 out = 0;
+   int chan, vol;
+
+   for (chan = 0; chan < 3; chan++)
+   {
+      /* a channel with tone and noise both off plays its volume */
+      if (0 == (((fme07->tones | mixer) >> chan) & (noise | (mixer >> (chan + 3))) & 1))
+         continue;
+
+      vol = fme07->regs[8 + chan];
+      if (vol & 0x10)
+         out += fme07_lut[fme07->env_step ^ fme07->env_attack];
+      else if (vol & 0x0F)
+         out += fme07_lut[((vol & 0x0F) << 1) + 1];
+   }
+
+   return out;
+}
+
+/* step to the current output, offset (16.16 cycles) into sample pos */
+INLINE void fme07_step(fme07snd_t *fme07, int pos, int32 offset)
+{
+   int32 out = fme07_output(fme07);
+
+   if (out != fme07->level)
+   {
+      apu_blep_add(fme07->blep_buf, pos, offset, fme07->blep_rate, out - fme07->level);
+      fme07->level = out;
+   }
+}
+
+static void fme07_process_block(void *ext, int32 *mix, int count)
+{
+   fme07snd_t *fme07 = (fme07snd_t *) ext;
+   int32 left = fme07->leftover;
+   int32 budget, used, step, avail;
+   int i;
+
+   /* pick up register writes since the last block */
+   fme07_step(fme07, 0, 0);
+
+   for (i = 0; i < count; i++)
+   {
+      /* left is where this sample starts past the last whole cycle run,
+      ** so an event used cycles on lands used - left into the sample
+      */
+      budget = left + fme07->incsize;
+      used = 0;
+
+      for (;;)
+      {
+         step = fme07_next(fme07);
+         avail = (budget - used) >> 16;
+         if (step > avail)
+         {
+            fme07_run(fme07, avail);
+            used += avail << 16;
+            break;
+         }
+
+         fme07_run(fme07, step);
+         used += step << 16;
+         fme07_step(fme07, i, used - left);
+      }
+
+      left = budget - used;
+   }
+
+   fme07->leftover = left;
+
+   apu_blep_mix(fme07->blep_buf, &fme07->blep_sum, mix, count);
+}
+
+static void fme07_write(void *userdata, uint32 address, uint8 value)
+{
+   fme07snd_t *fme07 = (fme07snd_t *) userdata;
+   int reg;
+
+   if (0xC000 == (address & 0xE000))
+   {
+      fme07->reg_select = value;
+      return;
+   }
+
+   /* the upper nibble of the select has to be clear */
+   reg = fme07->reg_select;
+   if (reg > 0x0F)
+      return;
+
+   fme07->regs[reg] = value;
+
+   /* a new tone, noise or envelope period is picked up when the counter
+   ** running down the old one reloads, so only an envelope restart has
+   ** anything to do here
+   */
+   if (0x0D != reg)
+      return;
+
+   /* without continue the envelope holds at the end, at the level it
+   ** started from if it attacked
+   */
+   fme07->env_attack = (value & 0x04) ? 0x1F : 0;
+   if (value & 0x08)
+   {
+      fme07->env_hold = (value & 0x01) ? TRUE : FALSE;
+      fme07->env_alt = (value & 0x02) ? TRUE : FALSE;
+   }
+   else
+   {
+      fme07->env_hold = TRUE;
+      fme07->env_alt = fme07->env_attack ? TRUE : FALSE;
+   }
+   fme07->env_step = 0x1F;
+   fme07->env_holding = FALSE;
+   fme07->env_count = fme07_envperiod(fme07);
+}
+
+/* reset state of 5B sound channels */
+static void fme07_reset(void *ext)
+{
+   fme07snd_t *fme07 = (fme07snd_t *) ext;
+   int32 incsize = fme07->incsize;
+   int32 blep_rate = fme07->blep_rate;
+   int chan;
+
+   memset(fme07, 0, sizeof(fme07snd_t));
+   fme07->incsize = incsize;
+   fme07->blep_rate = blep_rate;
+
+   for (chan = 0; chan < 3; chan++)
+      fme07->tone_count[chan] = fme07_toneperiod(fme07, chan);
+   fme07->noise_count = fme07_noiseperiod(fme07);
+   fme07->env_count = fme07_envperiod(fme07);
+   fme07->noise_sreg = 1;
+   fme07->env_holding = TRUE;
+}
+
+static void *fme07_init(apu_t *apu)
+{
+   fme07snd_t *fme07;
+
+   fme07 = malloc(sizeof(fme07snd_t));
+   if (NULL == fme07)
+      return NULL;
+   memset(fme07, 0, sizeof(fme07snd_t));
+
+   fme07->incsize = apu_getcyclerate(apu);
+   fme07->blep_rate = apu_getbleprate(apu);
+
+   return fme07;
+}
+
+static void fme07_shutdown(void *ext)
+{
+   free(ext);
+}
+
+static apu_memwrite fme07_memwrite[] =
+{
+   { 0xC000, 0xDFFF, fme07_write }, /* register select */
+   { 0xE000, 0xFFFF, fme07_write }, /* register data */
+   {     -1,     -1, NULL }
+};
+
+apuext_t fme07_ext =
+{
+   fme07_init,
+   fme07_shutdown,
+   fme07_reset,
+   NULL, /* see fme07_process_block */
+   NULL, /* no readable registers */
+   fme07_memwrite,
+   sizeof(fme07snd_t),
+   NULL, /* plain copies */
+   NULL,
+   fme07_process_block,
+   NULL  /* one mode */
+};
@@ -0,0 +1,61 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** fme07_snd.h
+**
+** Sunsoft FME-07 / 5B sound emulation
+*/
+
+#ifndef _FME07_SND_H_
+#define _FME07_SND_H_
+
+#include "nes_apu.h"
+
+typedef struct fme07snd_s
+{
+   int32 incsize;       /* cpu cycles per sample, fixed point */
+   int32 blep_rate;     /* from apu_getbleprate() */
+
+   uint8 reg_select;    /* $C000 */
+   uint8 regs[16];      /* $E000: the AY-3-8910 register file */
+
+   /* cpu cycles until each counter next fires */
+   int32 tone_count[3];
+   int32 noise_count;
+   int32 env_count;
+
+   uint8 tones;         /* square outputs, bit 0 = channel A */
+   uint32 noise_sreg;   /* 17 bit shift register */
+
+   /* envelope: step counts 31 down to 0, xor attack gives the level */
+   int env_step, env_attack;
+   boolean env_hold, env_alt, env_holding;
+
+   /* 16.16 cycles from the last whole cycle run to the next sample */
+   int32 leftover;
+
+   /* band-limited steps of the summed output */
+   int32 level;
+   int32 blep_buf[APU_BLOCK_SIZE + APU_BLEP_WIDTH];
+   int32 blep_sum;
+} fme07snd_t;
+
+extern apuext_t fme07_ext;
+
+#endif /* _FME07_SND_H_ */
@@ -34,17 +34,6 @@
 #define  APU_VOLUME_DECAY(x)  ((x) -= ((x) >> 7))
 
 
-typedef struct mmc5dac_s
-{
-   int32 output;
-   boolean enabled;
-} mmc5dac_t;
-
-
-/* look up table madness */
-static int32 decay_lut[16];
-static int vbl_lut[32];
-
 /* various sound constants for sound emulation */
 /* vblank length table used for rectangles, triangle, noise */
 static const uint8 vbl_length[32] =
@@ -63,13 +52,8 @@ static const int duty_lut[4] =
 };
 
 
-static int32 mmc5_incsize;
-static uint8 mul[2];
-static mmc5rectangle_t mmc5rect[2];
-static mmc5dac_t mmc5dac;
-
 #define  MMC5_RECTANGLE_OUTPUT   chan->output_vol
-static int32 mmc5_rectangle(mmc5rectangle_t *chan)
+static int32 mmc5_rectangle(mmc5snd_t *mmc5, mmc5rectangle_t *chan)
 {
    int32 output;
 
@@ -108,7 +92,7 @@ static int32 mmc5_rectangle(mmc5rectangle_t *chan)
    if (chan->freq < APU_TO_FIXED(4))
       return MMC5_RECTANGLE_OUTPUT;
 
-   chan->phaseacc -= mmc5_incsize; /* # of cycles per sample */
+   chan->phaseacc -= mmc5->incsize; /* # of cycles per sample */
    if (chan->phaseacc >= 0)
       return MMC5_RECTANGLE_OUTPUT;
 
@@ -153,11 +137,12 @@ static int32 mmc5_rectangle(mmc5rectangle_t *chan)
    return MMC5_RECTANGLE_OUTPUT;
 }
 
-static uint8 mmc5_read(uint32 address)
+static uint8 mmc5_read(void *userdata, uint32 address)
 {
+   mmc5snd_t *mmc5 = (mmc5snd_t *) userdata;
    uint32 retval;
 
-   retval = (uint32) (mul[0] * mul[1]);
+   retval = (uint32) (mmc5->mul[0] * mmc5->mul[1]);
 
    switch (address)
    {
@@ -172,22 +157,34 @@ static uint8 mmc5_read(uint32 address)
    }
 }
 
+/* the multiplier is all there is to read */
+#define  MMC5_PEEK_SIZE 2
+
+static void mmc5_peek(void *ext, void *buf)
+{
+   mmc5snd_t *mmc5 = (mmc5snd_t *) ext;
+
+   memcpy(buf, mmc5->mul, MMC5_PEEK_SIZE);
+}
+
 /* mix vrcvi sound channels together */
-static int32 mmc5_process(void)
+static int32 mmc5_process(void *ext)
 {
+   mmc5snd_t *mmc5 = (mmc5snd_t *) ext;
    int32 accum;
 
-   accum = mmc5_rectangle(&mmc5rect[0]);
-   accum += mmc5_rectangle(&mmc5rect[1]);
-   if (mmc5dac.enabled)
-      accum += mmc5dac.output;
+   accum = mmc5_rectangle(mmc5, &mmc5->rect[0]);
+   accum += mmc5_rectangle(mmc5, &mmc5->rect[1]);
+   if (mmc5->dac.enabled)
+      accum += mmc5->dac.output;
 
    return accum;
 }
 
 /* write to registers */
-static void mmc5_write(uint32 address, uint8 value)
+static void mmc5_write(void *userdata, uint32 address, uint8 value)
 {
+   mmc5snd_t *mmc5 = (mmc5snd_t *) userdata;
    int chan;
 
    switch (address)
@@ -196,13 +193,13 @@ static void mmc5_write(uint32 address, uint8 value)
    case MMC5_WRA0:
    case MMC5_WRB0:
       chan = (address & 4) ? 1 : 0;
-      mmc5rect[chan].regs[0] = value;
+      mmc5->rect[chan].regs[0] = value;
 
-      mmc5rect[chan].volume = value & 0x0F;
-      mmc5rect[chan].env_delay = decay_lut[value & 0x0F];
-      mmc5rect[chan].holdnote = (value & 0x20) ? TRUE : FALSE;
-      mmc5rect[chan].fixed_envelope = (value & 0x10) ? TRUE : FALSE;
-      mmc5rect[chan].duty_flip = duty_lut[value >> 6];
+      mmc5->rect[chan].volume = value & 0x0F;
+      mmc5->rect[chan].env_delay = mmc5->decay_lut[value & 0x0F];
+      mmc5->rect[chan].holdnote = (value & 0x20) ? TRUE : FALSE;
+      mmc5->rect[chan].fixed_envelope = (value & 0x10) ? TRUE : FALSE;
+      mmc5->rect[chan].duty_flip = duty_lut[value >> 6];
       break;
 
    case MMC5_WRA1:
@@ -212,61 +209,61 @@ static void mmc5_write(uint32 address, uint8 value)
    case MMC5_WRA2:
    case MMC5_WRB2:
       chan = (address & 4) ? 1 : 0;
-      mmc5rect[chan].regs[2] = value;
-      if (mmc5rect[chan].enabled)
-         mmc5rect[chan].freq = APU_TO_FIXED((((mmc5rect[chan].regs[3] & 7) << 8) + value) + 1);
+      mmc5->rect[chan].regs[2] = value;
+      if (mmc5->rect[chan].enabled)
+         mmc5->rect[chan].freq = APU_TO_FIXED((((mmc5->rect[chan].regs[3] & 7) << 8) + value) + 1);
       break;
 
    case MMC5_WRA3:
    case MMC5_WRB3:
       chan = (address & 4) ? 1 : 0;
-      mmc5rect[chan].regs[3] = value;
+      mmc5->rect[chan].regs[3] = value;
 
-      if (mmc5rect[chan].enabled)
+      if (mmc5->rect[chan].enabled)
       {
-         mmc5rect[chan].vbl_length = vbl_lut[value >> 3];
-         mmc5rect[chan].env_vol = 0;
-         mmc5rect[chan].freq = APU_TO_FIXED((((value & 7) << 8) + mmc5rect[chan].regs[2]) + 1);
-         mmc5rect[chan].adder = 0;
+         mmc5->rect[chan].vbl_length = mmc5->vbl_lut[value >> 3];
+         mmc5->rect[chan].env_vol = 0;
+         mmc5->rect[chan].freq = APU_TO_FIXED((((value & 7) << 8) + mmc5->rect[chan].regs[2]) + 1);
+         mmc5->rect[chan].adder = 0;
       }
       break;
    
    case MMC5_SMASK:
       if (value & 0x01)
-         mmc5rect[0].enabled = TRUE;
+         mmc5->rect[0].enabled = TRUE;
       else
       {
-         mmc5rect[0].enabled = FALSE;
-         mmc5rect[0].vbl_length = 0;
+         mmc5->rect[0].enabled = FALSE;
+         mmc5->rect[0].vbl_length = 0;
       }
 
       if (value & 0x02)
-         mmc5rect[1].enabled = TRUE;
+         mmc5->rect[1].enabled = TRUE;
       else
       {
-         mmc5rect[1].enabled = FALSE;
-         mmc5rect[1].vbl_length = 0;
+         mmc5->rect[1].enabled = FALSE;
+         mmc5->rect[1].vbl_length = 0;
       }
 
       break;
 
    case 0x5010:
       if (value & 0x01)
-         mmc5dac.enabled = TRUE;
+         mmc5->dac.enabled = TRUE;
       else
-         mmc5dac.enabled = FALSE;
+         mmc5->dac.enabled = FALSE;
       break;
 
    case 0x5011:
-      mmc5dac.output = (value ^ 0x80) << 8;
+      mmc5->dac.output = (value ^ 0x80) << 8;
       break;
 
    case 0x5205:
-      mul[0] = value;
+      mmc5->mul[0] = value;
       break;
 
    case 0x5206:
-      mul[1] = value;
+      mmc5->mul[1] = value;
       break;
 
    default:
@@ -275,37 +272,45 @@ static void mmc5_write(uint32 address, uint8 value)
 }
 
 /* reset state of vrcvi sound channels */
-static void mmc5_reset(void)
+static void mmc5_reset(void *ext)
 {
    int i;
 
-   /* get the phase period from the apu */
-   mmc5_incsize = apu_getcyclerate();
-
    for (i = 0x5000; i < 0x5008; i++)
-      mmc5_write(i, 0);
+      mmc5_write(ext, i, 0);
 
-   mmc5_write(0x5010, 0);
-   mmc5_write(0x5011, 0);
+   mmc5_write(ext, 0x5010, 0);
+   mmc5_write(ext, 0x5011, 0);
 }
 
-static void mmc5_init(void)
+static void *mmc5_init(apu_t *apu)
 {
+   mmc5snd_t *mmc5;
    int i;
-   int num_samples = apu_getcontext()->num_samples;
+   int num_samples = apu->num_samples;
+
+   mmc5 = malloc(sizeof(mmc5snd_t));
+   if (NULL == mmc5)
+      return NULL;
+   memset(mmc5, 0, sizeof(mmc5snd_t));
+
+   /* get the phase period from the apu */
+   mmc5->incsize = apu_getcyclerate(apu);
 
    /* lut used for enveloping and frequency sweeps */
    for (i = 0; i < 16; i++)
-      decay_lut[i] = num_samples * (i + 1);
+      mmc5->decay_lut[i] = num_samples * (i + 1);
 
    /* used for note length, based on vblanks and size of audio buffer */
    for (i = 0; i < 32; i++)
-      vbl_lut[i] = vbl_length[i] * num_samples;
+      mmc5->vbl_lut[i] = vbl_length[i] * num_samples;
+
+   return mmc5;
 }
 
-/* TODO: bleh */
-static void mmc5_shutdown(void)
+static void mmc5_shutdown(void *ext)
 {
+   free(ext);
 }
 
 static apu_memread mmc5_memread[] =
@@ -328,7 +333,14 @@ apuext_t mmc5_ext =
    mmc5_reset,
    mmc5_process,
    mmc5_memread,
-   mmc5_memwrite
+   mmc5_memwrite,
+   sizeof(mmc5snd_t),
+   NULL, /* plain copies */
+   NULL,
+   NULL, /* mixed per sample by mmc5_process */
+   NULL, /* one mode */
+   MMC5_PEEK_SIZE,
+   mmc5_peek
 };
 
 /*
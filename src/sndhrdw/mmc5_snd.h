@@ -58,6 +58,24 @@ typedef struct mmc5rectangle_s
    int duty_flip;
 } mmc5rectangle_t;
 
+typedef struct mmc5dac_s
+{
+   int32 output;
+   boolean enabled;
+} mmc5dac_t;
+
+typedef struct mmc5snd_s
+{
+   mmc5rectangle_t rect[2];
+   mmc5dac_t dac;
+   uint8 mul[2];
+   int32 incsize;
+
+   /* look up table madness */
+   int32 decay_lut[16];
+   int vbl_lut[32];
+} mmc5snd_t;
+
 
 #include "nes_apu.h"
 
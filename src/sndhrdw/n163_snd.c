@@ -0,0 +1,318 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** n163_snd.c
+**
+** Namco 163 sound emulation
+**
+** The chip has one adder, which it hands to each active channel in turn
+** for 15 cpu cycles: the channel's phase steps by its frequency, and the
+** DAC plays that channel's sample until the next turn.  With more than a
+** few channels the turns come round slowly enough to hear as a whine.
+** Accurate mode renders the turns as they happen; fast mode steps every
+** channel continuously and averages them, which is what the turns add up
+** to once the whine is filtered out.
+*/
+
+#include <string.h>
+#include "types.h"
+#include "nes_apu.h"
+#include "n163_snd.h"
+
+/* times in accurate mode are in 256ths of a cpu cycle */
+#define  N163_SLOT         (15 << 8)
+
+#define  N163_CHANNELS(n)  ((((n)->ram[0x7F] >> 4) & 7) + 1)
+
+/* registers of the k'th active channel, k = 0 being channel 8 */
+#define  N163_REGS(n, k)   (&(n)->ram[0x78 - ((k) << 3)])
+
+INLINE uint32 n163_getphase(const uint8 *reg)
+{
+   return reg[1] | (reg[3] << 8) | (reg[5] << 16);
+}
+
+INLINE void n163_setphase(uint8 *reg, uint32 phase)
+{
+   reg[1] = phase & 0xFF;
+   reg[3] = (phase >> 8) & 0xFF;
+   reg[5] = (phase >> 16) & 0xFF;
+}
+
+INLINE uint32 n163_getfreq(const uint8 *reg)
+{
+   return reg[0] | (reg[2] << 8) | ((reg[4] & 3) << 16);
+}
+
+/* wave length in samples: 4 to 256 */
+INLINE int n163_getlength(const uint8 *reg)
+{
+   return 256 - (reg[4] & 0xFC);
+}
+
+/* 4-bit sample pos of the wave starting at reg[6] */
+INLINE int n163_sample(n163snd_t *n163, const uint8 *reg, uint32 pos)
+{
+   pos = (pos + reg[6]) & 0xFF;
+   return ((n163->ram[pos >> 1] >> ((pos & 1) << 2)) & 0x0F) - 8;
+}
+
+/* add level into acc from time start to end, split at sample boundaries;
+** acc is scaled by the sample length, period
+*/
+INLINE void n163_spread(int32 *acc, int32 period, int32 start, int32 end,
+                        int32 level)
+{
+   while (start < end)
+   {
+      int i = start / period;
+      int32 edge = (i + 1) * period;
+
+      if (edge > end)
+         edge = end;
+      acc[i] += level * (edge - start);
+      start = edge;
+   }
+}
+
+/* accurate mode: each channel is stepped on its own turns, and each turn
+** is added to the samples it overlaps in proportion
+*/
+static void n163_accurate(n163snd_t *n163, int32 *mix, int count)
+{
+   int32 acc[APU_BLOCK_SIZE];
+   int32 period = n163->incsize >> 8;
+   int32 end = count * period;
+   int32 first, t;
+   int channels = N163_CHANNELS(n163);
+   int k, i, turns;
+
+   memset(acc, 0, count * sizeof(int32));
+
+   if (n163->slot >= channels)
+      n163->slot = 0;
+   first = n163->slot_time;
+
+   /* the end of the turn that was under way when the last block ended */
+   k = (n163->slot + channels - 1) % channels;
+   n163_spread(acc, period, 0, first < end ? first : end, n163->output[k]);
+
+   for (k = 0; k < channels; k++)
+   {
+      uint8 *reg = N163_REGS(n163, k);
+      uint32 phase = n163_getphase(reg);
+      uint32 freq = n163_getfreq(reg);
+      uint32 wrap = n163_getlength(reg) << 16;
+      int32 volume = reg[7] & 0x0F;
+
+      t = first + ((k - n163->slot + channels) % channels) * N163_SLOT;
+      for (; t < end; t += channels * N163_SLOT)
+      {
+         phase = (phase + freq) % wrap;
+         n163->output[k] = (n163_sample(n163, reg, phase >> 16) * volume) << 6;
+         n163_spread(acc, period, t, (t + N163_SLOT < end) ? t + N163_SLOT : end,
+                     n163->output[k]);
+      }
+
+      n163_setphase(reg, phase);
+   }
+
+   /* pick up where the turns left off */
+   turns = (first < end) ? (end - first + N163_SLOT - 1) / N163_SLOT : 0;
+   n163->slot_time = first + turns * N163_SLOT - end;
+   n163->slot = (n163->slot + turns) % channels;
+
+   for (i = 0; i < count; i++)
+      mix[i] += acc[i] / period;
+}
+
+/* fast mode: a whole block per channel, each stepped by its share of the
+** turns every sample, with the phase carrying 8 more bits than the chip's
+*/
+static void n163_fast(n163snd_t *n163, int32 *mix, int count)
+{
+   int channels = N163_CHANNELS(n163);
+   int k, i;
+
+   for (k = 0; k < channels; k++)
+   {
+      uint8 *reg = N163_REGS(n163, k);
+      uint32 phase = (n163_getphase(reg) << 8) | n163->phase_frac[k];
+      uint32 wrap = (uint32) n163_getlength(reg) << 24; /* 0: 256 samples */
+      uint32 inc;
+      int32 gain = ((reg[7] & 0x0F) << 12) / channels;
+
+      inc = (uint32) ((double) n163_getfreq(reg) * n163->incsize
+                      / (65536.0 * 15.0 * channels) * 256.0);
+      if (wrap)
+      {
+         inc %= wrap;
+         phase %= wrap;
+      }
+
+      for (i = 0; i < count; i++)
+      {
+         if (wrap && phase >= wrap - inc)
+            phase -= wrap - inc;
+         else
+            phase += inc;
+
+         mix[i] += (n163_sample(n163, reg, phase >> 24) * gain) >> 6;
+      }
+
+      n163_setphase(reg, phase >> 8);
+      n163->phase_frac[k] = phase & 0xFF;
+   }
+}
+
+static void n163_process_block(void *ext, int32 *mix, int count)
+{
+   n163snd_t *n163 = (n163snd_t *) ext;
+
+   if (APU_EXTMODE_FAST == n163->mode)
+      n163_fast(n163, mix, count);
+   else
+      n163_accurate(n163, mix, count);
+}
+
+/* step the address port after a data access, if it's set to */
+INLINE void n163_autoinc(n163snd_t *n163)
+{
+   if (n163->addr & 0x80)
+      n163->addr = 0x80 | ((n163->addr + 1) & 0x7F);
+}
+
+/* write to registers */
+static void n163_write(void *userdata, uint32 address, uint8 value)
+{
+   n163snd_t *n163 = (n163snd_t *) userdata;
+
+   switch (address & 0xF800)
+   {
+   case 0x4800:
+      n163->ram[n163->addr & 0x7F] = value;
+      n163_autoinc(n163);
+      break;
+
+   case 0xF800:
+      n163->addr = value;
+      break;
+
+   default:
+      break;
+   }
+}
+
+static uint8 n163_read(void *userdata, uint32 address)
+{
+   n163snd_t *n163 = (n163snd_t *) userdata;
+   uint8 value;
+
+   (void) address; /* the data port is the only register read */
+   value = n163->ram[n163->addr & 0x7F];
+   n163_autoinc(n163);
+
+   return value;
+}
+
+/* all of the RAM can be read through the data port, and where it reads
+** next */
+#define  N163_PEEK_SIZE (128 + 1)
+
+static void n163_peek(void *ext, void *buf)
+{
+   n163snd_t *n163 = (n163snd_t *) ext;
+   uint8 *peek = (uint8 *) buf;
+
+   memcpy(peek, n163->ram, 128);
+   peek[128] = n163->addr;
+}
+
+/* -1 just returns the current mode */
+static int n163_setmode(void *ext, int mode)
+{
+   n163snd_t *n163 = (n163snd_t *) ext;
+   int old = n163->mode;
+
+   if (mode != -1)
+      n163->mode = mode;
+   return old;
+}
+
+/* reset state of n163 sound channels */
+static void n163_reset(void *ext)
+{
+   n163snd_t *n163 = (n163snd_t *) ext;
+   int32 incsize = n163->incsize;
+   int mode = n163->mode;
+
+   memset(n163, 0, sizeof(n163snd_t));
+   n163->incsize = incsize;
+   n163->mode = mode;
+}
+
+static void *n163_init(apu_t *apu)
+{
+   n163snd_t *n163;
+
+   n163 = malloc(sizeof(n163snd_t));
+   if (NULL == n163)
+      return NULL;
+   memset(n163, 0, sizeof(n163snd_t));
+
+   n163->incsize = apu_getcyclerate(apu);
+   n163->mode = APU_EXTMODE_ACCURATE;
+
+   return n163;
+}
+
+static void n163_shutdown(void *ext)
+{
+   free(ext);
+}
+
+static apu_memread n163_memread[] =
+{
+   { 0x4800, 0x4FFF, n163_read },
+   {     -1,     -1, NULL }
+};
+
+static apu_memwrite n163_memwrite[] =
+{
+   { 0x4800, 0x4FFF, n163_write }, /* data port */
+   { 0xF800, 0xFFFF, n163_write }, /* address port */
+   {     -1,     -1, NULL }
+};
+
+apuext_t n163_ext =
+{
+   n163_init,
+   n163_shutdown,
+   n163_reset,
+   NULL, /* see n163_process_block */
+   n163_memread,
+   n163_memwrite,
+   sizeof(n163snd_t),
+   NULL, /* plain copies */
+   NULL,
+   n163_process_block,
+   n163_setmode,
+   N163_PEEK_SIZE,
+   n163_peek
+};
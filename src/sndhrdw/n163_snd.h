@@ -0,0 +1,56 @@
+/*
+** Nofrendo (c) 1998-2000 Matthew Conte (matt@conte.com)
+**
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of version 2 of the GNU Library General
+** Public License as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+** Library General Public License for more details.  To obtain a
+** copy of the GNU Library General Public License, write to the Free
+** Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+**
+** Any permitted reproduction of these routines, in whole or in part,
+** must bear this legend.
+**
+**
+** n163_snd.h
+**
+** Namco 163 sound emulation
+*/
+
+#ifndef _N163_SND_H_
+#define _N163_SND_H_
+
+#include "nes_apu.h"
+
+typedef struct n163snd_s
+{
+   int32 incsize;       /* cpu cycles per sample, fixed point */
+
+   /* 4-bit wave samples from the bottom up, 8 bytes of registers per
+   ** channel from $78 (channel 8) down to $40 (channel 1)
+   */
+   uint8 ram[128];
+   uint8 addr;          /* $F800: 0-6=address, 7=auto-increment */
+   int mode;            /* APU_EXTMODE_ACCURATE or APU_EXTMODE_FAST */
+
+   /* accurate mode: the active channels take 15 cycle turns, channel 8
+   ** first.  slot_time is where the next turn starts, past the start of
+   ** the next block (fixed point), and slot whose turn it is (0 = channel
+   ** 8); output holds each channel's level from its last turn
+   */
+   int32 slot_time;
+   int slot;
+   int32 output[8];
+
+   /* fast mode: phase bits below the chip's 24 */
+   uint8 phase_frac[8];
+} n163snd_t;
+
+extern apuext_t n163_ext;
+
+#endif /* _N163_SND_H_ */
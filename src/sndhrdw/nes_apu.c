@@ -24,6 +24,12 @@
 */
 
 #include <string.h>
+/* ahead of types.h, whose memguard macros would mangle mm_malloc.h */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "types.h"
 #include "log.h"
 #include "nes_apu.h"
@@ -43,20 +49,6 @@
 #define  APU_VOLUME_DECAY(x)  ((x) -= ((x) >> 7))
 
 
-/* pointer to active APU */
-static apu_t *apu;
-
-/* look up table madness */
-static int32 decay_lut[16];
-static int vbl_lut[32];
-static int trilength_lut[128];
-
-/* noise lookups for both modes */
-#ifndef REALTIME_NOISE
-static int8 noise_long_lut[APU_NOISE_32K];
-static int8 noise_short_lut[APU_NOISE_93];
-#endif /* !REALTIME_NOISE */
-
 /* $$$ ben : last error */
 #define SET_APU_ERROR(APU,X) \
 if (APU) (APU)->errstr = "apu: " X; else
@@ -107,35 +99,104 @@ const int dmc_clocks[16] =
 /* ratios of pos/neg pulse for rectangle waves */
 static const int duty_lut[4] = { 2, 4, 8, 12 };
 
-
-void apu_setcontext(apu_t *src_apu)
+/* band-limited unit step, as the difference it makes to each of the
+** samples it spans, for each sub-sample phase it can start at.  a
+** Blackman-windowed sinc cut off at 0.45 of the sample rate; every row
+** sums to exactly 1 << APU_BLEP_BITS so steps never leave a DC error
+*/
+static const int16 blep_kernel[APU_BLEP_PHASES][APU_BLEP_WIDTH] =
 {
-   apu = src_apu;
-   /* $$$ ben reset eoor string here. */
-   SET_APU_ERROR(apu,"no error");
-}
+   {    1,   -4,    9,   -4,  -31,  139, -424, 2362, 2362, -424,  139,  -31,   -4,    9,   -4,    1 },
+   {    1,   -4,    7,    0,  -40,  154, -442, 2257, 2463, -400,  123,  -21,   -9,   11,   -5,    1 },
+   {    1,   -3,    5,    5,  -48,  166, -456, 2149, 2560, -371,  105,  -11,  -14,   12,   -5,    1 },
+   {    1,   -3,    3,    9,  -56,  177, -465, 2038, 2654, -337,   85,    0,  -19,   14,   -6,    1 },
+   {    0,   -2,    2,   12,  -63,  186, -470, 1925, 2742, -298,   64,   12,  -25,   16,   -6,    1 },
+   {    0,   -2,    0,   16,  -68,  192, -470, 1810, 2826, -254,   40,   24,  -30,   18,   -7,    1 },
+   {    0,   -2,   -1,   19,  -73,  197, -467, 1694, 2902, -204,   16,   36,  -35,   20,   -7,    1 },
+   {    0,   -1,   -2,   22,  -78,  200, -460, 1578, 2972, -148,  -10,   49,  -41,   22,   -8,    1 },
+   {    0,   -1,   -3,   24,  -81,  202, -449, 1461, 3035,  -88,  -37,   62,  -46,   24,   -8,    1 },
+   {    0,    0,   -5,   26,  -83,  201, -435, 1344, 3093,  -22,  -65,   75,  -51,   25,   -8,    1 },
+   {    0,    0,   -5,   28,  -85,  199, -418, 1229, 3142,   49,  -94,   88,  -56,   27,   -9,    1 },
+   {    0,    0,   -6,   30,  -86,  196, -399, 1114, 3186,  126, -124,  100,  -61,   28,   -9,    1 },
+   {    0,    0,   -7,   31,  -86,  191, -377, 1001, 3222,  207, -154,  113,  -66,   29,   -9,    1 },
+   {    0,    1,   -8,   31,  -86,  184, -353,  891, 3251,  292, -184,  125,  -70,   30,   -9,    1 },
+   {    0,    1,   -8,   32,  -85,  177, -328,  782, 3270,  383, -214,  137,  -74,   31,   -9,    1 },
+   {    0,    1,   -9,   32,  -83,  168, -301,  677, 3283,  477, -244,  148,  -77,   32,   -9,    1 },
+   {    0,    1,   -9,   32,  -80,  159, -273,  575, 3286,  575, -273,  159,  -80,   32,   -9,    1 },
+   {    0,    1,   -9,   32,  -77,  148, -244,  477, 3283,  677, -301,  168,  -83,   32,   -9,    1 },
+   {    0,    1,   -9,   31,  -74,  137, -214,  383, 3270,  782, -328,  177,  -85,   32,   -8,    1 },
+   {    0,    1,   -9,   30,  -70,  125, -184,  292, 3251,  891, -353,  184,  -86,   31,   -8,    1 },
+   {    0,    1,   -9,   29,  -66,  113, -154,  207, 3222, 1001, -377,  191,  -86,   31,   -7,    0 },
+   {    0,    1,   -9,   28,  -61,  100, -124,  126, 3186, 1114, -399,  196,  -86,   30,   -6,    0 },
+   {    0,    1,   -9,   27,  -56,   88,  -94,   49, 3142, 1229, -418,  199,  -85,   28,   -5,    0 },
+   {    0,    1,   -8,   25,  -51,   75,  -65,  -22, 3093, 1344, -435,  201,  -83,   26,   -5,    0 },
+   {    0,    1,   -8,   24,  -46,   62,  -37,  -88, 3035, 1461, -449,  202,  -81,   24,   -3,   -1 },
+   {    0,    1,   -8,   22,  -41,   49,  -10, -148, 2972, 1578, -460,  200,  -78,   22,   -2,   -1 },
+   {    0,    1,   -7,   20,  -35,   36,   16, -204, 2902, 1694, -467,  197,  -73,   19,   -1,   -2 },
+   {    0,    1,   -7,   18,  -30,   24,   40, -254, 2826, 1810, -470,  192,  -68,   16,    0,   -2 },
+   {    0,    1,   -6,   16,  -25,   12,   64, -298, 2742, 1925, -470,  186,  -63,   12,    2,   -2 },
+   {    0,    1,   -6,   14,  -19,    0,   85, -337, 2655, 2038, -465,  177,  -56,    9,    3,   -3 },
+   {    0,    1,   -5,   12,  -14,  -11,  105, -371, 2561, 2149, -456,  166,  -48,    5,    5,   -3 },
+   {    0,    1,   -5,   11,   -9,  -21,  123, -400, 2464, 2257, -442,  154,  -40,    0,    7,   -4 }
+};
+
 
 /*
 ** Simple queue routines
 */
 #define  APU_QEMPTY()   (apu->q_head == apu->q_tail)
 
-static int apu_enqueue(apudata_t *d)
+/* move the queued writes into a ring of size entries */
+static int apu_growqueue(apu_t *apu, int size)
 {
-   ASSERT(apu);
-   apu->queue[apu->q_head] = *d;
+   apudata_t *queue;
+   int i, queued;
 
-   apu->q_head = (apu->q_head + 1) & APUQUEUE_MASK;
+   if (size > APUQUEUE_MAX)
+      return -1;
 
-   if (APU_QEMPTY()) {
-      log_printf("apu: queue overflow\n");      
-      SET_APU_ERROR(apu,"queue overflow");
+   queue = malloc(size * sizeof(apudata_t));
+   if (NULL == queue)
       return -1;
+
+   queued = 0;
+   if (apu->queue)
+   {
+      queued = (apu->q_head - apu->q_tail) & APUQUEUE_MASK(apu);
+      for (i = 0; i < queued; i++)
+         queue[i] = apu->queue[(apu->q_tail + i) & APUQUEUE_MASK(apu)];
+      free(apu->queue);
+   }
+
+   apu->queue = queue;
+   apu->q_size = size;
+   apu->q_tail = 0;
+   apu->q_head = queued;
+   return 0;
+}
+
+static int apu_enqueue(apu_t *apu, apudata_t *d)
+{
+   ASSERT(apu);
+
+   /* keep a slot free, so a full ring doesn't look empty */
+   if (NULL == apu->queue
+       || ((apu->q_head + 1) & APUQUEUE_MASK(apu)) == apu->q_tail)
+   {
+      if (apu_growqueue(apu, apu->queue ? apu->q_size * 2 : APUQUEUE_MIN))
+      {
+         log_printf("apu: queue overflow\n");
+         SET_APU_ERROR(apu,"queue overflow");
+         return -1;
+      }
    }
+
+   apu->queue[apu->q_head] = *d;
+   apu->q_head = (apu->q_head + 1) & APUQUEUE_MASK(apu);
    return 0;
 }
 
-static apudata_t *apu_dequeue(void)
+static apudata_t *apu_dequeue(apu_t *apu)
 {
    int loc;
 
@@ -147,12 +208,12 @@ static apudata_t *apu_dequeue(void)
      /* $$$ ben : should return 0 ??? */
    }
    loc = apu->q_tail;
-   apu->q_tail = (apu->q_tail + 1) & APUQUEUE_MASK;
+   apu->q_tail = (apu->q_tail + 1) & APUQUEUE_MASK(apu);
 
    return &apu->queue[loc];
 }
 
-int apu_setchan(int chan, boolean enabled)
+int apu_setchan(apu_t *apu, int chan, boolean enabled)
 {
   const unsigned int max = 6;
   int old;
@@ -174,22 +235,21 @@ int apu_setchan(int chan, boolean enabled)
 ** for the white noise channel
 */
 #ifdef REALTIME_NOISE
-INLINE int8 shift_register15(uint8 xor_tap)
+INLINE int8 shift_register15(noise_t *chan)
 {
-   static int sreg = 0x4000;
    int bit0, tap, bit14;
 
-   bit0 = sreg & 1;
-   tap = (sreg & xor_tap) ? 1 : 0;
+   bit0 = chan->sreg & 1;
+   tap = (chan->sreg & chan->xor_tap) ? 1 : 0;
    bit14 = (bit0 ^ tap);
-   sreg >>= 1;
-   sreg |= (bit14 << 14);
+   chan->sreg >>= 1;
+   chan->sreg |= (bit14 << 14);
    return (bit0 ^ 1);
 }
 #else
-static void shift_register15(int8 *buf, int count)
+static void shift_register15(noise_t *chan, int8 *buf, int count)
 {
-   static int sreg = 0x4000;
+   int sreg = chan->sreg;
    int bit0, bit1, bit6, bit14;
 
    if (count == APU_NOISE_93)
@@ -216,6 +276,8 @@ static void shift_register15(int8 *buf, int count)
          *buf++ = bit0 ^ 1;
       }
    }
+
+   chan->sreg = sreg;
 }
 #endif
 
@@ -226,20 +288,11 @@ static void shift_register15(int8 *buf, int count)
 ** reg2: 8 bits of freq
 ** reg3: 0-2=high freq, 7-4=vbl length counter
 */
-#define  APU_RECTANGLE_OUTPUT chan->output_vol
-static int32 apu_rectangle(rectangle_t *chan)
+/* length counter, envelope and sweep: FALSE if the channel is silent */
+INLINE boolean apu_rectangle_clock(rectangle_t *chan)
 {
-   int32 output;
-
-#ifdef APU_OVERSAMPLE
-   int num_times;
-   int32 total;
-#endif
-
-   APU_VOLUME_DECAY(chan->output_vol);
-
    if (FALSE == chan->enabled || 0 == chan->vbl_length)
-      return APU_RECTANGLE_OUTPUT;
+      return FALSE;
 
    /* vbl length counter */
    if (FALSE == chan->holdnote)
@@ -259,7 +312,7 @@ static int32 apu_rectangle(rectangle_t *chan)
 
    if ((FALSE == chan->sweep_inc && chan->freq > chan->freq_limit)
        || chan->freq < APU_TO_FIXED(4))
-      return APU_RECTANGLE_OUTPUT;
+      return FALSE;
 
    /* frequency sweeping at a rate of (sweep_delay + 1) / 120 secs */
    if (chan->sweep_on && chan->sweep_shifts)
@@ -275,6 +328,24 @@ static int32 apu_rectangle(rectangle_t *chan)
       }
    }
 
+   return TRUE;
+}
+
+#define  APU_RECTANGLE_OUTPUT chan->output_vol
+INLINE int32 apu_rectangle(apu_t *apu, rectangle_t *chan)
+{
+   int32 output;
+
+#ifdef APU_OVERSAMPLE
+   int num_times;
+   int32 total;
+#endif
+
+   APU_VOLUME_DECAY(chan->output_vol);
+
+   if (FALSE == apu_rectangle_clock(chan))
+      return APU_RECTANGLE_OUTPUT;
+
    chan->phaseacc -= apu->cycle_rate; /* # of cycles per sample */
    if (chan->phaseacc >= 0)
       return APU_RECTANGLE_OUTPUT;
@@ -326,13 +397,11 @@ static int32 apu_rectangle(rectangle_t *chan)
 ** reg2: low 8 bits of frequency
 ** reg3: 7-3=length counter, 2-0=high 3 bits of frequency
 */
-#define  APU_TRIANGLE_OUTPUT  (chan->output_vol + (chan->output_vol >> 2))
-static int32 apu_triangle(triangle_t *chan)
+/* length and linear counters: FALSE if the channel is silent */
+INLINE boolean apu_triangle_clock(triangle_t *chan)
 {
-   APU_VOLUME_DECAY(chan->output_vol);
-
    if (FALSE == chan->enabled || 0 == chan->vbl_length)
-      return APU_TRIANGLE_OUTPUT;
+      return FALSE;
 
    if (chan->counter_started)
    {
@@ -356,6 +425,17 @@ static int32 apu_triangle(triangle_t *chan)
    }
 */
    if (0 == chan->linear_length || chan->freq < APU_TO_FIXED(4)) /* inaudible */
+      return FALSE;
+
+   return TRUE;
+}
+
+#define  APU_TRIANGLE_OUTPUT  (chan->output_vol + (chan->output_vol >> 2))
+INLINE int32 apu_triangle(apu_t *apu, triangle_t *chan)
+{
+   APU_VOLUME_DECAY(chan->output_vol);
+
+   if (FALSE == apu_triangle_clock(chan))
       return APU_TRIANGLE_OUTPUT;
 
    chan->phaseacc -= apu->cycle_rate; /* # of cycles per sample */
@@ -380,25 +460,11 @@ static int32 apu_triangle(triangle_t *chan)
 ** reg2: 7=small(93 byte) sample,3-0=freq lookup
 ** reg3: 7-4=vbl length counter
 */
-#define  APU_NOISE_OUTPUT  ((chan->output_vol + chan->output_vol + chan->output_vol) >> 2)
-
-static int32 apu_noise(noise_t *chan)
+/* length counter and envelope: FALSE if the channel is silent */
+INLINE boolean apu_noise_clock(noise_t *chan)
 {
-   int32 outvol;
-
-#if defined(APU_OVERSAMPLE) && defined(REALTIME_NOISE)
-#else
-   int32 noise_bit;
-#endif
-#ifdef APU_OVERSAMPLE
-   int num_times;
-   int32 total;
-#endif
-
-   APU_VOLUME_DECAY(chan->output_vol);
-
    if (FALSE == chan->enabled || 0 == chan->vbl_length)
-      return APU_NOISE_OUTPUT;
+      return FALSE;
 
    /* vbl length counter */
    if (FALSE == chan->holdnote)
@@ -416,6 +482,29 @@ static int32 apu_noise(noise_t *chan)
          chan->env_vol++;
    }
 
+   return TRUE;
+}
+
+#define  APU_NOISE_OUTPUT  ((chan->output_vol + chan->output_vol + chan->output_vol) >> 2)
+
+INLINE int32 apu_noise(apu_t *apu, noise_t *chan)
+{
+   int32 outvol;
+
+#if defined(APU_OVERSAMPLE) && defined(REALTIME_NOISE)
+#else
+   int32 noise_bit;
+#endif
+#ifdef APU_OVERSAMPLE
+   int num_times;
+   int32 total;
+#endif
+
+   APU_VOLUME_DECAY(chan->output_vol);
+
+   if (FALSE == apu_noise_clock(chan))
+      return APU_NOISE_OUTPUT;
+
    chan->phaseacc -= apu->cycle_rate; /* # of cycles per sample */
    if (chan->phaseacc >= 0)
       return APU_NOISE_OUTPUT;
@@ -436,14 +525,14 @@ static int32 apu_noise(noise_t *chan)
 #ifdef REALTIME_NOISE
 
 #ifdef APU_OVERSAMPLE
-      if (shift_register15(chan->xor_tap))
+      if (shift_register15(chan))
          total += outvol;
       else
          total -= outvol;
 
       num_times++;
 #else
-      noise_bit = shift_register15(chan->xor_tap);
+      noise_bit = shift_register15(chan);
 #endif
 
 #else
@@ -462,9 +551,9 @@ static int32 apu_noise(noise_t *chan)
 
 #ifdef APU_OVERSAMPLE
       if (chan->short_sample)
-         noise_bit = noise_short_lut[chan->cur_pos];
+         noise_bit = chan->short_lut[chan->cur_pos];
       else
-         noise_bit = noise_long_lut[chan->cur_pos];
+         noise_bit = chan->long_lut[chan->cur_pos];
 
       if (noise_bit)
          total += outvol;
@@ -486,9 +575,9 @@ static int32 apu_noise(noise_t *chan)
 
 #ifndef REALTIME_NOISE
    if (chan->short_sample)
-      noise_bit = noise_short_lut[chan->cur_pos];
+      noise_bit = chan->short_lut[chan->cur_pos];
    else
-      noise_bit = noise_long_lut[chan->cur_pos];
+      noise_bit = chan->long_lut[chan->cur_pos];
 #endif /* !REALTIME_NOISE */
 
    if (noise_bit)
@@ -515,11 +604,86 @@ INLINE void apu_dmcreload(dmc_t *chan)
 ** reg2: 8 bits of 64-byte aligned address offset : $C000 + (value * 64)
 ** reg3: length, (value * 16) + 1
 */
-#define  APU_DMC_OUTPUT ((chan->output_vol + chan->output_vol + chan->output_vol) >> 2)
-static int32 apu_dmc(dmc_t *chan)
+/* one output clock of the DMC: FALSE once the sample has run out */
+INLINE boolean apu_dmc_clock(apu_t *apu, dmc_t *chan)
 {
    int delta_bit;
 
+   delta_bit = (chan->dma_length & 7) ^ 7;
+
+   if (7 == delta_bit)
+   {
+      chan->cur_byte = nes6502_getbyte(apu->cpu, chan->address);
+
+      /* steal a cycle from CPU*/
+      nes6502_setdma(apu->cpu, 1);
+
+      if (0xFFFF == chan->address)
+         chan->address = 0x8000;
+      else
+         chan->address++;
+   }
+
+   if (--chan->dma_length == 0)
+   {
+      /* if loop bit set, we're cool to retrigger sample */
+      if (chan->looping)
+         apu_dmcreload(chan);
+      else
+      {
+         /* check to see if we should generate an irq */
+         if (chan->irq_gen)
+         {
+            chan->irq_occurred = TRUE;
+            nes6502_irq(apu->cpu);
+         }
+
+         /* bodge for timestamp queue */
+         chan->enabled = FALSE;
+         return FALSE;
+      }
+   }
+
+   /* positive delta */
+   if (chan->cur_byte & (1 << delta_bit))
+   {
+      if (chan->regs[1] < 0x7D)
+      {
+         chan->regs[1] += 2;
+         chan->output_vol += (2 << 8);
+      }
+/*
+      if (chan->regs[1] < 0x3F)
+         chan->regs[1]++;
+
+      chan->output_vol &= ~(0x7E << 8);
+      chan->output_vol |= ((chan->regs[1] << 1) << 8);
+*/
+   }
+   /* negative delta */
+   else            
+   {
+      if (chan->regs[1] > 1)
+      {
+         chan->regs[1] -= 2;
+         chan->output_vol -= (2 << 8);
+      }
+
+/*
+      if (chan->regs[1] > 0)
+         chan->regs[1]--;
+
+      chan->output_vol &= ~(0x7E << 8);
+      chan->output_vol |= ((chan->regs[1] << 1) << 8);
+*/
+   }
+
+   return TRUE;
+}
+
+#define  APU_DMC_OUTPUT ((chan->output_vol + chan->output_vol + chan->output_vol) >> 2)
+INLINE int32 apu_dmc(apu_t *apu, dmc_t *chan)
+{
    APU_VOLUME_DECAY(chan->output_vol);
 
    /* only process when channel is alive */
@@ -530,83 +694,498 @@ static int32 apu_dmc(dmc_t *chan)
       while (chan->phaseacc < 0)
       {
          chan->phaseacc += chan->freq;
-         
-         delta_bit = (chan->dma_length & 7) ^ 7;
-         
-         if (7 == delta_bit)
-         {
-            chan->cur_byte = nes6502_getbyte(chan->address);
-            
-            /* steal a cycle from CPU*/
-            nes6502_setdma(1);
 
-            if (0xFFFF == chan->address)
-               chan->address = 0x8000;
-            else
-               chan->address++;
-         }
+         if (FALSE == apu_dmc_clock(apu, chan))
+            break;
+      }
+   }
 
-         if (--chan->dma_length == 0)
-         {
-            /* if loop bit set, we're cool to retrigger sample */
-            if (chan->looping)
-               apu_dmcreload(chan);
-            else
-            {
-               /* check to see if we should generate an irq */
-               if (chan->irq_gen)
-               {
-                  chan->irq_occurred = TRUE;
-                  nes6502_irq();
-               }
-
-               /* bodge for timestamp queue */
-               chan->enabled = FALSE;
-               break;
-            }
-         }
+   return APU_DMC_OUTPUT;
+}
 
-         /* positive delta */
-         if (chan->cur_byte & (1 << delta_bit))
-         {
-            if (chan->regs[1] < 0x7D)
-            {
-               chan->regs[1] += 2;
-               chan->output_vol += (2 << 8);
-            }
-/*
-            if (chan->regs[1] < 0x3F)
-               chan->regs[1]++;
 
-            chan->output_vol &= ~(0x7E << 8);
-            chan->output_vol |= ((chan->regs[1] << 1) << 8);
+/* Block renderers: run one channel for count samples, adding into mix.
+** The channel is worked on as a local copy so that its state can sit in
+** registers for the whole run instead of going back to memory (where it
+** might alias mix) every sample.
 */
-         }
-         /* negative delta */
-         else            
-         {
-            if (chan->regs[1] > 1)
-            {
-               chan->regs[1] -= 2;
-               chan->output_vol -= (2 << 8);
-            }
+static void apu_rectangle_block(apu_t *apu, rectangle_t *chan, int32 *mix,
+                                int count)
+{
+   rectangle_t rect = *chan;
+   int i;
 
-/*
-            if (chan->regs[1] > 0)
-               chan->regs[1]--;
+   for (i = 0; i < count; i++)
+      mix[i] += apu_rectangle(apu, &rect);
+
+   *chan = rect;
+}
+
+static void apu_triangle_block(apu_t *apu, triangle_t *chan, int32 *mix,
+                               int count)
+{
+   triangle_t tri = *chan;
+   int i;
+
+   for (i = 0; i < count; i++)
+      mix[i] += apu_triangle(apu, &tri);
+
+   *chan = tri;
+}
 
-            chan->output_vol &= ~(0x7E << 8);
-            chan->output_vol |= ((chan->regs[1] << 1) << 8);
+static void apu_noise_block(apu_t *apu, noise_t *chan, int32 *mix,
+                            int count)
+{
+#ifdef REALTIME_NOISE
+   noise_t noise = *chan;
+   int i;
+
+   for (i = 0; i < count; i++)
+      mix[i] += apu_noise(apu, &noise);
+
+   *chan = noise;
+#else
+   /* too big to copy around with its sample tables */
+   int i;
+
+   for (i = 0; i < count; i++)
+      mix[i] += apu_noise(apu, chan);
+#endif /* !REALTIME_NOISE */
+}
+
+static void apu_dmc_block(apu_t *apu, dmc_t *chan, int32 *mix, int count)
+{
+   dmc_t dmc = *chan;
+   int i;
+
+   for (i = 0; i < count; i++)
+      mix[i] += apu_dmc(apu, &dmc);
+
+   *chan = dmc;
+}
+
+/* BAND-LIMITED SYNTHESIS
+** ======================
+** Rather than sampling each channel once per output sample, every change
+** of a channel's output level is recorded as a delta at the cycle it
+** happens on.  Each delta is laid down as a band-limited step, so edges
+** put nothing above the output Nyquist rate, and a block's worth of them
+** is integrated back into a waveform at once.  The cost goes with the
+** number of transitions instead of an oversampling rate.  Length
+** counters, envelopes and sweeps are clocked just as in point mode.
 */
-         }
+
+/* lay a step of delta into out, offset (16.16 cycles) into its first sample */
+INLINE void apu_blep_lay(int32 *out, int32 offset, int32 blep_rate, int32 delta)
+{
+   const int16 *kernel;
+   int i;
+
+   kernel = blep_kernel[((offset >> 8) * blep_rate) >> 24];
+   for (i = 0; i < APU_BLEP_WIDTH; i++)
+      out[i] += delta * kernel[i];
+}
+
+/* move a channel to level amp, offset (16.16 cycles) into sample pos */
+INLINE void apu_blep_step(apu_t *apu, int32 *level, int pos, int32 offset,
+                          int32 amp)
+{
+   int32 delta;
+
+   delta = amp - *level;
+   if (0 == delta)
+      return;
+
+   *level = amp;
+
+   apu_blep_lay(apu->blep_buf + pos, offset, apu->blep_rate, delta);
+}
+
+/* the same for external chips with step buffers of their own */
+void apu_blep_add(int32 *buf, int pos, int32 offset, int32 blep_rate,
+                  int32 delta)
+{
+   apu_blep_lay(buf + pos, offset, blep_rate, delta);
+}
+
+/* integrate count samples of steps from buf into mix, running sum in sum */
+void apu_blep_mix(int32 *buf, int32 *sum, int32 *mix, int count)
+{
+   int32 acc;
+   int i;
+
+   acc = *sum;
+   for (i = 0; i < count; i++)
+   {
+      acc += buf[i];
+      mix[i] += acc >> APU_BLEP_BITS;
+
+      /* same slow pull back to zero as APU_VOLUME_DECAY */
+      acc -= acc >> 7;
+   }
+   *sum = acc;
+
+   /* keep the tails of steps that run on past this block */
+   memmove(buf, buf + count, APU_BLEP_WIDTH * sizeof(int32));
+   memset(buf + APU_BLEP_WIDTH, 0, count * sizeof(int32));
+}
+
+static void apu_rectangle_blep(apu_t *apu, rectangle_t *chan, int32 *level,
+                               int count)
+{
+   rectangle_t rect = *chan;
+   int32 lvl = *level;
+   int32 vol, offset;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      if (FALSE == apu_rectangle_clock(&rect))
+      {
+         apu_blep_step(apu, &lvl, i, 0, 0);
+         continue;
+      }
+
+      if (rect.fixed_envelope)
+         vol = rect.volume << 8; /* fixed volume */
+      else
+         vol = (rect.env_vol ^ 0x0F) << 8;
+
+      /* pick up any volume change */
+      apu_blep_step(apu, &lvl, i, 0, (rect.adder < rect.duty_flip) ? vol : -vol);
+
+      rect.phaseacc -= apu->cycle_rate; /* # of cycles per sample */
+      while (rect.phaseacc < 0)
+      {
+         offset = apu->cycle_rate + rect.phaseacc;
+         rect.phaseacc += rect.freq;
+         rect.adder = (rect.adder + 1) & 0x0F;
+
+         apu_blep_step(apu, &lvl, i, offset, (rect.adder < rect.duty_flip) ? vol : -vol);
       }
    }
 
-   return APU_DMC_OUTPUT;
+   *chan = rect;
+   *level = lvl;
 }
 
+/* 15..0, 0..15 staircase, centered and scaled like the point triangle */
+#define  APU_TRIANGLE_LEVEL(adder) \
+   ((((((adder) & 0x10) ? (adder) : ~(adder)) & 0x0F) * 2 - 15) * 320)
+
+static void apu_triangle_blep(apu_t *apu, triangle_t *chan, int32 *level,
+                              int count)
+{
+   triangle_t tri = *chan;
+   int32 lvl = *level;
+   int32 offset;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      /* a halted triangle holds where it is */
+      if (FALSE == apu_triangle_clock(&tri))
+         continue;
+
+      tri.phaseacc -= apu->cycle_rate; /* # of cycles per sample */
+      while (tri.phaseacc < 0)
+      {
+         offset = apu->cycle_rate + tri.phaseacc;
+         tri.phaseacc += tri.freq;
+         tri.adder = (tri.adder + 1) & 0x1F;
+
+         apu_blep_step(apu, &lvl, i, offset, APU_TRIANGLE_LEVEL(tri.adder));
+      }
+   }
 
-static void apu_regwrite(uint32 address, uint8 value)
+   *chan = tri;
+   *level = lvl;
+}
+
+/* next bit out of the noise generator */
+INLINE int apu_noise_bit(noise_t *chan)
+{
+#ifdef REALTIME_NOISE
+   return shift_register15(chan);
+#else
+   chan->cur_pos++;
+
+   if (chan->short_sample)
+   {
+      if (APU_NOISE_93 == chan->cur_pos)
+         chan->cur_pos = 0;
+      return chan->short_lut[chan->cur_pos];
+   }
+
+   if (APU_NOISE_32K == chan->cur_pos)
+      chan->cur_pos = 0;
+   return chan->long_lut[chan->cur_pos];
+#endif /* !REALTIME_NOISE */
+}
+
+static void apu_noise_blep(apu_t *apu, noise_t *chan, int32 *level,
+                           int count)
+{
+#ifdef REALTIME_NOISE
+   noise_t copy = *chan;
+   noise_t *noise = &copy;
+#else
+   /* too big to copy around with its sample tables */
+   noise_t *noise = chan;
+#endif /* !REALTIME_NOISE */
+   int32 lvl = *level;
+   int32 vol, offset;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      if (FALSE == apu_noise_clock(noise))
+      {
+         apu_blep_step(apu, &lvl, i, 0, 0);
+         continue;
+      }
+
+      if (noise->fixed_envelope)
+         vol = noise->volume << 8; /* fixed volume */
+      else
+         vol = (noise->env_vol ^ 0x0F) << 8;
+      vol = (vol + vol + vol) >> 2;
+
+      /* pick up any volume change */
+      apu_blep_step(apu, &lvl, i, 0, (lvl < 0) ? -vol : vol);
+
+      noise->phaseacc -= apu->cycle_rate; /* # of cycles per sample */
+      while (noise->phaseacc < 0)
+      {
+         offset = apu->cycle_rate + noise->phaseacc;
+         noise->phaseacc += noise->freq;
+
+         apu_blep_step(apu, &lvl, i, offset, apu_noise_bit(noise) ? vol : -vol);
+      }
+   }
+
+#ifdef REALTIME_NOISE
+   *chan = copy;
+#endif /* REALTIME_NOISE */
+   *level = lvl;
+}
+
+/* DAC level, centered and scaled like the point DMC */
+#define  APU_DMC_LEVEL(dac)  (((dac) - 0x40) * 0xC0)
+
+static void apu_dmc_blep(apu_t *apu, dmc_t *chan, int32 *level, int count)
+{
+   dmc_t dmc = *chan;
+   int32 lvl = *level;
+   int32 offset;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      /* pick up any direct DAC write */
+      apu_blep_step(apu, &lvl, i, 0, APU_DMC_LEVEL(dmc.regs[1]));
+
+      /* only process when channel is alive */
+      if (0 == dmc.dma_length)
+         continue;
+
+      dmc.phaseacc -= apu->cycle_rate; /* # of cycles per sample */
+      while (dmc.phaseacc < 0)
+      {
+         offset = apu->cycle_rate + dmc.phaseacc;
+         dmc.phaseacc += dmc.freq;
+
+         if (FALSE == apu_dmc_clock(apu, &dmc))
+            break;
+
+         apu_blep_step(apu, &lvl, i, offset, APU_DMC_LEVEL(dmc.regs[1]));
+      }
+   }
+
+   *chan = dmc;
+   *level = lvl;
+}
+
+/* lay down steps for the 2A03 channels, then integrate them into mix */
+static void apu_blep_process(apu_t *apu, int32 *mix, int count)
+{
+   /* a channel switched out of the mix steps to silence */
+   if (APU_MIX_ENABLE(0))
+      apu_rectangle_blep(apu, &apu->rectangle[0], &apu->blep_level[0], count);
+   else
+      apu_blep_step(apu, &apu->blep_level[0], 0, 0, 0);
+
+   if (APU_MIX_ENABLE(1))
+      apu_rectangle_blep(apu, &apu->rectangle[1], &apu->blep_level[1], count);
+   else
+      apu_blep_step(apu, &apu->blep_level[1], 0, 0, 0);
+
+   if (APU_MIX_ENABLE(2))
+      apu_triangle_blep(apu, &apu->triangle, &apu->blep_level[2], count);
+   else
+      apu_blep_step(apu, &apu->blep_level[2], 0, 0, 0);
+
+   if (APU_MIX_ENABLE(3))
+      apu_noise_blep(apu, &apu->noise, &apu->blep_level[3], count);
+   else
+      apu_blep_step(apu, &apu->blep_level[3], 0, 0, 0);
+
+   if (APU_MIX_ENABLE(4))
+      apu_dmc_blep(apu, &apu->dmc, &apu->blep_level[4], count);
+   else
+      apu_blep_step(apu, &apu->blep_level[4], 0, 0, 0);
+
+   apu_blep_mix(apu->blep_buf, &apu->blep_sum, mix, count);
+}
+
+/* MIXING STAGE
+** ============
+** Filters, boosts, clips and converts a block of summed channel output
+** to the output format: unsigned 8-bit, signed 16-bit, or 32-bit float
+** in [-1, 1).  The format and filter are picked once per block, and on
+** x86 the bulk of the block goes 4 (SSE2) or 8 (AVX2) samples at a time;
+** the scalar loop takes the rest, or everything on other machines.
+**
+** The filters both come out as (x * mx + prev * mp) >> shift, with prev
+** the previous unfiltered sample, read from mix[-1] for the first one.
+*/
+#if defined(__AVX2__)
+#define  APU_SIMD_LANES       8
+typedef __m256i apu_simd_t;
+#define  SIMD_LOAD(p)         _mm256_loadu_si256((const __m256i *) (p))
+#define  SIMD_SET1(x)         _mm256_set1_epi32(x)
+#define  SIMD_ADD(a, b)       _mm256_add_epi32((a), (b))
+#define  SIMD_AND(a, b)       _mm256_and_si256((a), (b))
+#define  SIMD_SRA(a, n)       _mm256_sra_epi32((a), (n))
+#define  SIMD_SLL1(a)         _mm256_slli_epi32((a), 1)
+/* saturate to 8 int16s in the bottom of a 128-bit register */
+#define  SIMD_PACK16(a)       _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packs_epi32((a), (a)), 0x08))
+#define  SIMD_STORE16(p, w)   _mm_storeu_si128((__m128i *) (p), (w))
+#define  SIMD_STORE8(p, b)    _mm_storel_epi64((__m128i *) (p), (b))
+#define  SIMD_STOREF(p, w)    _mm256_storeu_ps((p), _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(w)), _mm256_set1_ps(1.0f / 32768.0f)))
+#elif defined(__SSE2__)
+#define  APU_SIMD_LANES       4
+typedef __m128i apu_simd_t;
+#define  SIMD_LOAD(p)         _mm_loadu_si128((const __m128i *) (p))
+#define  SIMD_SET1(x)         _mm_set1_epi32(x)
+#define  SIMD_ADD(a, b)       _mm_add_epi32((a), (b))
+#define  SIMD_AND(a, b)       _mm_and_si128((a), (b))
+#define  SIMD_SRA(a, n)       _mm_sra_epi32((a), (n))
+#define  SIMD_SLL1(a)         _mm_slli_epi32((a), 1)
+/* saturate to 4 int16s in the bottom of a 128-bit register */
+#define  SIMD_PACK16(a)       _mm_packs_epi32((a), (a))
+#define  SIMD_STORE16(p, w)   _mm_storel_epi64((__m128i *) (p), (w))
+#define  SIMD_STORE8(p, b)    do { int32 _b = _mm_cvtsi128_si32(b); memcpy((p), &_b, 4); } while (0)
+#define  SIMD_STOREF(p, w)    _mm_storeu_ps((p), _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16((w), (w)), 16)), _mm_set1_ps(1.0f / 32768.0f)))
+#endif
+
+/* one filtered, boosted and clipped sample */
+INLINE int32 apu_mix_sample(const int32 *mix, int32 mx3, int32 mp, int shift)
+{
+   int32 accum;
+
+   accum = mix[0] + ((mix[0] + mix[0]) & mx3) + (mix[-1] & mp);
+   accum >>= shift;
+
+   /* little extra kick for the kids */
+   accum <<= 1;
+
+   /* prevent clipping */
+   if (accum > 0x7FFF)
+      accum = 0x7FFF;
+   else if (accum < -0x8000)
+      accum = -0x8000;
+
+   return accum;
+}
+
+static void *apu_output(apu_t *apu, int32 *mix, int count, void *buffer)
+{
+   int32 mx3, mp;
+   int shift, i = 0;
+#ifdef APU_SIMD_LANES
+   apu_simd_t x, v_mx3, v_mp;
+   __m128i v_shift, w;
+#endif
+
+   switch (apu->filter_type)
+   {
+   case APU_FILTER_LOWPASS:   /* (x + prev) >> 1 */
+      mx3 = 0; mp = -1; shift = 1;
+      break;
+   case APU_FILTER_WEIGHTED:  /* (3x + prev) >> 2 */
+      mx3 = -1; mp = -1; shift = 2;
+      break;
+   default:
+      mx3 = 0; mp = 0; shift = 0;
+      break;
+   }
+
+   mix[-1] = apu->prev_sample;
+   apu->prev_sample = mix[count - 1];
+
+#ifdef APU_SIMD_LANES
+   v_mx3 = SIMD_SET1(mx3);
+   v_mp = SIMD_SET1(mp);
+   v_shift = _mm_cvtsi32_si128(shift);
+
+#define  SIMD_MIX(i) \
+   x = SIMD_LOAD(mix + (i)); \
+   x = SIMD_ADD(x, SIMD_AND(SIMD_ADD(x, x), v_mx3)); \
+   x = SIMD_ADD(x, SIMD_AND(SIMD_LOAD(mix + (i) - 1), v_mp)); \
+   w = SIMD_PACK16(SIMD_SLL1(SIMD_SRA(x, v_shift)))
+
+   if (16 == apu->sample_bits)
+   {
+      for (; i + APU_SIMD_LANES <= count; i += APU_SIMD_LANES)
+      {
+         SIMD_MIX(i);
+         SIMD_STORE16((int16 *) buffer + i, w);
+      }
+   }
+   else if (32 == apu->sample_bits)
+   {
+      for (; i + APU_SIMD_LANES <= count; i += APU_SIMD_LANES)
+      {
+         SIMD_MIX(i);
+         SIMD_STOREF((float *) buffer + i, w);
+      }
+   }
+   else
+   {
+      for (; i + APU_SIMD_LANES <= count; i += APU_SIMD_LANES)
+      {
+         SIMD_MIX(i);
+         w = _mm_srai_epi16(w, 8);
+         w = _mm_xor_si128(_mm_packs_epi16(w, w), _mm_set1_epi8((char) 0x80));
+         SIMD_STORE8((uint8 *) buffer + i, w);
+      }
+   }
+#undef SIMD_MIX
+#endif /* APU_SIMD_LANES */
+
+   /* signed 16-bit output, float, unsigned 8-bit */
+   if (16 == apu->sample_bits)
+   {
+      for (; i < count; i++)
+         ((int16 *) buffer)[i] = (int16) apu_mix_sample(mix + i, mx3, mp, shift);
+      return (int16 *) buffer + count;
+   }
+   else if (32 == apu->sample_bits)
+   {
+      for (; i < count; i++)
+         ((float *) buffer)[i] = apu_mix_sample(mix + i, mx3, mp, shift) * (1.0f / 32768.0f);
+      return (float *) buffer + count;
+   }
+   else
+   {
+      for (; i < count; i++)
+         ((uint8 *) buffer)[i] = (apu_mix_sample(mix + i, mx3, mp, shift) >> 8) ^ 0x80;
+      return (uint8 *) buffer + count;
+   }
+}
+
+static void apu_regwrite(apu_t *apu, uint32 address, uint8 value)
 {  
    int chan;
 
@@ -620,7 +1199,7 @@ static void apu_regwrite(uint32 address, uint8 value)
       apu->rectangle[chan].regs[0] = value;
 
       apu->rectangle[chan].volume = value & 0x0F;
-      apu->rectangle[chan].env_delay = decay_lut[value & 0x0F];
+      apu->rectangle[chan].env_delay = apu->decay_lut[value & 0x0F];
       apu->rectangle[chan].holdnote = (value & 0x20) ? TRUE : FALSE;
       apu->rectangle[chan].fixed_envelope = (value & 0x10) ? TRUE : FALSE;
       apu->rectangle[chan].duty_flip = duty_lut[value >> 6];
@@ -632,7 +1211,7 @@ static void apu_regwrite(uint32 address, uint8 value)
       apu->rectangle[chan].regs[1] = value;
       apu->rectangle[chan].sweep_on = (value & 0x80) ? TRUE : FALSE;
       apu->rectangle[chan].sweep_shifts = value & 7;
-      apu->rectangle[chan].sweep_delay = decay_lut[(value >> 4) & 7];
+      apu->rectangle[chan].sweep_delay = apu->decay_lut[(value >> 4) & 7];
       
       apu->rectangle[chan].sweep_inc = (value & 0x08) ? TRUE : FALSE;
       apu->rectangle[chan].freq_limit = APU_TO_FIXED(freq_limit[value & 7]);
@@ -653,7 +1232,7 @@ static void apu_regwrite(uint32 address, uint8 value)
 
 //      if (apu->rectangle[chan].enabled)
       {
-         apu->rectangle[chan].vbl_length = vbl_lut[value >> 3];
+         apu->rectangle[chan].vbl_length = apu->vbl_lut[value >> 3];
          apu->rectangle[chan].env_vol = 0;
          apu->rectangle[chan].freq = APU_TO_FIXED((((value & 7) << 8) + apu->rectangle[chan].regs[2]) + 1);
          apu->rectangle[chan].adder = 0;
@@ -668,7 +1247,7 @@ static void apu_regwrite(uint32 address, uint8 value)
       else
       {
          if (apu->triangle.countmode == COUNTMODE_LOAD && apu->triangle.vbl_length)
-            apu->triangle.linear_length = trilength_lut[value & 0x7F];
+            apu->triangle.linear_length = apu->trilength_lut[value & 0x7F];
 
          if (0 == (value & 0x80))
             apu->triangle.countmode = COUNTMODE_COUNT;
@@ -682,7 +1261,7 @@ static void apu_regwrite(uint32 address, uint8 value)
 //      if (apu->triangle.enabled)
       {
          if (FALSE == apu->triangle.counter_started && apu->triangle.vbl_length)
-            apu->triangle.linear_length = trilength_lut[value & 0x7F];
+            apu->triangle.linear_length = apu->trilength_lut[value & 0x7F];
       }
 
       break;
@@ -714,7 +1293,7 @@ static void apu_regwrite(uint32 address, uint8 value)
       /* 06/13/00 MPC -- seems to work OK */
       apu->triangle.write_latency = (int) (2 * NES_SCANLINE_CYCLES / APU_FROM_FIXED(apu->cycle_rate));
 /*
-      apu->triangle.linear_length = trilength_lut[apu->triangle.regs[0] & 0x7F];
+      apu->triangle.linear_length = apu->trilength_lut[apu->triangle.regs[0] & 0x7F];
       if (0 == (apu->triangle.regs[0] & 0x80))
          apu->triangle.countmode = COUNTMODE_COUNT;
       else
@@ -723,9 +1302,9 @@ static void apu_regwrite(uint32 address, uint8 value)
 //      if (apu->triangle.enabled)
       {
          apu->triangle.freq = APU_TO_FIXED((((value & 7) << 8) + apu->triangle.regs[1]) + 1);
-         apu->triangle.vbl_length = vbl_lut[value >> 3];
+         apu->triangle.vbl_length = apu->vbl_lut[value >> 3];
          apu->triangle.counter_started = FALSE;
-         apu->triangle.linear_length = trilength_lut[apu->triangle.regs[0] & 0x7F];
+         apu->triangle.linear_length = apu->trilength_lut[apu->triangle.regs[0] & 0x7F];
       }
 
       break;
@@ -733,7 +1312,7 @@ static void apu_regwrite(uint32 address, uint8 value)
    /* noise */
    case APU_WRD0:
       apu->noise.regs[0] = value;
-      apu->noise.env_delay = decay_lut[value & 0x0F];
+      apu->noise.env_delay = apu->decay_lut[value & 0x0F];
       apu->noise.holdnote = (value & 0x20) ? TRUE : FALSE;
       apu->noise.fixed_envelope = (value & 0x10) ? TRUE : FALSE;
       apu->noise.volume = value & 0x0F;
@@ -750,7 +1329,7 @@ static void apu_regwrite(uint32 address, uint8 value)
       if ((value & 0x80) && FALSE == apu->noise.short_sample)
       {
          /* recalculate short noise buffer */
-         shift_register15(noise_short_lut, APU_NOISE_93);
+         shift_register15(&apu->noise, apu->noise.short_lut, APU_NOISE_93);
          apu->noise.cur_pos = 0;
       }
       apu->noise.short_sample = (value & 0x80) ? TRUE : FALSE;
@@ -762,7 +1341,7 @@ static void apu_regwrite(uint32 address, uint8 value)
 
 //      if (apu->noise.enabled)
       {
-         apu->noise.vbl_length = vbl_lut[value >> 3];
+         apu->noise.vbl_length = apu->vbl_lut[value >> 3];
          apu->noise.env_vol = 0; /* reset envelope */
       }
       break;
@@ -864,8 +1443,9 @@ static void apu_regwrite(uint32 address, uint8 value)
 }
 
 /* Read from $4000-$4017 */
-uint8 apu_read(uint32 address)
+uint8 apu_read(void *userdata, uint32 address)
 {
+   apu_t *apu = (apu_t *) userdata;
    uint8 value;
 
    ASSERT(apu);
@@ -915,13 +1495,16 @@ uint8 apu_read(uint32 address)
 }
 
 
-void apu_write(uint32 address, uint8 value)
+void apu_write(void *userdata, uint32 address, uint8 value)
 {
+   apu_t *apu = (apu_t *) userdata;
 #ifndef NSF_PLAYER
    static uint8 last_write;
 #endif /* !NSF_PLAYER */
    apudata_t d;
 
+   ASSERT(apu);
+
    switch (address)
    {
    case 0x4015:
@@ -933,10 +1516,10 @@ void apu_write(uint32 address, uint8 value)
    case 0x4008: case 0x4009: case 0x400A: case 0x400B:
    case 0x400C: case 0x400D: case 0x400E: case 0x400F:
    case 0x4010: case 0x4011: case 0x4012: case 0x4013:
-      d.timestamp = nes6502_getcycles(FALSE);
+      d.timestamp = nes6502_getcycles(apu->cpu, FALSE);
       d.address = address;
       d.value = value;
-      apu_enqueue(&d);
+      apu_enqueue(apu, &d);
       break;
 
 #ifndef NSF_PLAYER
@@ -965,7 +1548,8 @@ void apu_write(uint32 address, uint8 value)
    }
 }
 
-void apu_getpcmdata(void **data, int *num_samples, int *sample_bits)
+void apu_getpcmdata(apu_t *apu, void **data, int *num_samples,
+                    int *sample_bits)
 {
    ASSERT(apu);
    *data = apu->buffer;
@@ -974,85 +1558,98 @@ void apu_getpcmdata(void **data, int *num_samples, int *sample_bits)
 }
 
 
-void apu_process(void *buffer, int num_samples)
+/* Register writes are queued with the CPU cycle they happened on; a
+** write takes effect on the first sample that starts at or after it.
+** Between writes nothing changes but the channels' own clocks, so each
+** channel is synthesized for the whole run up to the next write in its
+** own loop, and the runs are then summed and output.
+**
+** apu_render() may be called several times to play a frame in pieces;
+** apu_process() plays the last (or only) piece and then resyncs with
+** the CPU's cycle count, so rounding never builds up.
+*/
+void apu_render(apu_t *apu, void *buffer, int num_samples)
 {
    apudata_t *d;
-   uint32 elapsed_cycles;
-   static int32 prev_sample = 0;
-   int32 next_sample, accum;
+   uint32 elapsed_cycles, sample_cycles, until;
+   int32 mix_buf[APU_BLOCK_SIZE + 1], *mix = mix_buf + 1; /* mix[-1] is filter history */
+   int count, i, ext;
 
    ASSERT(apu);
 
    /* grab it, keep it local for speed */
    elapsed_cycles = (uint32) apu->elapsed_cycles;
+   sample_cycles = APU_FROM_FIXED(apu->cycle_rate);
 
    /* BLEH */
    apu->buffer = buffer; 
 
-   while (num_samples--)
+   while (num_samples > 0)
    {
       while ((FALSE == APU_QEMPTY()) && (apu->queue[apu->q_tail].timestamp <= elapsed_cycles))
       {
-         d = apu_dequeue();
-         apu_regwrite(d->address, d->value);
+         d = apu_dequeue(apu);
+         apu_regwrite(apu, d->address, d->value);
       }
 
-      elapsed_cycles += APU_FROM_FIXED(apu->cycle_rate);
-
-      accum = 0;
-      if (APU_MIX_ENABLE(0)) accum += apu_rectangle(&apu->rectangle[0]);
-      if (APU_MIX_ENABLE(1)) accum += apu_rectangle(&apu->rectangle[1]);
-      if (APU_MIX_ENABLE(2)) accum += apu_triangle(&apu->triangle);
-      if (APU_MIX_ENABLE(3)) accum += apu_noise(&apu->noise);
-      if (APU_MIX_ENABLE(4)) accum += apu_dmc(&apu->dmc);
+      /* run up to the sample the next write lands on */
+      count = (num_samples < APU_BLOCK_SIZE) ? num_samples : APU_BLOCK_SIZE;
+      if (FALSE == APU_QEMPTY() && sample_cycles)
+      {
+         until = apu->queue[apu->q_tail].timestamp - elapsed_cycles;
+         until = (until + sample_cycles - 1) / sample_cycles;
+         if (until < (uint32) count)
+            count = until;
+      }
 
-      if (apu->ext && APU_MIX_ENABLE(5)) accum += apu->ext->process();
+      elapsed_cycles += count * sample_cycles;
+      num_samples -= count;
 
-      /* do any filtering */
-      if (APU_FILTER_NONE != apu->filter_type)
+      memset(mix, 0, count * sizeof(int32));
+      if (APU_SYNTH_BLEP == apu->synth_type)
+      {
+         apu_blep_process(apu, mix, count);
+      }
+      else
       {
-         next_sample = accum;
+         if (APU_MIX_ENABLE(0)) apu_rectangle_block(apu, &apu->rectangle[0], mix, count);
+         if (APU_MIX_ENABLE(1)) apu_rectangle_block(apu, &apu->rectangle[1], mix, count);
+         if (APU_MIX_ENABLE(2)) apu_triangle_block(apu, &apu->triangle, mix, count);
+         if (APU_MIX_ENABLE(3)) apu_noise_block(apu, &apu->noise, mix, count);
+         if (APU_MIX_ENABLE(4)) apu_dmc_block(apu, &apu->dmc, mix, count);
+      }
 
-         if (APU_FILTER_LOWPASS == apu->filter_type)
+      if (APU_MIX_ENABLE(5))
+      {
+         for (ext = 0; ext < apu->num_ext; ext++)
          {
-            accum += prev_sample;
-            accum >>= 1;
+            if (apu->ext[ext]->process_block)
+               apu->ext[ext]->process_block(apu->ext_data[ext], mix, count);
+            else
+               for (i = 0; i < count; i++)
+                  mix[i] += apu->ext[ext]->process(apu->ext_data[ext]);
          }
-         else
-            accum = (accum + accum + accum + prev_sample) >> 2;
-
-         prev_sample = next_sample;
       }
 
-      /* little extra kick for the kids */
-      accum <<= 1;
+      buffer = apu_output(apu, mix, count, buffer);
+   }
 
-      /* prevent clipping */
-      if (accum > 0x7FFF)
-         accum = 0x7FFF;
-      else if (accum < -0x8000)
-         accum = -0x8000;
+   apu->elapsed_cycles = elapsed_cycles;
+}
 
-      /* signed 16-bit output, unsigned 8-bit */
-      if (16 == apu->sample_bits) {
-         *(int16 *)(buffer) = (int16) accum;
-         buffer += sizeof(int16);
-      }
-      else {
-         *(uint8 *)(buffer) = (accum >> 8) ^ 0x80;
-         buffer += sizeof(uint8);
-      }
-   }
+void apu_process(apu_t *apu, void *buffer, int num_samples)
+{
+   apu_render(apu, buffer, num_samples);
 
    /* resync cycle counter */
-   apu->elapsed_cycles = nes6502_getcycles(FALSE);
+   apu->elapsed_cycles = nes6502_getcycles(apu->cpu, FALSE);
 }
 
 /* set the filter type */
 /* $$$ ben :
  * Add a get feature (filter_type == -1) and returns old filter type
  */
-int apu_setfilter(int filter_type)
+int apu_setfilter(apu_t *apu, int filter_type)
 {
   int old; 
    ASSERT(apu);
@@ -1063,63 +1660,107 @@ int apu_setfilter(int filter_type)
    return old;
 }
 
-void apu_reset(void)
+INLINE void apu_blep_clear(apu_t *apu)
+{
+   memset(apu->blep_buf, 0, sizeof(apu->blep_buf));
+   memset(apu->blep_level, 0, sizeof(apu->blep_level));
+   apu->blep_sum = 0;
+}
+
+/* set the synthesis mode, -1 just returns the current one */
+int apu_setsynth(apu_t *apu, int synth_type)
+{
+   int old;
+
+   ASSERT(apu);
+   old = apu->synth_type;
+   if (synth_type != -1 && synth_type != old)
+   {
+      apu->synth_type = synth_type;
+      apu_blep_clear(apu);
+   }
+   return old;
+}
+
+/* set the expansion chips' mode, -1 just returns the current one; chips
+** with only one way don't count
+*/
+int apu_setextmode(apu_t *apu, int mode)
+{
+   int old = APU_EXTMODE_ACCURATE;
+   boolean found = FALSE;
+   int i;
+
+   ASSERT(apu);
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      if (NULL == apu->ext[i]->set_mode)
+         continue;
+
+      if (found)
+         apu->ext[i]->set_mode(apu->ext_data[i], mode);
+      else
+         old = apu->ext[i]->set_mode(apu->ext_data[i], mode);
+      found = TRUE;
+   }
+
+   return old;
+}
+
+void apu_reset(apu_t *apu)
 {
    uint32 address;
+   int i;
 
    ASSERT(apu);
 
    apu->elapsed_cycles = 0;
-   memset(&apu->queue, 0, APUQUEUE_SIZE * sizeof(apudata_t));
    apu->q_head = 0;
    apu->q_tail = 0;
+   apu_blep_clear(apu);
 
    /* use to avoid bugs =) */
    for (address = 0x4000; address <= 0x4013; address++)
-      apu_regwrite(address, 0);
+      apu_regwrite(apu, address, 0);
 
 #ifdef NSF_PLAYER
-   apu_regwrite(0x400C, 0x10); /* silence noise channel on NSF start */
-   apu_regwrite(0x4015, 0x0F);
+   apu_regwrite(apu, 0x400C, 0x10); /* silence noise channel on NSF start */
+   apu_regwrite(apu, 0x4015, 0x0F);
 #else
-   apu_regwrite(0x4015, 0);
+   apu_regwrite(apu, 0x4015, 0);
 #endif /* NSF_PLAYER */
 
-   if (apu->ext)
-      apu->ext->reset();
+   for (i = 0; i < apu->num_ext; i++)
+      apu->ext[i]->reset(apu->ext_data[i]);
 }
 
-void apu_build_luts(int num_samples)
+static void apu_build_luts(apu_t *apu)
 {
+   int num_samples = apu->num_samples;
    int i;
 
    /* lut used for enveloping and frequency sweeps */
    for (i = 0; i < 16; i++)
-      decay_lut[i] = num_samples * (i + 1);
+      apu->decay_lut[i] = num_samples * (i + 1);
 
    /* used for note length, based on vblanks and size of audio buffer */
    for (i = 0; i < 32; i++)
-      vbl_lut[i] = vbl_length[i] * num_samples;
+      apu->vbl_lut[i] = vbl_length[i] * num_samples;
 
    /* triangle wave channel's linear length table */
    for (i = 0; i < 128; i++)
-      trilength_lut[i] = (i * num_samples) / 4;
+      apu->trilength_lut[i] = (i * num_samples) / 4;
 
 #ifndef REALTIME_NOISE
    /* generate noise samples */
-   shift_register15(noise_long_lut, APU_NOISE_32K);
-   shift_register15(noise_short_lut, APU_NOISE_93);
+   shift_register15(&apu->noise, apu->noise.long_lut, APU_NOISE_32K);
+   shift_register15(&apu->noise, apu->noise.short_lut, APU_NOISE_93);
 #endif /* !REALTIME_NOISE */
 }
 
-static void apu_setactive(apu_t *active)
-{
-   ASSERT(active);
-   apu = active;
-}
-
 /* Initializes emulated sound hardware, creates waveforms/voices */
-apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits, boolean stereo)
+apu_t *apu_create(nes6502_context *cpu, int sample_rate, int refresh_rate,
+                  int sample_bits, boolean stereo)
 {
    apu_t *temp_apu;
 /*    int channel; */
@@ -1131,6 +1772,7 @@ apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits, boolean st
    memset(temp_apu,0,sizeof(apu_t));
 
    SET_APU_ERROR(temp_apu,"no error");
+   temp_apu->cpu = cpu;
    temp_apu->sample_rate = sample_rate;
    temp_apu->refresh_rate = refresh_rate;
    temp_apu->sample_bits = sample_bits;
@@ -1139,66 +1781,334 @@ apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits, boolean st
    /* turn into fixed point! */
    temp_apu->cycle_rate = (int32) (APU_BASEFREQ * 65536.0 / (float) sample_rate);
 
+   /* noise shift register powers up with only bit 14 set */
+   temp_apu->noise.sreg = 0x4000;
+
+   /* sample phase per cycle, for placing band-limited steps; rounded
+   ** down so that the last phase of a sample stays below APU_BLEP_PHASES
+   */
+   temp_apu->blep_rate = ((APU_BLEP_PHASES << 24) - 1) / ((temp_apu->cycle_rate >> 8) + 1);
+
    /* build various lookup tables for apu */
-   apu_build_luts(temp_apu->num_samples);
+   apu_build_luts(temp_apu);
 
    /* set the update routine */
    temp_apu->process = apu_process;
-   temp_apu->ext = NULL;
+   temp_apu->num_ext = 0;
 
-   apu_setactive(temp_apu);
-   apu_reset();
+   apu_reset(temp_apu);
 
    temp_apu->mix_enable = 0x3F;
 /*    for (channel = 0; channel < 6; channel++) */
 /*       apu_setchan(channel, TRUE); */
 
-   apu_setfilter(APU_FILTER_LOWPASS);
+   apu_setfilter(temp_apu, APU_FILTER_LOWPASS);
 
    return temp_apu;
 }
 
-apu_t *apu_getcontext(void)
-{
-   return apu;
-}
-
 void apu_destroy(apu_t *src_apu)
 {
    if (src_apu)
    {
-      if (src_apu->ext)
-         src_apu->ext->shutdown();
+      apu_setext(src_apu, NULL);
+      if (src_apu->queue)
+         free(src_apu->queue);
       free(src_apu);
    }
 }
 
+/* drop any expansion chips, then add ext if there is one */
 int apu_setext(apu_t *src_apu, apuext_t *ext)
 {
    ASSERT(src_apu);
 
    /* $$$ ben : seem cleaner like this */
-   if (src_apu->ext) {
-     src_apu->ext->shutdown();
+   while (src_apu->num_ext > 0)
+   {
+      src_apu->num_ext--;
+      src_apu->ext[src_apu->num_ext]->shutdown(src_apu->ext_data[src_apu->num_ext]);
    }
 
-   src_apu->ext = ext;
+   if (NULL == ext)
+      return 0;
+
+   return apu_addext(src_apu, ext);
+}
+
+/* drive ext alongside whichever chips are already there */
+int apu_addext(apu_t *src_apu, apuext_t *ext)
+{
+   void *ext_data;
+
+   ASSERT(src_apu);
+   ASSERT(ext);
+
+   if (src_apu->num_ext >= APU_MAX_EXT)
+   {
+      SET_APU_ERROR(src_apu,"too many extensions");
+      return -1;
+   }
 
    /* initialize it */
-   if (src_apu->ext)
-      src_apu->ext->init();
+   ext_data = ext->init(src_apu);
+   if (NULL == ext_data)
+   {
+      SET_APU_ERROR(src_apu,"extension init failed");
+      return -1;
+   }
+
+   src_apu->ext[src_apu->num_ext] = ext;
+   src_apu->ext_data[src_apu->num_ext] = ext_data;
+   src_apu->num_ext++;
 
-   /* $$$ ben : May be one day extension int () will return error code */
    return 0;
 }
 
+/* for addresses more than one chip answers to: every chip that does
+** sees the write, in the order the chips were added
+*/
+void apu_extwrite(void *userdata, uint32 address, uint8 value)
+{
+   apu_t *apu = (apu_t *) userdata;
+   apu_memwrite *pmw;
+   int i;
+
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      for (pmw = apu->ext[i]->mem_write; pmw && pmw->write_func; pmw++)
+      {
+         if (address >= pmw->min_range && address <= pmw->max_range)
+         {
+            pmw->write_func(apu->ext_data[i], address, value);
+            break;
+         }
+      }
+   }
+}
+
 /* this exists for external mixing routines */
-int32 apu_getcyclerate(void)
+int32 apu_getcyclerate(apu_t *apu)
 {
    ASSERT(apu);
    return apu->cycle_rate;
 }
 
+/* for external chips laying down their own steps with apu_blep_add() */
+int32 apu_getbleprate(apu_t *apu)
+{
+   ASSERT(apu);
+   return apu->blep_rate;
+}
+
+/* what apu_savestate() writes: the channels and whatever is pending, then
+** the queued register writes, then the chip state.  It only goes back
+** into an apu made with the same sample and refresh rates.
+*/
+typedef struct apustate_s
+{
+   int sample_rate;
+   int refresh_rate;
+   int ext_size;
+   int queued;
+   rectangle_t rectangle[2];
+   triangle_t triangle;
+   noise_t noise;
+   dmc_t dmc;
+   uint8 enable_reg;
+   uint32 elapsed_cycles;
+   int32 prev_sample;
+   int32 blep_buf[APU_BLOCK_SIZE + APU_BLEP_WIDTH];
+   int32 blep_sum;
+   int32 blep_level[5];
+} apustate_t;
+
+static int apu_extstatesize(apu_t *apu)
+{
+   int i, size = 0;
+
+   for (i = 0; i < apu->num_ext; i++)
+      size += apu->ext[i]->state_size;
+   return size;
+}
+
+/* bytes apu_savestate() needs right now */
+int apu_statesize(apu_t *apu)
+{
+   int queued;
+
+   ASSERT(apu);
+
+   queued = (apu->q_head - apu->q_tail) & APUQUEUE_MASK(apu);
+   return sizeof(apustate_t) + queued * sizeof(apudata_t)
+          + apu_extstatesize(apu);
+}
+
+/* returns the number of bytes written, apu_statesize() of them */
+int apu_savestate(apu_t *apu, void *buf)
+{
+   apustate_t *state = (apustate_t *) buf;
+   apudata_t *queue = (apudata_t *) (state + 1);
+   uint8 *ext_state;
+   int i;
+
+   ASSERT(apu);
+
+   state->sample_rate = apu->sample_rate;
+   state->refresh_rate = apu->refresh_rate;
+   state->ext_size = apu_extstatesize(apu);
+   state->queued = (apu->q_head - apu->q_tail) & APUQUEUE_MASK(apu);
+   state->rectangle[0] = apu->rectangle[0];
+   state->rectangle[1] = apu->rectangle[1];
+   state->triangle = apu->triangle;
+   state->noise = apu->noise;
+   state->dmc = apu->dmc;
+   state->enable_reg = apu->enable_reg;
+   state->elapsed_cycles = apu->elapsed_cycles;
+   state->prev_sample = apu->prev_sample;
+   memcpy(state->blep_buf, apu->blep_buf, sizeof(apu->blep_buf));
+   state->blep_sum = apu->blep_sum;
+   memcpy(state->blep_level, apu->blep_level, sizeof(apu->blep_level));
+
+   for (i = 0; i < state->queued; i++)
+      queue[i] = apu->queue[(apu->q_tail + i) & APUQUEUE_MASK(apu)];
+
+   /* then each chip's state, one after another */
+   ext_state = (uint8 *) (queue + state->queued);
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      if (apu->ext[i]->save_state)
+         apu->ext[i]->save_state(apu->ext_data[i], ext_state);
+      else
+         memcpy(ext_state, apu->ext_data[i], apu->ext[i]->state_size);
+      ext_state += apu->ext[i]->state_size;
+   }
+
+   return apu_statesize(apu);
+}
+
+/* returns -1, leaving the apu alone, if the state doesn't fit it */
+int apu_loadstate(apu_t *apu, const void *buf, int size)
+{
+   const apustate_t *state = (const apustate_t *) buf;
+   const apudata_t *queue = (const apudata_t *) (state + 1);
+   const uint8 *ext_state;
+   int i;
+
+   ASSERT(apu);
+
+   if (size < (int) sizeof(apustate_t)
+       || state->sample_rate != apu->sample_rate
+       || state->refresh_rate != apu->refresh_rate
+       || state->ext_size != apu_extstatesize(apu)
+       || state->queued < 0 || state->queued >= APUQUEUE_MAX
+       || size != (int) (sizeof(apustate_t)
+                         + state->queued * sizeof(apudata_t)
+                         + state->ext_size))
+      return -1;
+
+   if (state->queued >= apu->q_size)
+   {
+      int q_size = apu->queue ? apu->q_size : APUQUEUE_MIN;
+
+      while (q_size <= state->queued)
+         q_size *= 2;
+      if (apu_growqueue(apu, q_size))
+         return -1;
+   }
+
+   apu->rectangle[0] = state->rectangle[0];
+   apu->rectangle[1] = state->rectangle[1];
+   apu->triangle = state->triangle;
+   apu->noise = state->noise;
+   apu->dmc = state->dmc;
+   apu->enable_reg = state->enable_reg;
+   apu->elapsed_cycles = state->elapsed_cycles;
+   apu->prev_sample = state->prev_sample;
+   memcpy(apu->blep_buf, state->blep_buf, sizeof(apu->blep_buf));
+   apu->blep_sum = state->blep_sum;
+   memcpy(apu->blep_level, state->blep_level, sizeof(apu->blep_level));
+
+   for (i = 0; i < state->queued; i++)
+      apu->queue[i] = queue[i];
+   apu->q_tail = 0;
+   apu->q_head = state->queued;
+
+   ext_state = (const uint8 *) (queue + state->queued);
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      if (apu->ext[i]->load_state)
+         apu->ext[i]->load_state(apu->ext_data[i], ext_state);
+      else
+         memcpy(apu->ext_data[i], ext_state, apu->ext[i]->state_size);
+      ext_state += apu->ext[i]->state_size;
+   }
+
+   return 0;
+}
+
+/* what apu_peek() writes: the length counters behind $4015 and what it
+** reads now, then each chip's readable state
+*/
+typedef struct apupeek_s
+{
+   int32 vbl_length[4];
+   uint8 enabled[4];
+   uint8 status;
+   uint8 pad[3];
+} apupeek_t;
+
+/* bytes apu_peek() writes */
+int apu_peeksize(apu_t *apu)
+{
+   int i, size = sizeof(apupeek_t);
+
+   ASSERT(apu);
+
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      if (apu->ext[i]->peek)
+         size += apu->ext[i]->peek_size;
+   }
+   return size;
+}
+
+/* Everything the cpu can read back from the sound hardware, for telling
+** whether it is where it was before.  Returns the bytes written,
+** apu_peeksize() of them.
+*/
+int apu_peek(apu_t *apu, void *buf)
+{
+   apupeek_t *peek = (apupeek_t *) buf;
+   uint8 *ext_peek;
+   int i;
+
+   ASSERT(apu);
+
+   memset(peek, 0, sizeof(apupeek_t));
+   peek->vbl_length[0] = apu->rectangle[0].vbl_length;
+   peek->vbl_length[1] = apu->rectangle[1].vbl_length;
+   peek->vbl_length[2] = apu->triangle.vbl_length;
+   peek->vbl_length[3] = apu->noise.vbl_length;
+   peek->enabled[0] = apu->rectangle[0].enabled;
+   peek->enabled[1] = apu->rectangle[1].enabled;
+   peek->enabled[2] = apu->triangle.enabled;
+   peek->enabled[3] = apu->noise.enabled;
+   peek->status = apu_read(apu, APU_SMASK);
+
+   ext_peek = (uint8 *) (peek + 1);
+   for (i = 0; i < apu->num_ext; i++)
+   {
+      if (apu->ext[i]->peek)
+      {
+         apu->ext[i]->peek(apu->ext_data[i], ext_peek);
+         ext_peek += apu->ext[i]->peek_size;
+      }
+   }
+
+   return apu_peeksize(apu);
+}
+
 /*
 ** $Log: nes_apu.c,v $
 ** Revision 1.2  2003/04/09 14:50:32  ben
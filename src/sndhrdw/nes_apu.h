@@ -34,6 +34,8 @@
 #define  INLINE      static
 #endif
 
+#include "nes6502.h"
+
 /* define this for realtime generated noise */
 #define  REALTIME_NOISE
 
@@ -160,11 +162,14 @@ typedef struct noise_s
 
    int vbl_length;
 
+   int sreg; /* 15-bit shift register */
 #ifdef REALTIME_NOISE
    uint8 xor_tap;
 #else
    boolean short_sample;
    int cur_pos;
+   int8 long_lut[APU_NOISE_32K];
+   int8 short_lut[APU_NOISE_93];
 #endif /* REALTIME_NOISE */
 } noise_t;
 
@@ -198,33 +203,95 @@ enum
    APU_FILTER_WEIGHTED
 };
 
+/* synthesis modes */
+enum
+{
+   APU_SYNTH_POINT,  /* sample the channels once per output sample */
+   APU_SYNTH_BLEP    /* band-limited steps at the exact transition times */
+};
+
+/* expansion chip modes, for chips that have a choice */
+enum
+{
+   APU_EXTMODE_ACCURATE, /* the hardware's quirks, whatever they cost */
+   APU_EXTMODE_FAST      /* a cheaper approximation, for batch work */
+};
+
+/* most samples synthesized in one run between register writes */
+#define  APU_BLOCK_SIZE    256
+
+/* band-limited step kernel: sub-sample phases, taps, and fixed point */
+#define  APU_BLEP_PHASES   32
+#define  APU_BLEP_WIDTH    16
+#define  APU_BLEP_BITS     12
+
+/* same layout as nes6502_memread / nes6502_memwrite */
 typedef struct
 {
    uint32 min_range, max_range;
-   uint8 (*read_func)(uint32 address);
+   uint8 (*read_func)(void *userdata, uint32 address);
+   void *userdata;
 } apu_memread;
 
 typedef struct
 {
    uint32 min_range, max_range;
-   void (*write_func)(uint32 address, uint8 value);
+   void (*write_func)(void *userdata, uint32 address, uint8 value);
+   void *userdata;
 } apu_memwrite;
 
 /* external sound chip stuff */
+struct apu_s;
+
+/* init() allocates the chip state and returns it (NULL on failure); that
+** pointer is handed back to every other driver function, and to the
+** mem_read / mem_write handlers as their userdata
+**
+** for snapshots, save_state() copies state_size bytes of chip state out
+** and load_state() puts them back; leave both NULL when the state is
+** just the first state_size bytes of the chip's struct
+**
+** a chip gives either process(), called for every sample, or
+** process_block(), which adds a whole run of samples into mix at once
+**
+** set_mode() picks one of the APU_EXTMODE_ modes and returns the old
+** one (-1 just returns it); chips with only one way leave it NULL
+**
+** peek() copies the peek_size bytes of state the cpu can read back from
+** the chip, without the side effects a read would have; chips with no
+** readable registers leave it NULL
+**
+** an apu drives up to APU_MAX_EXT chips at once (apu_addext); a write to
+** an address more than one of them answers goes to all of them, through
+** apu_extwrite()
+*/
 typedef struct apuext_s
 {
-   void  (*init)(void);
-   void  (*shutdown)(void);
-   void  (*reset)(void);
-   int32 (*process)(void);
+   void  *(*init)(struct apu_s *apu);
+   void  (*shutdown)(void *ext);
+   void  (*reset)(void *ext);
+   int32 (*process)(void *ext);
    apu_memread *mem_read;
    apu_memwrite *mem_write;
+   int   state_size;
+   void  (*save_state)(void *ext, void *buf);
+   void  (*load_state)(void *ext, const void *buf);
+   void  (*process_block)(void *ext, int32 *mix, int count);
+   int   (*set_mode)(void *ext, int mode);
+   int   peek_size;
+   void  (*peek)(void *ext, void *buf);
 } apuext_t;
 
 
-/* APU queue structure */
-#define  APUQUEUE_SIZE  4096
-#define  APUQUEUE_MASK  (APUQUEUE_SIZE - 1)
+/* most expansion chips one apu drives at once, one per NSF header bit */
+#define  APU_MAX_EXT    6
+
+/* APU queue structure: a ring of a power of two entries, allocated on
+** the first write and doubled whenever a frame's writes outgrow it
+*/
+#define  APUQUEUE_MIN   64
+#define  APUQUEUE_MAX   16384    /* a write every cycle of a PAL frame */
+#define  APUQUEUE_MASK(apu) ((apu)->q_size - 1)
 
 /* apu ring buffer member */
 typedef struct apudata_s
@@ -242,8 +309,8 @@ typedef struct apu_s
    dmc_t dmc;
    uint8 enable_reg;
 
-   apudata_t queue[APUQUEUE_SIZE];
-   int q_head, q_tail;
+   apudata_t *queue;
+   int q_size, q_head, q_tail;
    uint32 elapsed_cycles;
 
    void *buffer; /* pointer to output buffer */
@@ -253,18 +320,38 @@ typedef struct apu_s
    int filter_type;
 
    int32 cycle_rate;
+   int32 prev_sample; /* filter history */
+
+   /* band-limited synthesis: pending step deltas, their running sum,
+   ** and the level each 2A03 channel was last stepped to
+   */
+   int synth_type;
+   int32 blep_buf[APU_BLOCK_SIZE + APU_BLEP_WIDTH];
+   int32 blep_sum;
+   int32 blep_rate;
+   int32 blep_level[5];
 
    int sample_rate;
    int sample_bits;
    int refresh_rate;
 
-   void (*process)(void *buffer, int num_samples);
+   /* look up table madness, scaled to num_samples */
+   int32 decay_lut[16];
+   int vbl_lut[32];
+   int trilength_lut[128];
+
+   void (*process)(struct apu_s *apu, void *buffer, int num_samples);
 
   /* $$$ ben : last error string */
   const char * errstr;
 
-   /* external sound chip */
-   apuext_t *ext;
+   /* CPU we take timestamps and DMC fetches from */
+   nes6502_context *cpu;
+
+   /* external sound chips, in the order they were added */
+   apuext_t *ext[APU_MAX_EXT];
+   void *ext_data[APU_MAX_EXT];
+   int num_ext;
 } apu_t;
 
 
@@ -273,21 +360,45 @@ extern "C" {
 #endif /* __cplusplus */
 
 /* Function prototypes */
-extern apu_t *apu_create(int sample_rate, int refresh_rate, int sample_bits, boolean stereo);
+/* sample_bits: 8 (unsigned), 16 (signed) or 32 (float) */
+extern apu_t *apu_create(nes6502_context *cpu, int sample_rate,
+                         int refresh_rate, int sample_bits, boolean stereo);
 extern void apu_destroy(apu_t *apu);
 extern int apu_setext(apu_t *apu, apuext_t *ext);
-extern int apu_setfilter(int filter_type);
-extern void apu_process(void *buffer, int num_samples);
-extern void apu_reset(void);
-extern int apu_setchan(int chan, boolean enabled);
-extern int32 apu_getcyclerate(void);
-extern apu_t *apu_getcontext(void);
-
-extern uint8 apu_read(uint32 address);
-extern void apu_write(uint32 address, uint8 value);
+extern int apu_addext(apu_t *apu, apuext_t *ext);
+extern int apu_setfilter(apu_t *apu, int filter_type);
+extern int apu_setsynth(apu_t *apu, int synth_type);
+extern int apu_setextmode(apu_t *apu, int mode);
+extern void apu_process(apu_t *apu, void *buffer, int num_samples);
+extern void apu_render(apu_t *apu, void *buffer, int num_samples);
+extern void apu_reset(apu_t *apu);
+extern int apu_setchan(apu_t *apu, int chan, boolean enabled);
+extern int32 apu_getcyclerate(apu_t *apu);
+extern int32 apu_getbleprate(apu_t *apu);
+
+/* band-limited steps for external chips: a chip keeps an int32 buffer of
+** APU_BLOCK_SIZE + APU_BLEP_WIDTH and a running sum, adds steps into it
+** and integrates each block into mix with apu_blep_mix()
+*/
+extern void apu_blep_add(int32 *buf, int pos, int32 offset, int32 blep_rate,
+                         int32 delta);
+extern void apu_blep_mix(int32 *buf, int32 *sum, int32 *mix, int count);
+
+/* snapshots of the sound state, the external chip's included */
+extern int apu_statesize(apu_t *apu);
+extern int apu_savestate(apu_t *apu, void *buf);
+extern int apu_loadstate(apu_t *apu, const void *buf, int size);
+extern int apu_peeksize(apu_t *apu);
+extern int apu_peek(apu_t *apu, void *buf);
+
+/* memory handlers, userdata is the apu_t */
+extern uint8 apu_read(void *userdata, uint32 address);
+extern void apu_write(void *userdata, uint32 address, uint8 value);
+extern void apu_extwrite(void *userdata, uint32 address, uint8 value);
 
 /* for visualization */
-extern void apu_getpcmdata(void **data, int *num_samples, int *sample_bits);
+extern void apu_getpcmdata(apu_t *apu, void **data, int *num_samples,
+                           int *sample_bits);
 
 
 #ifdef __cplusplus
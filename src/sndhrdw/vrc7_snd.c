@@ -21,287 +21,479 @@
 **
 ** VRCVII sound hardware emulation
 ** Thanks to Charles MacDonald (cgfm2@hooked.net) for donating code.
+**
+** The VRC7 is a cut down YM2413 (OPLL): six two-operator FM channels,
+** fifteen instruments in ROM and one user instrument.  The chip is run
+** at its own rate of 3.58MHz / 72, a channel at a time over a chunk of
+** samples, and resampled to the output rate.  Sines and exponentials
+** come from log tables as on the die, so it is all integer work.
+**
 ** $Id: vrc7_snd.c,v 1.1 2003/04/08 20:53:01 ben Exp $
 */
 
-#include <stdio.h>
+#include <string.h>
 #include "types.h"
 #include "vrc7_snd.h"
-#include "fmopl.h"
 
+/* envelope states */
+enum
+{
+   VRC7_ATTACK,
+   VRC7_DECAY,
+   VRC7_SUSTAIN,
+   VRC7_RELEASE
+};
 
-static int buflen;
-static int16 *buffer;
+/* built-in instruments 1-15, laid out like the user instrument at $00-$07;
+** read out of a VRC7 die
+*/
+static const uint8 vrc7_rom[15][8] =
+{
+   { 0x03, 0x21, 0x05, 0x06, 0xE8, 0x81, 0x42, 0x27 }, /* Buzzy bell */
+   { 0x13, 0x41, 0x14, 0x0D, 0xD8, 0xF6, 0x23, 0x12 }, /* Guitar */
+   { 0x11, 0x11, 0x08, 0x08, 0xFA, 0xB2, 0x20, 0x12 }, /* Wurly */
+   { 0x31, 0x61, 0x0C, 0x07, 0xA8, 0x64, 0x61, 0x27 }, /* Flute */
+   { 0x32, 0x21, 0x1E, 0x06, 0xE1, 0x76, 0x01, 0x28 }, /* Clarinet */
+   { 0x02, 0x01, 0x06, 0x00, 0xA3, 0xE2, 0xF4, 0xF4 }, /* Synth */
+   { 0x21, 0x61, 0x1D, 0x07, 0x82, 0x81, 0x11, 0x07 }, /* Trumpet */
+   { 0x23, 0x21, 0x22, 0x17, 0xA2, 0x72, 0x01, 0x17 }, /* Organ */
+   { 0x35, 0x11, 0x25, 0x00, 0x40, 0x73, 0x72, 0x01 }, /* Bells */
+   { 0xB5, 0x01, 0x0F, 0x0F, 0xA8, 0xA5, 0x51, 0x02 }, /* Vibes */
+   { 0x17, 0xC1, 0x24, 0x07, 0xF8, 0xF8, 0x22, 0x12 }, /* Vibraphone */
+   { 0x71, 0x23, 0x11, 0x06, 0x65, 0x74, 0x18, 0x16 }, /* Tutti */
+   { 0x01, 0x02, 0xD3, 0x05, 0xC9, 0x95, 0x03, 0x02 }, /* Fretless */
+   { 0x61, 0x63, 0x0C, 0x00, 0x94, 0xC0, 0x33, 0xF6 }, /* Synth bass */
+   { 0x21, 0x72, 0x0D, 0x00, 0xC1, 0xD5, 0x56, 0x06 }  /* Sweep */
+};
 
-#define OPL_WRITE(opl, r, d) \
-{ \
-   OPLWrite((opl)->ym3812, 0, (r)); \
-   OPLWrite((opl)->ym3812, 1, (d)); \
-}
+/* -log2(sin) over a quarter wave, in 256ths of an octave (6dB) */
+static const uint16 logsin_tab[256] =
+{
+   2137, 1731, 1543, 1419, 1326, 1252, 1190, 1137, 1091, 1050, 1013,  979,
+    949,  920,  894,  869,  846,  825,  804,  785,  767,  749,  732,  717,
+    701,  687,  672,  659,  646,  633,  621,  609,  598,  587,  576,  566,
+    556,  546,  536,  527,  518,  509,  501,  492,  484,  476,  468,  461,
+    453,  446,  439,  432,  425,  418,  411,  405,  399,  392,  386,  380,
+    375,  369,  363,  358,  352,  347,  341,  336,  331,  326,  321,  316,
+    311,  307,  302,  297,  293,  289,  284,  280,  276,  271,  267,  263,
+    259,  255,  251,  248,  244,  240,  236,  233,  229,  226,  222,  219,
+    215,  212,  209,  205,  202,  199,  196,  193,  190,  187,  184,  181,
+    178,  175,  172,  169,  167,  164,  161,  159,  156,  153,  151,  148,
+    146,  143,  141,  138,  136,  134,  131,  129,  127,  125,  122,  120,
+    118,  116,  114,  112,  110,  108,  106,  104,  102,  100,   98,   96,
+     94,   92,   91,   89,   87,   85,   83,   82,   80,   78,   77,   75,
+     74,   72,   70,   69,   67,   66,   64,   63,   62,   60,   59,   57,
+     56,   55,   53,   52,   51,   49,   48,   47,   46,   45,   43,   42,
+     41,   40,   39,   38,   37,   36,   35,   34,   33,   32,   31,   30,
+     29,   28,   27,   26,   25,   24,   23,   23,   22,   21,   20,   20,
+     19,   18,   17,   17,   16,   15,   15,   14,   13,   13,   12,   12,
+     11,   10,   10,    9,    9,    8,    8,    7,    7,    7,    6,    6,
+      5,    5,    5,    4,    4,    4,    3,    3,    3,    2,    2,    2,
+      2,    1,    1,    1,    1,    1,    1,    1,    0,    0,    0,    0,
+      0,    0,    0,    0
+};
 
-static vrc7_t vrc7;
+/* 2^-x for the fractional part of an attenuation, 11 bits */
+static const uint16 exp_tab[256] =
+{
+   2042, 2037, 2031, 2026, 2020, 2015, 2010, 2004, 1999, 1993, 1988, 1983,
+   1977, 1972, 1966, 1961, 1956, 1951, 1945, 1940, 1935, 1930, 1924, 1919,
+   1914, 1909, 1904, 1898, 1893, 1888, 1883, 1878, 1873, 1868, 1863, 1858,
+   1853, 1848, 1843, 1838, 1833, 1828, 1823, 1818, 1813, 1808, 1803, 1798,
+   1794, 1789, 1784, 1779, 1774, 1769, 1765, 1760, 1755, 1750, 1746, 1741,
+   1736, 1732, 1727, 1722, 1717, 1713, 1708, 1704, 1699, 1694, 1690, 1685,
+   1681, 1676, 1672, 1667, 1663, 1658, 1654, 1649, 1645, 1640, 1636, 1631,
+   1627, 1623, 1618, 1614, 1609, 1605, 1601, 1596, 1592, 1588, 1584, 1579,
+   1575, 1571, 1566, 1562, 1558, 1554, 1550, 1545, 1541, 1537, 1533, 1529,
+   1525, 1520, 1516, 1512, 1508, 1504, 1500, 1496, 1492, 1488, 1484, 1480,
+   1476, 1472, 1468, 1464, 1460, 1456, 1452, 1448, 1444, 1440, 1436, 1433,
+   1429, 1425, 1421, 1417, 1413, 1409, 1406, 1402, 1398, 1394, 1391, 1387,
+   1383, 1379, 1376, 1372, 1368, 1364, 1361, 1357, 1353, 1350, 1346, 1342,
+   1339, 1335, 1332, 1328, 1324, 1321, 1317, 1314, 1310, 1307, 1303, 1300,
+   1296, 1292, 1289, 1286, 1282, 1279, 1275, 1272, 1268, 1265, 1261, 1258,
+   1255, 1251, 1248, 1244, 1241, 1238, 1234, 1231, 1228, 1224, 1221, 1218,
+   1214, 1211, 1208, 1205, 1201, 1198, 1195, 1192, 1188, 1185, 1182, 1179,
+   1176, 1172, 1169, 1166, 1163, 1160, 1157, 1154, 1150, 1147, 1144, 1141,
+   1138, 1135, 1132, 1129, 1126, 1123, 1120, 1117, 1114, 1111, 1108, 1105,
+   1102, 1099, 1096, 1093, 1090, 1087, 1084, 1081, 1078, 1075, 1072, 1069,
+   1066, 1064, 1061, 1058, 1055, 1052, 1049, 1046, 1044, 1041, 1038, 1035,
+   1032, 1030, 1027, 1024
+};
 
-/* Fixed instrument settings, from MAME's YM2413 emulation */
-/* This might need some tweaking... */
-unsigned char table[16][11] =
+/* frequency multipliers, times two */
+static const int mul_tab[16] =
 {
-  /*   20    23    40    43    60    63    80    83    E0    E3    C0 */
-   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-
-   /* MAME */  
-   { 0x01, 0x22, 0x23, 0x07, 0xF0, 0xF0, 0x07, 0x18, 0x00, 0x00, 0x00 }, /* Violin */
-   { 0x23, 0x01, 0x68, 0x05, 0xF2, 0x74, 0x6C, 0x89, 0x00, 0x00, 0x00 }, /* Acoustic Guitar(steel) */
-   { 0x13, 0x11, 0x25, 0x00, 0xD2, 0xB2, 0xF4, 0xF4, 0x00, 0x00, 0x00 }, /* Acoustic Grand */
-   { 0x22, 0x21, 0x1B, 0x05, 0xC0, 0xA1, 0x18, 0x08, 0x00, 0x00, 0x00 }, /* Flute */
-   { 0x22, 0x21, 0x2C, 0x03, 0xD2, 0xA1, 0x18, 0x57, 0x00, 0x00, 0x00 }, /* Clarinet */
-   { 0x01, 0x22, 0xBA, 0x01, 0xF1, 0xF1, 0x1E, 0x04, 0x00, 0x00, 0x00 }, /* Oboe */
-   { 0x21, 0x21, 0x28, 0x06, 0xF1, 0xF1, 0x6B, 0x3E, 0x00, 0x00, 0x00 }, /* Trumpet */
-   { 0x27, 0x21, 0x60, 0x00, 0xF0, 0xF0, 0x0D, 0x0F, 0x00, 0x00, 0x00 }, /* Church Organ */
-   { 0x20, 0x21, 0x2B, 0x06, 0x85, 0xF1, 0x6D, 0x89, 0x00, 0x00, 0x00 }, /* French Horn */
-   { 0x01, 0x21, 0xBF, 0x02, 0x53, 0x62, 0x5F, 0xAE, 0x01, 0x00, 0x00 }, /* Synth Voice */
-   { 0x23, 0x21, 0x70, 0x07, 0xD4, 0xA3, 0x4E, 0x64, 0x01, 0x00, 0x00 }, /* Harpsichord */
-   { 0x2B, 0x21, 0xA4, 0x07, 0xF6, 0x93, 0x5C, 0x4D, 0x00, 0x00, 0x00 }, /* Vibraphone */
-   { 0x21, 0x23, 0xAD, 0x07, 0x77, 0xF1, 0x18, 0x37, 0x00, 0x00, 0x00 }, /* Synth Bass 1 */
-   { 0x21, 0x21, 0x2A, 0x03, 0xF3, 0xE2, 0x29, 0x46, 0x00, 0x00, 0x00 }, /* Acoustic Bass */
-   { 0x21, 0x23, 0x37, 0x03, 0xF3, 0xE2, 0x29, 0x46, 0x00, 0x00, 0x00 }, /* Electric Guitar(clean) */
-
-
-#if 0
-   /* Horton, try 1 */
-   { 0x05, 0x03, 0x10, 0x06, 0x74, 0xA1, 0x13, 0xF4, 0x00, 0x00, 0x00 },
-   { 0x05, 0x01, 0x16, 0x00, 0xF9, 0xA2, 0x15, 0xF5, 0x00, 0x00, 0x00 },
-   { 0x01, 0x41, 0x11, 0x00, 0xA0, 0xA0, 0x83, 0x95, 0x00, 0x00, 0x00 },
-   { 0x01, 0x41, 0x17, 0x00, 0x60, 0xF0, 0x83, 0x95, 0x00, 0x00, 0x00 },
-   { 0x24, 0x41, 0x1F, 0x00, 0x50, 0xB0, 0x94, 0x94, 0x00, 0x00, 0x00 },
-   { 0x05, 0x01, 0x0B, 0x04, 0x65, 0xA0, 0x54, 0x95, 0x00, 0x00, 0x00 },
-   { 0x11, 0x41, 0x0E, 0x04, 0x70, 0xC7, 0x13, 0x10, 0x00, 0x00, 0x00 },
-   { 0x02, 0x44, 0x16, 0x06, 0xE0, 0xE0, 0x31, 0x35, 0x00, 0x00, 0x00 },
-   { 0x48, 0x22, 0x22, 0x07, 0x50, 0xA1, 0xA5, 0xF4, 0x00, 0x00, 0x00 },
-   { 0x05, 0xA1, 0x18, 0x00, 0xA2, 0xA2, 0xF5, 0xF5, 0x00, 0x00, 0x00 },
-   { 0x07, 0x81, 0x2B, 0x05, 0xA5, 0xA5, 0x03, 0x03, 0x00, 0x00, 0x00 },
-   { 0x01, 0x41, 0x08, 0x08, 0xA0, 0xA0, 0x83, 0x95, 0x00, 0x00, 0x00 },
-   { 0x21, 0x61, 0x12, 0x00, 0x93, 0x92, 0x74, 0x75, 0x00, 0x00, 0x00 },
-   { 0x21, 0x62, 0x21, 0x00, 0x84, 0x85, 0x34, 0x15, 0x00, 0x00, 0x00 },
-   { 0x21, 0x62, 0x0E, 0x00, 0xA1, 0xA0, 0x34, 0x15, 0x00, 0x00, 0x00 },
-#endif
-
-#if 0
-   /* Horton try 2 */
-   { 0x31, 0x22, 0x23, 0x07, 0xF0, 0xF0, 0xE8, 0xF7, 0x00, 0x00, 0x00 },
-   { 0x03, 0x31, 0x68, 0x05, 0xF2, 0x74, 0x79, 0x9C, 0x00, 0x00, 0x00 },
-   { 0x01, 0x51, 0x72, 0x04, 0xF1, 0xD3, 0x9D, 0x8B, 0x00, 0x00, 0x00 },
-   { 0x22, 0x61, 0x1B, 0x05, 0xC0, 0xA1, 0xF8, 0xE8, 0x00, 0x00, 0x00 },
-   { 0x22, 0x61, 0x2C, 0x03, 0xD2, 0xA1, 0xA7, 0xE8, 0x00, 0x00, 0x00 },
-   { 0x31, 0x22, 0xFA, 0x01, 0xF1, 0xF1, 0xF4, 0xEE, 0x00, 0x00, 0x00 },
-   { 0x21, 0x61, 0x28, 0x06, 0xF1, 0xF1, 0xCE, 0x9B, 0x00, 0x00, 0x00 },
-   { 0x27, 0x61, 0x60, 0x00, 0xF0, 0xF0, 0xFF, 0xFD, 0x00, 0x00, 0x00 },
-   { 0x60, 0x21, 0x2B, 0x06, 0x85, 0xF1, 0x79, 0x9D, 0x00, 0x00, 0x00 },
-   { 0x31, 0xA1, 0xFF, 0x0A, 0x53, 0x62, 0x5E, 0xAF, 0x00, 0x00, 0x00 },
-   { 0x03, 0xA1, 0x70, 0x0F, 0xD4, 0xA3, 0x94, 0xBE, 0x00, 0x00, 0x00 },
-   { 0x2B, 0x61, 0xE4, 0x07, 0xF6, 0x93, 0xBD, 0xAC, 0x00, 0x00, 0x00 },
-   { 0x21, 0x63, 0xED, 0x07, 0x77, 0xF1, 0xC7, 0xE8, 0x00, 0x00, 0x00 },
-   { 0x21, 0x61, 0x2A, 0x03, 0xF3, 0xE2, 0xB6, 0xD9, 0x00, 0x00, 0x00 },
-   { 0x21, 0x63, 0x37, 0x03, 0xF3, 0xE2, 0xB6, 0xD9, 0x00, 0x00, 0x00 },
-#endif
+   1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30
 };
 
-static void vrc7_reset(void)
+/* key scaling attenuation for the top 4 bits of fnum, in block 7, in
+** envelope steps
+*/
+static const int ksl_tab[16] =
 {
-   int n;
+   0, 48, 64, 74, 80, 86, 90, 94, 96, 100, 102, 104, 106, 108, 110, 112
+};
 
-   /* Point to current VRC7 context */
-   vrc7_t *opll = &vrc7;
+/* vibrato: fnum offsets (in half steps) for the top 3 bits of fnum, over
+** the 8 steps of the lfo
+*/
+static const int8 pm_tab[8][8] =
+{
+   { 0, 0, 0, 0, 0,  0,  0,  0 },
+   { 0, 0, 1, 0, 0,  0, -1,  0 },
+   { 0, 1, 2, 1, 0, -1, -2, -1 },
+   { 0, 1, 3, 1, 0, -1, -3, -1 },
+   { 0, 2, 4, 2, 0, -2, -4, -2 },
+   { 0, 2, 5, 2, 0, -2, -5, -2 },
+   { 0, 3, 6, 3, 0, -3, -6, -3 },
+   { 0, 3, 7, 3, 0, -3, -7, -3 }
+};
 
-   /* Clear all YM3812 registers */
-   for (n = 0; n < 0x100; n++)
-      OPL_WRITE(opll, n, 0x00);
+/* envelope steps over 8 ticks: rows 0-3 for rates below 52, by the low
+** two bits, then 52-55, 56-59 and 60-63
+*/
+static const uint8 eg_inc[13][8] =
+{
+   { 0, 1, 0, 1, 0, 1, 0, 1 },
+   { 0, 1, 0, 1, 1, 1, 0, 1 },
+   { 0, 1, 1, 1, 0, 1, 1, 1 },
+   { 0, 1, 1, 1, 1, 1, 1, 1 },
+   { 1, 1, 1, 1, 1, 1, 1, 1 },
+   { 1, 1, 1, 2, 1, 1, 1, 2 },
+   { 1, 2, 1, 2, 1, 2, 1, 2 },
+   { 1, 2, 2, 2, 1, 2, 2, 2 },
+   { 2, 2, 2, 2, 2, 2, 2, 2 },
+   { 2, 2, 2, 4, 2, 2, 2, 4 },
+   { 2, 4, 2, 4, 2, 4, 2, 4 },
+   { 2, 4, 4, 4, 2, 4, 4, 4 },
+   { 4, 4, 4, 4, 4, 4, 4, 4 }
+};
 
-   /* Turn off rhythm mode and key-on bits */
-   OPL_WRITE(opll, 0xBD, 0xC0);
+/* an operator's settings, worked out from the registers once a chunk */
+typedef struct vrc7op_s
+{
+   int fnum, block, mul;
+   uint32 inc;             /* phase step without vibrato */
+   int rate[4];            /* 0-63 for each envelope state */
+   int sl;                 /* sustain level, in envelope steps */
+   int tl;                 /* total level and key scaling, likewise */
+   boolean am, pm, half;
+   int fb;                 /* modulator feedback, 0-7 */
+} vrc7op_t;
+
+/* effective envelope rate for a 4-bit rate and key scaling */
+INLINE int vrc7_rate(int rate, int rks)
+{
+   if (0 == rate)
+      return 0;
 
-   /* Enable waveform select */
-   OPL_WRITE(opll, 0x01, 0x20);
+   rate = (rate << 2) + rks;
+   return (rate > 63) ? 63 : rate;
 }
 
-static void vrc7_init(void)
+/* envelope step at rate this chip sample */
+INLINE int vrc7_eginc(int rate, uint32 counter)
 {
-   vrc7.ym3812 = OPLCreate(OPL_TYPE_YM3812, 3579545, apu_getcontext()->sample_rate);
-   ASSERT(vrc7.ym3812);
-   buflen = apu_getcontext()->num_samples;
-   buffer = malloc(buflen * 2);
-   ASSERT(buffer);
-   vrc7_reset();
+   int shift;
+
+   if (rate < 4)
+      return 0;
+
+   if (rate < 52)
+   {
+      shift = 13 - (rate >> 2);
+      if (counter & ((1 << shift) - 1))
+         return 0;
+      return eg_inc[rate & 3][(counter >> shift) & 7];
+   }
+
+   return eg_inc[(rate < 60) ? rate - 48 : 12][counter & 7];
 }
 
-static void vrc7_shutdown(void)
+INLINE void vrc7_eg(vrc7slot_t *slot, const vrc7op_t *op, uint32 counter)
 {
-   vrc7_reset();
-   OPLDestroy(vrc7.ym3812);
-   free(buffer);
+   int inc = vrc7_eginc(op->rate[slot->eg_state], counter);
+
+   if (VRC7_ATTACK == slot->eg_state)
+   {
+      if (op->rate[VRC7_ATTACK] >= 60)
+         slot->env = 0;
+      else if (inc)
+         slot->env += (~slot->env * inc) >> 2;
+
+      if (slot->env <= 0)
+      {
+         slot->env = 0;
+         slot->eg_state = VRC7_DECAY;
+      }
+      return;
+   }
+
+   slot->env += inc;
+   if (slot->env > 127)
+      slot->env = 127;
+
+   if (VRC7_DECAY == slot->eg_state && slot->env >= op->sl)
+      slot->eg_state = VRC7_SUSTAIN;
 }
 
-/* channel (0-9), instrument (0-F), volume (0-3F, YM3812 format) */
-static void load_instrument(uint8 ch, uint8 inst, uint8 vol)
+/* output of an operator at 10-bit phase p, attenuated by env steps */
+INLINE int32 vrc7_output(int p, int env, boolean half)
 {
-   /* Point to current VRC7 context */
-   vrc7_t *opll = &vrc7;
-
-   /* Point to fixed instrument or user table */
-   uint8 *param = (inst == 0) ? &opll->user[0] : &table[inst][0];
-
-   /* Maps channels to operator registers */
-   uint8 ch2op[] = {0, 1, 2, 8, 9, 10, 16, 17, 18};
-
-   /* Make operator offset from requested channel */
-   uint8 op = ch2op[ch];
-
-   /* Store volume level */
-   opll->channel[ch].volume = (vol & 0x3F);
-
-   /* Store instrument number */
-   opll->channel[ch].instrument = (inst & 0x0F);
-
-   /* Update instrument settings, except frequency registers */
-   OPL_WRITE(opll, 0x20 + op,  param[0]);
-   OPL_WRITE(opll, 0x23 + op,  param[1]);
-   OPL_WRITE(opll, 0x40 + op,  param[2]);
-   OPL_WRITE(opll, 0x43 + op, (param[3] & 0xC0) | opll->channel[ch].volume);
-   OPL_WRITE(opll, 0x60 + op,  param[4]);
-   OPL_WRITE(opll, 0x63 + op,  param[5]);
-   OPL_WRITE(opll, 0x80 + op,  param[6]);
-   OPL_WRITE(opll, 0x83 + op,  param[7]);
-   OPL_WRITE(opll, 0xE0 + op,  param[8]);
-   OPL_WRITE(opll, 0xE3 + op,  param[9]);
-   OPL_WRITE(opll, 0xC0 + ch,  param[10]);
+   int att;
+   int32 out;
+
+   if (env >= 127 || (half && (p & 0x200)))
+      return 0;
+
+   att = logsin_tab[(p & 0x100) ? (~p & 0xFF) : (p & 0xFF)] + (env << 4);
+   out = exp_tab[att & 0xFF] >> (att >> 8);
+
+   return (p & 0x200) ? -out : out;
 }
 
-static void vrc7_write(uint32 address, uint8 data)
+INLINE uint32 vrc7_phaseinc(const vrc7op_t *op, uint32 counter)
 {
-   /* Point to current VRC7 context */
-   vrc7_t *opll = &vrc7;
+   if (FALSE == op->pm)
+      return op->inc;
+
+   return ((((op->fnum << 1) + pm_tab[op->fnum >> 6][(counter >> 10) & 7])
+            * op->mul) << op->block) >> 2;
+}
 
-   if (address & 0x0020) /* data port */
+/* settings for a channel's modulator (op[0]) and carrier (op[1]) */
+static void vrc7_setup(vrc7_t *opll, int ch, vrc7op_t *op)
+{
+   int inst = opll->reg[0x30 + ch] >> 4;
+   const uint8 *patch = inst ? vrc7_rom[inst - 1] : opll->reg;
+   int fnum = opll->reg[0x10 + ch] | ((opll->reg[0x20 + ch] & 1) << 8);
+   int block = (opll->reg[0x20 + ch] >> 1) & 7;
+   boolean sus = (opll->reg[0x20 + ch] & 0x20) ? TRUE : FALSE;
+   int ksl, kslk, rks, rr, k;
+
+   ksl = ksl_tab[fnum >> 5] - ((7 - block) << 4);
+   if (ksl < 0)
+      ksl = 0;
+
+   for (k = 0; k < 2; k++)
    {
-      /* Store register data */
-      opll->reg[opll->latch] = data;
+      uint8 flags = patch[k];
+
+      op[k].fnum = fnum;
+      op[k].block = block;
+      op[k].mul = mul_tab[flags & 0x0F];
+      op[k].inc = (((fnum << 1) * op[k].mul) << block) >> 2;
+      op[k].am = (flags & 0x80) ? TRUE : FALSE;
+      op[k].pm = (flags & 0x40) ? TRUE : FALSE;
+
+      rks = ((block << 1) | (fnum >> 8)) >> ((flags & 0x10) ? 0 : 2);
+      rr = patch[6 + k] & 0x0F;
+      op[k].rate[VRC7_ATTACK] = vrc7_rate(patch[4 + k] >> 4, rks);
+      op[k].rate[VRC7_DECAY] = vrc7_rate(patch[4 + k] & 0x0F, rks);
+
+      /* a sustained tone holds until key-off, a percussive one doesn't */
+      if (flags & 0x20)
+      {
+         op[k].rate[VRC7_SUSTAIN] = 0;
+         op[k].rate[VRC7_RELEASE] = vrc7_rate(sus ? 5 : rr, rks);
+      }
+      else
+      {
+         op[k].rate[VRC7_SUSTAIN] = vrc7_rate(rr, rks);
+         op[k].rate[VRC7_RELEASE] = vrc7_rate(sus ? 5 : 7, rks);
+      }
+      op[k].sl = (patch[6 + k] >> 4) << 3;
 
-      switch (opll->latch & 0x30)
+      kslk = patch[2 + k] >> 6;
+      op[k].tl = kslk ? (ksl >> (3 - kslk)) : 0;
+      if (k)
+         op[k].tl += (opll->reg[0x30 + ch] & 0x0F) << 3; /* 3dB steps */
+      else
+         op[k].tl += (patch[2] & 0x3F) << 1;             /* 0.75dB steps */
+
+      op[k].half = (patch[3] & (k ? 0x10 : 0x08)) ? TRUE : FALSE;
+   }
+
+   op[0].fb = patch[3] & 0x07;
+   op[1].fb = 0;
+}
+
+/* add count chip samples of a channel into buf, am[] being the tremolo */
+static void vrc7_channel(vrc7_t *opll, int ch, int32 *buf, int count,
+                         const uint8 *am)
+{
+   vrc7slot_t *mod = &opll->slot[ch][0];
+   vrc7slot_t *car = &opll->slot[ch][1];
+   uint32 counter = opll->counter;
+   vrc7op_t op[2];
+   int32 fm, out;
+   int i;
+
+   /* a channel that has died away stays silent until it's keyed on,
+   ** which starts its phases over
+   */
+   if (VRC7_RELEASE == mod->eg_state && 127 == mod->env
+       && VRC7_RELEASE == car->eg_state && 127 == car->env
+       && 0 == (mod->out[0] | mod->out[1] | car->out[0] | car->out[1]))
+      return;
+
+   vrc7_setup(opll, ch, op);
+
+   for (i = 0; i < count; i++, counter++)
+   {
+      vrc7_eg(mod, &op[0], counter);
+      fm = op[0].fb ? (mod->out[0] + mod->out[1]) >> (8 - op[0].fb) : 0;
+      out = vrc7_output(((int) (mod->phase >> 9) + fm) & 0x3FF,
+                        mod->env + op[0].tl + (op[0].am ? am[i] : 0),
+                        op[0].half);
+      mod->out[1] = mod->out[0];
+      mod->out[0] = out;
+      mod->phase = (mod->phase + vrc7_phaseinc(&op[0], counter)) & 0x7FFFF;
+
+      /* the carrier, phase modulated by it */
+      vrc7_eg(car, &op[1], counter);
+      out = vrc7_output(((int) (car->phase >> 9) + (mod->out[0] << 1)) & 0x3FF,
+                        car->env + op[1].tl + (op[1].am ? am[i] : 0),
+                        op[1].half);
+      car->out[1] = car->out[0];
+      car->out[0] = out;
+      car->phase = (car->phase + vrc7_phaseinc(&op[1], counter)) & 0x7FFFF;
+
+      buf[i] += out;
+   }
+}
+
+static void vrc7_process_block(void *ext, int32 *mix, int count)
+{
+   vrc7_t *opll = (vrc7_t *) ext;
+   int32 chip[VRC7_CHUNK + 2];   /* prev, cur, then the chunk */
+   uint8 am[VRC7_CHUNK];
+   uint32 pos, c;
+   int32 a, b;
+   int num, need, i, ch;
+
+   while (count > 0)
+   {
+      /* as many output samples as a chunk of chip samples covers */
+      num = ((VRC7_CHUNK << 16) - opll->pos) / opll->step;
+      if (num > count)
+         num = count;
+      need = (opll->pos + num * opll->step) >> 16;
+
+      /* tremolo: a 210 step triangle, 0-13 envelope steps deep */
+      for (i = 0; i < need; i++)
       {
-      case 0x00: /* User instrument registers */
-         switch (opll->latch & 0x0F)
-         {
-         case 0x00: /* Misc. ctrl. (modulator) */
-         case 0x01: /* Misc. ctrl. (carrier) */
-         case 0x02: /* Key scale level and total level (modulator) */
-         case 0x04: /* Attack / Decay (modulator) */
-         case 0x05: /* Attack / Decay (carrier) */
-         case 0x06: /* Sustain / Release (modulator) */
-         case 0x07: /* Sustain / Release (carrier) */
-            opll->user[(opll->latch & 0x07)] = data;
-            break;
-    
-         case 0x03: /* Key scale level, carrier/modulator waveform, feedback */
-    
-            /* Key scale level (carrier) */
-            /* Don't touch the total level (channel volume) */
-            opll->user[3] = (opll->user[3] & 0x3F) | (data & 0xC0);
-    
-            /* Waveform select for the modulator */
-            opll->user[8] = (data >> 3) & 1;
-    
-            /* Waveform select for the carrier */
-            opll->user[9] = (data >> 4) & 1;
-    
-            /* Store feedback level in YM3812 format */
-            opll->user[10] = ((data & 0x07) << 1) & 0x0E;
-            break;
-         }
-    
-         /* If the user instrument registers were accessed, then
-            go through each channel and update the ones that were
-            currently using the user instrument. We can skip the
-            last three channels in rhythm mode since they can
-            only use percussion sounds anyways. */
-         if (opll->latch <= 0x05)
-         {
-            uint8 x;
-
-            for (x = 0; x < 6; x++)
-               if (opll->channel[x].instrument == 0x00)
-                  load_instrument(x, 0x00, opll->channel[x].volume);
-         }
-         break;
-    
-      case 0x10: /* Channel Frequency (LSB) */
-      case 0x20: /* Channel Frequency (MSB) + key-on and sustain control */
-         {
-            uint8 block;
-            uint16 frequency;
-            uint8 ch = (opll->latch & 0x0F);
-
-            /* Ensure proper channel range */
-            if (ch > 0x05)
-               break;
- 
-            /* Get VRC7 channel frequency */
-            frequency = ((opll->reg[0x10 + ch] & 0xFF) | ((opll->reg[0x20 + ch] & 0x01) << 8));
-
-            /* Scale 9 bit frequency to 10 bits */
-            frequency = (frequency << 1) & 0x1FFF;
-
-            /* Get VRC7 block */
-            block = (opll->reg[0x20 + ch] >> 1) & 7;
-
-            /* Add in block */
-            frequency |= (block << 10);
-
-            /* Add key-on flag */
-            if (opll->reg[0x20 + ch] & 0x10)
-               frequency |= 0x2000;
-
-            /* Save current frequency/block/key-on setting */
-            opll->channel[ch].frequency = (frequency & 0x3FFF);
-
-            /* Write changes to YM3812 */
-            OPL_WRITE(opll, 0xA0 + ch, (opll->channel[ch].frequency >> 0) & 0xFF);
-            OPL_WRITE(opll, 0xB0 + ch, (opll->channel[ch].frequency >> 8) & 0xFF);
-         }
-         break;
-    
-      case 0x30: /* Channel Volume Level and Instrument Select */
-
-         /* Ensure proper channel range */
-         if (opll->latch > 0x35) 
-            break;
-         
-         {
-            uint8 ch = (opll->latch & 0x0F);
-            uint8 inst = (data >> 4) & 0x0F;
-            uint8 vol = (data & 0x0F) << 2;
-            load_instrument(ch, inst, vol);
-         }
-
-         break;
+         c = ((opll->counter + i) >> 6) % 210;
+         am[i] = ((c < 106) ? c : 210 - c) >> 3;
       }
+
+      chip[0] = opll->prev;
+      chip[1] = opll->cur;
+      memset(chip + 2, 0, need * sizeof(int32));
+      for (ch = 0; ch < 6; ch++)
+         vrc7_channel(opll, ch, chip + 2, need, am);
+      opll->counter += need;
+
+      /* linear interpolation between chip samples */
+      pos = opll->pos;
+      for (i = 0; i < num; i++)
+      {
+         pos += opll->step;
+         a = chip[pos >> 16];
+         b = chip[(pos >> 16) + 1];
+         mix[i] += (a + (((b - a) * (int32) ((pos >> 4) & 0xFFF)) >> 12)) << 1;
+      }
+
+      opll->prev = chip[need];
+      opll->cur = chip[need + 1];
+      opll->pos = pos & 0xFFFF;
+
+      mix += num;
+      count -= num;
    }
-   else /* Register latch */
+}
+
+/* key-on starts both operators' envelopes and phases over */
+static void vrc7_key(vrc7_t *opll, int ch, boolean on)
+{
+   int k;
+
+   for (k = 0; k < 2; k++)
+   {
+      vrc7slot_t *slot = &opll->slot[ch][k];
+
+      if (on)
+      {
+         slot->eg_state = VRC7_ATTACK;
+         slot->phase = 0;
+      }
+      else
+      {
+         slot->eg_state = VRC7_RELEASE;
+      }
+   }
+}
+
+static void vrc7_write(void *userdata, uint32 address, uint8 data)
+{
+   /* Point to current VRC7 context */
+   vrc7_t *opll = (vrc7_t *) userdata;
+   uint8 old;
+   int ch;
+
+   if (0 == (address & 0x0020)) /* Register latch */
    {
       opll->latch = (data & 0x3F);
+      return;
    }
+
+   /* data port: everything else is read from the registers as it's used */
+   old = opll->reg[opll->latch];
+   opll->reg[opll->latch] = data;
+
+   ch = opll->latch & 0x0F;
+   if (0x20 == (opll->latch & 0x30) && ch < 6 && ((old ^ data) & 0x10))
+      vrc7_key(opll, ch, (data & 0x10) ? TRUE : FALSE);
 }
 
-static int32 vrc7_process(void)
+static void vrc7_reset(void *ext)
 {
-   static int sample = 0;
+   vrc7_t *opll = (vrc7_t *) ext;
+   uint32 step = opll->step;
+   int ch, k;
 
-   /* update a large chunk at once */
-   if (sample >= buflen)
+   memset(opll, 0, sizeof(vrc7_t));
+   opll->step = step;
+
+   for (ch = 0; ch < 6; ch++)
    {
-      sample -= buflen;
-      YM3812UpdateOne(vrc7.ym3812, buffer, buflen);
+      for (k = 0; k < 2; k++)
+      {
+         opll->slot[ch][k].eg_state = VRC7_RELEASE;
+         opll->slot[ch][k].env = 127;
+      }
    }
+}
+
+static void *vrc7_init(apu_t *apu)
+{
+   vrc7_t *opll;
 
-   return (int32) ((int16 *) buffer)[sample++];
+   opll = malloc(sizeof(vrc7_t));
+   if (NULL == opll)
+      return NULL;
+   memset(opll, 0, sizeof(vrc7_t));
+
+   /* 3579545 / 72 = 49715 + 65/72 chip samples a second */
+   opll->step = (49715 * 65536u + (65 * 65536u) / 72) / apu->sample_rate;
+
+   vrc7_reset(opll);
+   return opll;
+}
+
+static void vrc7_shutdown(void *ext)
+{
+   free(ext);
 }
 
 static apu_memwrite vrc7_memwrite[] =
@@ -316,9 +508,14 @@ apuext_t vrc7_ext =
    vrc7_init,
    vrc7_shutdown,
    vrc7_reset,
-   vrc7_process,
+   NULL, /* see vrc7_process_block */
    NULL, /* no reads */
-   vrc7_memwrite
+   vrc7_memwrite,
+   sizeof(vrc7_t),
+   NULL, /* plain copies */
+   NULL,
+   vrc7_process_block,
+   NULL  /* one mode */
 };
 
 /*
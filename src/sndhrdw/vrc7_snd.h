@@ -28,27 +28,35 @@
 #ifndef _VRC7_SND_H_
 #define _VRC7_SND_H_
 
-#include "fmopl.h"
+#include "nes_apu.h"
+
+/* chip samples rendered at once, before resampling to the output rate */
+#define  VRC7_CHUNK     512
+
+/* one operator: a channel's modulator or carrier */
+typedef struct vrc7slot_s
+{
+   uint32 phase;           /* 19 bits, the top 10 index the sine */
+   int eg_state;           /* attack, decay, sustain or release */
+   int env;                /* attenuation, 0-127 in 0.375dB steps */
+   int32 out[2];           /* last two outputs, for feedback */
+} vrc7slot_t;
 
 /* VRC7 context */
 typedef struct vrc7_s
 {
-   uint8 reg[0x40];        /* 64 registers */
+   uint8 reg[0x40];        /* 64 registers, $00-$07 the user instrument */
    uint8 latch;            /* Register latch */
-   uint8 user[0x10];       /* User instrument settings */
-   struct
-   {
-      uint16 frequency;    /* Channel frequency */
-      uint8 volume;        /* Channel volume */
-      uint8 instrument;    /* Channel instrument */
-   } channel[9];
+   vrc7slot_t slot[6][2];  /* modulator, carrier for each channel */
+   uint32 counter;         /* chip samples, times the envelopes and lfos */
 
-   FM_OPL *ym3812;
+   /* the chip runs at 3.58MHz / 72; step is chip samples per output
+   ** sample and pos how far past prev the next output is, both 16.16
+   */
+   uint32 step, pos;
+   int32 prev, cur;
 } vrc7_t;
 
-
-#include "nes_apu.h"
-
 extern apuext_t vrc7_ext;
 
 #endif /* !_VRC7_SND_H_ */
@@ -23,23 +23,21 @@
 ** $Id: vrcvisnd.c,v 1.1 2003/04/08 20:53:01 ben Exp $
 */
 
+#include <string.h>
 #include "types.h"
 #include "vrcvisnd.h"
 #include "nes_apu.h"
 
 
-static vrcvisnd_t vrcvi;
-static int32 vrcvi_incsize;
-
 /* VRCVI rectangle wave generation */
-static int32 vrcvi_rectangle(vrcvirectangle_t *chan)
+static int32 vrcvi_rectangle(vrcvisnd_t *vrcvi, vrcvirectangle_t *chan)
 {
    /* reg0: 0-3=volume, 4-6=duty cycle
    ** reg1: 8 bits of freq
    ** reg2: 0-3=high freq, 7=enable
    */
 
-   chan->phaseacc -= vrcvi_incsize; /* # of clocks per wave cycle */
+   chan->phaseacc -= vrcvi->incsize; /* # of clocks per wave cycle */
    while (chan->phaseacc < 0)
    {
       chan->phaseacc += chan->freq;
@@ -57,14 +55,14 @@ static int32 vrcvi_rectangle(vrcvirectangle_t *chan)
 }
 
 /* VRCVI sawtooth wave generation */
-static int32 vrcvi_sawtooth(vrcvisawtooth_t *chan)
+static int32 vrcvi_sawtooth(vrcvisnd_t *vrcvi, vrcvisawtooth_t *chan)
 {
    /* reg0: 0-5=phase accumulator bits
    ** reg1: 8 bits of freq
    ** reg2: 0-3=high freq, 7=enable
    */
 
-   chan->phaseacc -= vrcvi_incsize; /* # of clocks per wav cycle */
+   chan->phaseacc -= vrcvi->incsize; /* # of clocks per wav cycle */
    while (chan->phaseacc < 0)
    {
       chan->phaseacc += chan->freq;
@@ -85,20 +83,22 @@ static int32 vrcvi_sawtooth(vrcvisawtooth_t *chan)
 }
 
 /* mix vrcvi sound channels together */
-static int32 vrcvi_process(void)
+static int32 vrcvi_process(void *ext)
 {
+   vrcvisnd_t *vrcvi = (vrcvisnd_t *) ext;
    int32 output;
 
-   output = vrcvi_rectangle(&vrcvi.rectangle[0]);
-   output += vrcvi_rectangle(&vrcvi.rectangle[1]);
-   output += vrcvi_sawtooth(&vrcvi.saw);
+   output = vrcvi_rectangle(vrcvi, &vrcvi->rectangle[0]);
+   output += vrcvi_rectangle(vrcvi, &vrcvi->rectangle[1]);
+   output += vrcvi_sawtooth(vrcvi, &vrcvi->saw);
 
    return output;
 }
 
 /* write to registers */
-static void vrcvi_write(uint32 address, uint8 value)
+static void vrcvi_write(void *userdata, uint32 address, uint8 value)
 {
+   vrcvisnd_t *vrcvi = (vrcvisnd_t *) userdata;
    int chan;
 
    switch (address & 0xB003)
@@ -106,35 +106,35 @@ static void vrcvi_write(uint32 address, uint8 value)
    case 0x9000:
    case 0xA000:
       chan = (address >> 12) - 9;
-      vrcvi.rectangle[chan].reg[0] = value;
-      vrcvi.rectangle[chan].volume = (value & 0x0F) << 8;
-      vrcvi.rectangle[chan].duty_flip = (value >> 4) + 1;
+      vrcvi->rectangle[chan].reg[0] = value;
+      vrcvi->rectangle[chan].volume = (value & 0x0F) << 8;
+      vrcvi->rectangle[chan].duty_flip = (value >> 4) + 1;
       break;
    case 0x9001:
    case 0xA001:
       chan = (address >> 12) - 9;
-      vrcvi.rectangle[chan].reg[1] = value;
-      vrcvi.rectangle[chan].freq = APU_TO_FIXED(((vrcvi.rectangle[chan].reg[2] & 0x0F) << 8) + value + 1);
+      vrcvi->rectangle[chan].reg[1] = value;
+      vrcvi->rectangle[chan].freq = APU_TO_FIXED(((vrcvi->rectangle[chan].reg[2] & 0x0F) << 8) + value + 1);
       break;
    case 0x9002:
    case 0xA002:
       chan = (address >> 12) - 9;
-      vrcvi.rectangle[chan].reg[2] = value;
-      vrcvi.rectangle[chan].freq = APU_TO_FIXED(((value & 0x0F) << 8) + vrcvi.rectangle[chan].reg[1] + 1);
-      vrcvi.rectangle[chan].enabled = (value & 0x80) ? TRUE : FALSE;
+      vrcvi->rectangle[chan].reg[2] = value;
+      vrcvi->rectangle[chan].freq = APU_TO_FIXED(((value & 0x0F) << 8) + vrcvi->rectangle[chan].reg[1] + 1);
+      vrcvi->rectangle[chan].enabled = (value & 0x80) ? TRUE : FALSE;
       break;
    case 0xB000:
-      vrcvi.saw.reg[0] = value;
-      vrcvi.saw.volume = value & 0x3F;
+      vrcvi->saw.reg[0] = value;
+      vrcvi->saw.volume = value & 0x3F;
       break;
    case 0xB001:
-      vrcvi.saw.reg[1] = value;
-      vrcvi.saw.freq = APU_TO_FIXED((((vrcvi.saw.reg[2] & 0x0F) << 8) + value + 1) << 1);
+      vrcvi->saw.reg[1] = value;
+      vrcvi->saw.freq = APU_TO_FIXED((((vrcvi->saw.reg[2] & 0x0F) << 8) + value + 1) << 1);
       break;
    case 0xB002:
-      vrcvi.saw.reg[2] = value;
-      vrcvi.saw.freq = APU_TO_FIXED((((value & 0x0F) << 8) + vrcvi.saw.reg[1] + 1) << 1);
-      vrcvi.saw.enabled = (value & 0x80) ? TRUE : FALSE;
+      vrcvi->saw.reg[2] = value;
+      vrcvi->saw.freq = APU_TO_FIXED((((value & 0x0F) << 8) + vrcvi->saw.reg[1] + 1) << 1);
+      vrcvi->saw.enabled = (value & 0x80) ? TRUE : FALSE;
       break;
    default:
       break;
@@ -142,24 +142,37 @@ static void vrcvi_write(uint32 address, uint8 value)
 }
 
 /* reset state of vrcvi sound channels */
-static void vrcvi_reset(void)
+static void vrcvi_reset(void *ext)
 {
    int i;
 
    /* preload regs */
    for (i = 0; i < 3; i++)
    {
-      vrcvi_write(0x9000 + i, 0);
-      vrcvi_write(0xA000 + i, 0);
-      vrcvi_write(0xB000 + i, 0);
+      vrcvi_write(ext, 0x9000 + i, 0);
+      vrcvi_write(ext, 0xA000 + i, 0);
+      vrcvi_write(ext, 0xB000 + i, 0);
    }
+}
+
+static void *vrcvi_init(apu_t *apu)
+{
+   vrcvisnd_t *vrcvi;
+
+   vrcvi = malloc(sizeof(vrcvisnd_t));
+   if (NULL == vrcvi)
+      return NULL;
+   memset(vrcvi, 0, sizeof(vrcvisnd_t));
 
    /* get the phase period from the apu */
-   vrcvi_incsize = apu_getcyclerate();
+   vrcvi->incsize = apu_getcyclerate(apu);
+
+   return vrcvi;
 }
 
-static void vrcvi_dummy(void)
+static void vrcvi_shutdown(void *ext)
 {
+   free(ext);
 }
 
 static apu_memwrite vrcvi_memwrite[] =
@@ -173,12 +186,15 @@ static apu_memwrite vrcvi_memwrite[] =
 
 apuext_t vrcvi_ext =
 {
-   vrcvi_dummy, /* no init */
-   vrcvi_dummy, /* no shutdown */
+   vrcvi_init,
+   vrcvi_shutdown,
    vrcvi_reset,
    vrcvi_process,
    NULL, /* no reads */
-   vrcvi_memwrite
+   vrcvi_memwrite,
+   sizeof(vrcvisnd_t),
+   NULL, /* plain copies */
+   NULL
 };
 
 /*
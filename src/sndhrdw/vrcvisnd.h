@@ -54,6 +54,7 @@ typedef struct vrcvisnd_s
 {
    vrcvirectangle_t rectangle[2];
    vrcvisawtooth_t saw;
+   int32 incsize;
 } vrcvisnd_t;
 
 #include "nes_apu.h"
@@ -58,6 +58,7 @@
 	typedef  unsigned char  uint8;
 	typedef  unsigned short uint16;
 	typedef  unsigned int   uint32;
+	typedef  unsigned long long uint64;
 
 #endif
 